@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "autoindex.h"
+
+static struct autoindex *cache[AUTOINDEX_CACHE_SIZE];
+
+/* Growable output buffer for the listing */
+struct html_buf {
+	char *data;
+	size_t len;
+	size_t cap;
+	int failed;
+};
+
+static void html_append(struct html_buf *b, const char *s, size_t len)
+{
+	char *data;
+	size_t cap;
+
+	if (b->failed)
+		return;
+
+	if (b->len + len > b->cap) {
+		cap = b->cap ? b->cap : 4096;
+		while (cap < b->len + len)
+			cap *= 2;
+		data = realloc(b->data, cap);
+		if (!data) {
+			b->failed = 1;
+			return;
+		}
+		b->data = data;
+		b->cap = cap;
+	}
+
+	memcpy(b->data + b->len, s, len);
+	b->len += len;
+}
+
+static void html_puts(struct html_buf *b, const char *s)
+{
+	html_append(b, s, strlen(s));
+}
+
+// Function to append text with the HTML special characters escaped
+static void html_escape(struct html_buf *b, const char *s)
+{
+	for (; *s; s++) {
+		switch (*s) {
+		case '<':
+			html_puts(b, "&lt;");
+			break;
+		case '>':
+			html_puts(b, "&gt;");
+			break;
+		case '&':
+			html_puts(b, "&amp;");
+			break;
+		case '"':
+			html_puts(b, "&quot;");
+			break;
+		default:
+			html_append(b, s, 1);
+		}
+	}
+}
+
+// Function to append len bytes of a path percent-encoded for use in a link
+static void html_url_n(struct html_buf *b, const char *s, size_t len)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char esc[3] = { '%' };
+
+	for (; len--; s++) {
+		unsigned char c = *s;
+
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		    (c >= '0' && c <= '9') || strchr("-._~/", c)) {
+			html_append(b, s, 1);
+		} else {
+			esc[1] = hex[c >> 4];
+			esc[2] = hex[c & 15];
+			html_append(b, esc, 3);
+		}
+	}
+}
+
+static void html_url(struct html_buf *b, const char *s)
+{
+	html_url_n(b, s, strlen(s));
+}
+
+struct dir_entry {
+	char *name;
+	int is_dir;
+};
+
+static int dir_entry_cmp(const void *a, const void *b)
+{
+	const struct dir_entry *x = a, *y = b;
+
+	// Directories first, then by name
+	if (x->is_dir != y->is_dir)
+		return y->is_dir - x->is_dir;
+
+	return strcmp(x->name, y->name);
+}
+
+// Function to read the visible entries of a directory
+static struct dir_entry *read_entries(int dirfd, size_t *count)
+{
+	struct dir_entry *entries = NULL, *grown;
+	size_t n = 0, cap = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	int fd;
+
+	// closedir() closes the fd, the caller keeps its own
+	fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return NULL;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		// Hidden files, "." and ".." are not listed
+		if (de->d_name[0] == '.')
+			continue;
+
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			grown = realloc(entries, cap * sizeof(*entries));
+			if (!grown)
+				goto fail;
+			entries = grown;
+		}
+
+		entries[n].name = strdup(de->d_name);
+		if (!entries[n].name)
+			goto fail;
+		if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK)
+			entries[n].is_dir = fstatat(dirfd, de->d_name, &st, 0) == 0 &&
+					    S_ISDIR(st.st_mode);
+		else
+			entries[n].is_dir = de->d_type == DT_DIR;
+		n++;
+	}
+	closedir(dir);
+
+	*count = n;
+	// A directory may well be empty
+	return entries ? entries : calloc(1, sizeof(*entries));
+
+fail:
+	while (n)
+		free(entries[--n].name);
+	free(entries);
+	closedir(dir);
+	errno = ENOMEM;
+	return NULL;
+}
+
+// Function to render the listing of a directory
+static struct autoindex *autoindex_create(int dirfd, const struct stat *st, const char *path)
+{
+	struct html_buf b = { 0 };
+	struct dir_entry *entries;
+	struct autoindex *index;
+	size_t count, i, len, parent;
+
+	entries = read_entries(dirfd, &count);
+	if (!entries)
+		return NULL;
+	qsort(entries, count, sizeof(*entries), dir_entry_cmp);
+
+	html_puts(&b, "<html><head><title>Index of ");
+	html_escape(&b, path);
+	html_puts(&b, "</title></head><body><h1>Index of ");
+	html_escape(&b, path);
+	html_puts(&b, "</h1><hr><pre>\n");
+
+	// Links are absolute, the directory may be requested without its trailing slash
+	len = strlen(path);
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+	if (len > 1) {
+		for (parent = len - 1; path[parent] != '/'; parent--)
+			;
+		html_puts(&b, "<a href=\"");
+		html_url_n(&b, path, parent + 1);
+		html_puts(&b, "\">../</a>\n");
+	}
+
+	for (i = 0; i < count; i++) {
+		html_puts(&b, "<a href=\"");
+		html_url_n(&b, path, len);
+		if (len > 1)
+			html_puts(&b, "/");
+		html_url(&b, entries[i].name);
+		if (entries[i].is_dir)
+			html_puts(&b, "/");
+		html_puts(&b, "\">");
+		html_escape(&b, entries[i].name);
+		if (entries[i].is_dir)
+			html_puts(&b, "/");
+		html_puts(&b, "</a>\n");
+		free(entries[i].name);
+	}
+	free(entries);
+	html_puts(&b, "</pre><hr></body></html>\n");
+
+	index = calloc(1, sizeof(*index));
+	if (b.failed || !index)
+		goto fail;
+	index->path = strdup(path);
+	if (!index->path)
+		goto fail;
+
+	index->dev = st->st_dev;
+	index->ino = st->st_ino;
+	index->mtime = st->st_mtim;
+	index->html = b.data;
+	index->len = b.len;
+	index->refs = 1;
+
+	return index;
+
+fail:
+	free(index);
+	free(b.data);
+	errno = ENOMEM;
+	return NULL;
+}
+
+static size_t autoindex_slot(const struct stat *st, const char *path)
+{
+	uint64_t hash = (uint64_t)st->st_dev * 31 + st->st_ino;
+
+	while (*path)
+		hash = hash * 31 + (unsigned char)*path++;
+
+	return hash % AUTOINDEX_CACHE_SIZE;
+}
+
+struct autoindex *autoindex_get(int dirfd, const struct stat *st, const char *path)
+{
+	size_t slot = autoindex_slot(st, path);
+	struct autoindex *index = cache[slot];
+
+	if (index && index->dev == st->st_dev && index->ino == st->st_ino &&
+	    index->mtime.tv_sec == st->st_mtim.tv_sec &&
+	    index->mtime.tv_nsec == st->st_mtim.tv_nsec && !strcmp(index->path, path)) {
+		index->refs++;
+		return index;
+	}
+
+	index = autoindex_create(dirfd, st, path);
+	if (!index)
+		return NULL;
+
+	// Replies still sending the previous listing keep it alive
+	if (cache[slot])
+		autoindex_put(cache[slot]);
+	cache[slot] = index;
+	index->refs++;
+
+	return index;
+}
+
+void autoindex_put(struct autoindex *index)
+{
+	if (!index || --index->refs > 0)
+		return;
+
+	free(index->path);
+	free(index->html);
+	free(index);
+}
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef AUTOINDEX_H_
+#define AUTOINDEX_H_	1
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Generated listings kept around, direct mapped by directory and path */
+#define AUTOINDEX_CACHE_SIZE	64
+
+/* HTML listing of a directory, shared by every reply that sends it */
+struct autoindex {
+	dev_t dev;
+	ino_t ino;
+	/* mtime of the directory when it was listed */
+	struct timespec mtime;
+	/* request path the links are relative to */
+	char *path;
+	char *html;
+	size_t len;
+	/* the cache holds one reference while the entry is current */
+	int refs;
+};
+
+/*
+ * Listing of the directory open on dirfd, whose fstat() result is st, as
+ * seen under the request path. The cached listing is reused until the
+ * directory mtime changes, so only entries added, removed or renamed
+ * trigger a new scan. Takes a reference; returns NULL and sets errno on
+ * failure.
+ */
+struct autoindex *autoindex_get(int dirfd, const struct stat *st, const char *path);
+
+/* Drop a reference taken by autoindex_get() */
+void autoindex_put(struct autoindex *index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AUTOINDEX_H_ */
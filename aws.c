@@ -1,17 +1,22 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libaio.h>
 #include <netinet/in.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -19,6 +24,17 @@
 #include <time.h>
 
 #include "aws.h"
+#include "config.h"
+#include "etag.h"
+#include "fswatch.h"
+#include "http2.h"
+#include "metaindex.h"
+#include "prewarm.h"
+#include "response.h"
+#include "shmcache.h"
+#include "sockprofile.h"
+#include "treewalk.h"
+#include "zerocopy.h"
 #include "utils/debug.h"
 #include "utils/sock_util.h"
 #include "utils/util.h"
@@ -32,6 +48,23 @@ static int epollfd;
 
 static io_context_t ctx;
 
+/* inotify watches invalidating the file caches, fd is -1 without them */
+static struct fs_watch watch = { .fd = -1 };
+
+/* file metadata saved by the previous run, empty without one */
+static struct metaindex file_index;
+
+/* SIGINT and SIGTERM, read by the loop to stop cleanly */
+static int sigfd = -1;
+
+/* results of the etag threads, -1 unless ETags are hashed */
+static int etagfd = -1;
+
+/* listener settings, sites and their routing tables */
+static struct server_config config;
+
+struct server_stats server_stats;
+
 int min_num(int a, int b) { return a < b ? a : b; }
 
 static int aws_on_path_cb(http_parser *p, const char *buf, size_t len)
@@ -45,100 +78,324 @@ static int aws_on_path_cb(http_parser *p, const char *buf, size_t len)
 	return 0;
 }
 
-// Function to format the date
-void format_date(time_t time, char *buf, size_t size)
+static int aws_on_url_cb(http_parser *p, const char *buf, size_t len)
 {
-	struct tm tm;
+	struct connection *conn = (struct connection *)p->data;
+
+	(void)buf;
 
-	strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&time, &tm));
+	// Stop parsing, the URI is answered with 414
+	if (len > AWS_MAX_URI_LEN) {
+		conn->status = 414;
+		return 1;
+	}
+
+	return 0;
 }
 
-// Function to get the last modified date
-int last_mod_date(const char *path, char *buf, size_t size)
+static int aws_on_header_field_cb(http_parser *p, const char *buf, size_t len)
 {
-	struct stat file_stat;
+	struct connection *conn = (struct connection *)p->data;
 
-	if (stat(path, &file_stat) == 0) {
-		format_date(file_stat.st_mtime, buf, size);
-		return 0;
-	}
-	return -1;
+	conn->in_host_header = len == 4 && !strncasecmp(buf, "Host", 4);
+
+	return 0;
+}
+
+static int aws_on_header_value_cb(http_parser *p, const char *buf, size_t len)
+{
+	struct connection *conn = (struct connection *)p->data;
+
+	// The site is picked as soon as its Host field is seen
+	if (conn->in_host_header)
+		conn->site = resolve_site(buf, len);
+
+	return 0;
+}
+
+static int aws_on_body_cb(http_parser *p, const char *buf, size_t len)
+{
+	struct connection *conn = (struct connection *)p->data;
+
+	// The whole body is in recv_buffer, so it arrives in one piece
+	if (!conn->body)
+		conn->body = buf;
+	conn->body_len += len;
+
+	return 0;
+}
+
+static int aws_on_message_complete_cb(http_parser *p)
+{
+	struct connection *conn = (struct connection *)p->data;
+
+	conn->message_complete = 1;
+
+	return 0;
+}
+
+static int aws_on_headers_complete_cb(http_parser *p)
+{
+	struct connection *conn = (struct connection *)p->data;
+
+	// content_length stays at -1 when the header is absent
+	if (p->content_length != (size_t)-1 && p->content_length > AWS_MAX_REQUEST_BODY)
+		conn->status = 413;
+
+	return 0;
+}
+
+// Function to check whether the file is sent from the cached contents
+static int connection_in_memory(const struct connection *conn)
+{
+	return conn->file && conn->file->data;
+}
+
+// Function to check whether the body was generated into the send buffer
+static int connection_generated(const struct connection *conn)
+{
+	return !conn->file && !conn->listing && !conn->sse &&
+	       conn->file_size != RESPONSE_NO_LENGTH;
 }
 
 // Function to prepare the header for the response
 static void connection_prepare_send_reply_header(struct connection *conn)
 {
-	char date[50];
-	char last_modified_date[50];
-	time_t now = time(NULL);
-
 	if (!conn)
 		return;
 
-	// Get current date
-	format_date(now, date, sizeof(date));
-	// Get the last modified date
-	if (last_mod_date(conn->filename, last_modified_date, sizeof(last_modified_date)) == -1) {
-		perror("last_modified_date");
-		return;
-	}
+	// Splice Date and Content-Length into the pre-rendered fragments
+	response_header_build(&conn->reply, &conn->file_hdr, &conn->route->cache,
+			      conn->file_size);
+
+	// Bodies held in memory go out with the header in one writev()
+	conn->coalesced = 1;
+	if (conn->head_only || conn->file_size == 0)
+		;
+	else if (connection_in_memory(conn))
+		response_header_body(&conn->reply, conn->file->data, conn->file_size);
+	else if (conn->listing)
+		response_header_body(&conn->reply, conn->listing->html, conn->file_size);
+	else if (connection_generated(conn))
+		response_header_body(&conn->reply, conn->send_buffer, conn->send_len);
+	else
+		conn->coalesced = 0;
+	server_stats_response(200);
+}
 
-	// Create the header
-	const char *header_fmt = "HTTP/1.1 200 OK\r\n"
-							 "Date: %s\r\n"
-							 "Server: Apache/2.2.9\r\n"
-							 "Last-Modified: %s\r\n"
-							 "Accept-Ranges: bytes\r\n"
-							 "Vary: Accept-Encoding\r\n"
-							 "Connection: close\r\n"
-							 "Content-Type: text/html\r\n"
-							 "Content-Length: %ld\r\n\r\n";
+// Function to send the reply header, then close or go on with the body
+static void connection_send_header(struct connection *conn)
+{
+	int flags = 0;
 
-	// Clear the buffer
-	memset(conn->send_buffer, 0, BUFSIZ);
-	// Write the header in the buffer
-	snprintf(conn->send_buffer, BUFSIZ, header_fmt, date, last_modified_date, conn->file_size);
-	conn->send_len = strlen(conn->send_buffer);
+	// sendfile() and zerocopy bodies follow at once: hold the header for them
+	if (!conn->coalesced && (conn->zerocopy || conn->res_type == RESOURCE_TYPE_STATIC))
+		flags = MSG_MORE;
+
+	if (response_header_send(conn->sockfd, &conn->reply, flags) == -1)
+		conn->state = STATE_CONNECTION_CLOSED;
+	else if (response_header_pending(&conn->reply) == 0)
+		conn->state = conn->coalesced ? STATE_CONNECTION_CLOSED : STATE_SENDING_DATA;
 }
 
-// Function to prepare send 404
-static void connection_prepare_send_404(struct connection *conn)
+// Function to prepare one of the pre-rendered error responses
+static void connection_prepare_send_error(struct connection *conn, int status)
 {
 	if (!conn)
 		return;
 
-	// Create the header
-	const char *header_fmt = "HTTP/1.1 404 Not Found\r\n"
-							 "Content-Type: text/html\r\n"
-							 "Connection: close\r\n"
-							 "\r\n";
+	conn->status = status;
+	response_error_build(&conn->reply, status, conn->head_only);
+	server_stats_response(status);
+	conn->state = STATE_SENDING_ERROR;
+}
 
-	// Clear the buffer
-	memset(conn->send_buffer, 0, BUFSIZ);
-	// Write the header in the buffer
-	snprintf(conn->send_buffer, BUFSIZ, "%s", header_fmt);
-	conn->send_len = strlen(conn->send_buffer);
+// Function to check whether a path contains a ".." segment
+static int path_has_dotdot(const char *path)
+{
+	const char *p = path;
+
+	while ((p = strstr(p, "..")) != NULL) {
+		if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/'))
+			return 1;
+		p += 2;
+	}
+
+	return 0;
+}
+
+// Function to find the site serving a Host value
+const struct site *resolve_site(const char *host, size_t len)
+{
+	return vhost_lookup(&config.hosts, host, len);
+}
+
+// Function to map a request path to its route and file name
+const struct route *resolve_route(const struct site *site, const char *path,
+				  char *filename, size_t size)
+{
+	const struct route *route;
+	size_t matched;
+	int len;
+
+	if (!site)
+		return NULL;
+
+	route = router_match(&site->router, path, &matched);
+	if (!route || path_has_dotdot(path + matched))
+		return NULL;
+
+	if (route->type == RESOURCE_TYPE_STATUS) {
+		filename[0] = '\0';
+		return route;
+	}
+
+	// The rest of the path is relative to the directory of the route,
+	// itself relative to the document root of the site
+	path += matched;
+	while (*path == '/')
+		path++;
+	len = snprintf(filename, size, "%s%s", route->dir, path);
+	if (len == 0)
+		len = snprintf(filename, size, ".");
+	if (len < 0 || (size_t)len >= size)
+		return NULL;
+
+	return route;
+}
+
+// Function to render the counters served by status routes
+size_t server_stats_render(char *buf, size_t size)
+{
+	int len;
+
+	len = snprintf(buf, size,
+		       "connections_accepted %lu\n"
+		       "connections_active %lu\n"
+		       "tfo_accepts %lu\n"
+		       "requests %lu\n"
+		       "h2_sessions %lu\n"
+		       "sse_subscribers %lu\n"
+		       "sse_events %lu\n"
+		       "sse_overflows %lu\n"
+		       "fd_cache_hits %lu\n"
+		       "fd_cache_misses %lu\n"
+		       "fd_cache_negative_hits %lu\n"
+		       "fd_cache_bytes %lu\n"
+		       "fd_cache_mapped %lu\n"
+		       "zerocopy_sends %lu\n"
+		       "zerocopy_copied %lu\n"
+		       "zerocopy_fallbacks %lu\n"
+		       "metaindex_hits %lu\n"
+		       "metaindex_misses %lu\n"
+		       "etag_hashes %lu\n"
+		       "shmcache_hits %lu\n"
+		       "shmcache_fills %lu\n"
+		       "shmcache_busy %lu\n"
+		       "fs_events %lu\n"
+		       "fs_overflows %lu\n"
+		       "responses_2xx %lu\n"
+		       "responses_3xx %lu\n"
+		       "responses_4xx %lu\n"
+		       "responses_5xx %lu\n",
+		       server_stats.connections_accepted,
+		       server_stats.connections_active,
+		       server_stats.tfo_accepts,
+		       server_stats.requests,
+		       server_stats.h2_sessions,
+		       server_stats.sse_subscribers,
+		       server_stats.sse_events,
+		       server_stats.sse_overflows,
+		       server_stats.fd_cache_hits,
+		       server_stats.fd_cache_misses,
+		       server_stats.fd_cache_negative_hits,
+		       server_stats.fd_cache_bytes,
+		       server_stats.fd_cache_mapped,
+		       server_stats.zerocopy_sends,
+		       server_stats.zerocopy_copied,
+		       server_stats.zerocopy_fallbacks,
+		       server_stats.metaindex_hits,
+		       server_stats.metaindex_misses,
+		       server_stats.etag_hashes,
+		       server_stats.shmcache_hits,
+		       server_stats.shmcache_fills,
+		       server_stats.shmcache_busy,
+		       server_stats.fs_events,
+		       server_stats.fs_overflows,
+		       server_stats.responses[2], server_stats.responses[3],
+		       server_stats.responses[4], server_stats.responses[5]);
+	if (len < 0)
+		return 0;
+	if ((size_t)len >= size)
+		return size - 1;
+
+	// What the kernel made of the socket profile of the listener
+	return len + sock_profile_report(listenfd, config.listen_profile, buf + len, size - len);
 }
 
-// Function to get the type of the resource
+// Function to bound the unsent bytes the kernel queues for the connection
+static void connection_set_lowat(struct connection *conn, unsigned int bytes)
+{
+	if (!bytes || bytes == conn->notsent_lowat)
+		return;
+	if (tcp_set_notsent_lowat(conn->sockfd, bytes) == 0)
+		conn->notsent_lowat = bytes;
+}
+
+// Function to route the request path of the connection
 static enum resource_type
 connection_get_resource_type(struct connection *conn)
 {
 	if (!conn)
 		return RESOURCE_TYPE_NONE;
 
-	// If the request path contains the static folder
-	if (strstr(conn->request_path, AWS_REL_STATIC_FOLDER)) {
-		conn->filename[0] = '.';
-		strcat(conn->filename, conn->request_path);
-		return RESOURCE_TYPE_STATIC;
-		// If the request path contains the dynamic folder
-	} else if (strstr(conn->request_path, AWS_REL_DYNAMIC_FOLDER)) {
-		conn->filename[0] = '.';
-		strcat(conn->filename, conn->request_path);
-		return RESOURCE_TYPE_DYNAMIC;
-	}
-	return RESOURCE_TYPE_NONE;
+	conn->route = resolve_route(conn->site, conn->request_path, conn->filename,
+				    sizeof(conn->filename));
+	if (conn->route)
+		connection_set_lowat(conn, conn->route->notsent_lowat);
+
+	return conn->route ? conn->route->type : RESOURCE_TYPE_NONE;
+}
+
+// Function to prepare the body of a status route
+static void connection_prepare_status(struct connection *conn)
+{
+	conn->send_len = server_stats_render(conn->send_buffer, sizeof(conn->send_buffer));
+	conn->send_pos = 0;
+	conn->file_size = conn->send_len;
+	response_generated_headers(&conn->file_hdr, "text/plain");
+}
+
+// Function to subscribe the connection to the hub of its events route
+static int connection_subscribe(struct connection *conn)
+{
+	// HEAD only gets the header, there is nothing to subscribe to
+	if (!conn->head_only && sse_subscribe(conn->route->hub, conn) < 0)
+		return -1;
+
+	conn->file_size = RESPONSE_NO_LENGTH;
+	response_generated_headers(&conn->file_hdr, "text/event-stream");
+
+	return 0;
+}
+
+// Function to publish the request body and report how many subscribers got it
+static int connection_publish(struct connection *conn)
+{
+	long queued;
+
+	queued = sse_publish(conn->route->hub, epollfd, conn->body ? conn->body : "",
+			     conn->body_len);
+	if (queued < 0)
+		return -1;
+
+	conn->send_len = snprintf(conn->send_buffer, sizeof(conn->send_buffer),
+				  "queued %ld\n", queued);
+	conn->send_pos = 0;
+	conn->file_size = conn->send_len;
+	response_generated_headers(&conn->file_hdr, "text/plain");
+
+	return 0;
 }
 
 // Function to create a new connection
@@ -158,6 +415,8 @@ struct connection *connection_create(int sockfd)
 	conn->state = STATE_INITIAL;
 	conn->fd = -1;
 	conn->eventfd = -1;
+	// Requests without a Host field go to the default site
+	conn->site = config.hosts.default_site;
 	memset(conn->send_buffer, 0, BUFSIZ);
 	memset(conn->recv_buffer, 0, BUFSIZ);
 	memset(conn->request_path, 0, BUFSIZ);
@@ -165,6 +424,17 @@ struct connection *connection_create(int sockfd)
 	return conn;
 }
 
+// Function to pick the buffer the next dynamic chunk is read into
+static char *connection_read_buffer(struct connection *conn, size_t *size)
+{
+	if (conn->zc_ring) {
+		*size = ZEROCOPY_CHUNK;
+		return conn->zc_ring->buf[conn->zc_ring->head];
+	}
+	*size = BUFSIZ;
+	return conn->send_buffer;
+}
+
 // Function to start the async io
 void connection_start_async_io(struct connection *conn)
 {
@@ -177,7 +447,9 @@ void connection_start_async_io(struct connection *conn)
 	conn->eventfd = eventfd(0, EFD_NONBLOCK);
 	memset(&conn->iocb, 0, sizeof(conn->iocb));
 	// Calculate the size to read
-	int read_size = min_num(BUFSIZ, conn->file_size - conn->file_pos);
+	size_t buf_size;
+	char *buf = connection_read_buffer(conn, &buf_size);
+	int read_size = min_num(buf_size, conn->file_size - conn->file_pos);
 
 	conn->send_len = read_size;
 	if (conn->fd < 0)
@@ -187,7 +459,7 @@ void connection_start_async_io(struct connection *conn)
 	// Create the context
 	rc = io_setup(1, &ctx);
 	// Prepare the read
-	io_prep_pread(&conn->iocb, conn->fd, conn->send_buffer, read_size,
+	io_prep_pread(&conn->iocb, conn->fd, buf, read_size,
 				  conn->file_pos);
 	io_set_eventfd(&conn->iocb, conn->eventfd);
 	conn->piocb[0] = &conn->iocb;
@@ -206,11 +478,13 @@ void connection_continue_async_io(struct connection *conn)
 	if (!conn)
 		return;
 	// Calculate the size to read
-	int read_size = min_num(BUFSIZ, conn->file_size - conn->file_pos);
+	size_t buf_size;
+	char *buf = connection_read_buffer(conn, &buf_size);
+	int read_size = min_num(buf_size, conn->file_size - conn->file_pos);
 
 	conn->send_len = read_size;
 	// Prepare the read
-	io_prep_pread(&conn->iocb, conn->fd, conn->send_buffer, read_size,
+	io_prep_pread(&conn->iocb, conn->fd, buf, read_size,
 				  conn->file_pos);
 	io_set_eventfd(&conn->iocb, conn->eventfd);
 	conn->piocb[0] = &conn->iocb;
@@ -258,25 +532,36 @@ void connection_remove(struct connection *conn)
 		w_epoll_remove_fd(epollfd, conn->sockfd);
 		close(conn->sockfd);
 	}
-	// If fd is valid, close it
-	if (conn->fd >= 0)
-		close(conn->fd);
+	// The file stays open in the cache for the next request
+	fdcache_put(conn->file);
 	// If eventfd is not unll, close it
 	if (conn->eventfd >= 0)
 		close(conn->eventfd);
 	// If ctx is not null, destroy it
 	if (conn->ctx)
 		io_destroy(conn->ctx);
+	zerocopy_ring_free(conn->zc_ring);
+	// Drop the reference on a directory listing
+	autoindex_put(conn->listing);
+	// Leave the hub, releasing the queued events
+	if (conn->sse)
+		sse_unsubscribe(conn->sse);
+	// If the connection was upgraded to HTTP/2, tear down the session
+	if (conn->h2)
+		http2_session_destroy(conn->h2);
+	server_stats.connections_active--;
 	// Free memory
 	free(conn);
 }
 
 void handle_new_connection(void)
 {
+	const struct sock_profile *profile = config.listen_profile;
 	struct sockaddr_in add;
 	socklen_t addlen = sizeof(add);
 	int new_sockfd;
 	struct connection *conn;
+	int read_now;
 	int rc;
 
 	// Accept the new connection
@@ -295,49 +580,163 @@ void handle_new_connection(void)
 		return;
 	}
 
+	server_stats.connections_accepted++;
+	server_stats.connections_active++;
+
+	// Writes then follow the peer: EPOLLOUT only once the backlog drained
+	connection_set_lowat(conn, config.notsent_lowat);
+	sock_profile_accepted(new_sockfd, config.listen_profile);
+
 	// Add the connection to the epoll
 	rc = w_epoll_add_ptr_in(epollfd, new_sockfd, conn);
 	DIE(rc < 0, "w_epoll_add_in");
 
 	// Initialize the http parser
 	http_parser_init(&conn->request_parser, HTTP_REQUEST);
+
+	// The request is here already if it came with the SYN, or was waited for
+	read_now = (profile->set & SOCKOPT_DEFER_ACCEPT) != 0;
+	if ((profile->set & SOCKOPT_FASTOPEN) && sock_syn_data(new_sockfd)) {
+		server_stats.tfo_accepts++;
+		read_now = 1;
+	}
+	// Read, parse and reply now rather than after another epoll_wait()
+	if (read_now) {
+		conn->state = STATE_RECEIVING_DATA;
+		handle_client(EPOLLIN, conn);
+	}
+}
+
+// Function to find the Content-Length of a request whose header ends at end
+static size_t request_content_length(const char *buf, const char *end)
+{
+	const char *line = buf;
+
+	while ((line = memchr(line, '\n', end - line)) != NULL && ++line < end) {
+		if (end - line > 15 && !strncasecmp(line, "Content-Length:", 15))
+			return strtoul(line + 15, NULL, 10);
+	}
+
+	return 0;
 }
 
 // Function to check if the request is complete
 int is_request_complete(struct connection *conn)
 {
 	const char *end = "\r\n\r\n";
+	const char *header_end;
+
+	if (conn->recv_len < 4)
+		return 0;
+
+	header_end = memmem(conn->recv_buffer, conn->recv_len, end, 4);
+	if (!header_end)
+		return 0;
+	header_end += 4;
+
+	// Wait for the body as well, parse_header() tells what is too big
+	return conn->recv_len - (header_end - conn->recv_buffer) >=
+		request_content_length(conn->recv_buffer, header_end);
+}
+
+int resource_open(const struct site *site, const struct route *route, const char *filename,
+		  const char *path, struct fd_entry **file, struct autoindex **listing)
+{
+	char index[BUFSIZ];
+	struct fd_entry *dir;
+	int err;
+
+	*file = NULL;
+	*listing = NULL;
+
+	// Open the file, relative to the document root of the site
+	dir = fdcache_open(site->root_fd, filename);
+	if (!dir)
+		return response_status_from_errno(errno);
+
+	// A directory is served by its index file or, if allowed, by a listing
+	if (S_ISDIR(dir->st.st_mode)) {
+		snprintf(index, sizeof(index), "%s/" AWS_INDEX_FILE, filename);
+		*file = fdcache_open(site->root_fd, index);
+		if (*file && S_ISREG((*file)->st.st_mode)) {
+			fdcache_put(dir);
+			return 0;
+		}
+		fdcache_put(*file);
+		*file = NULL;
+
+		if (route->autoindex)
+			*listing = autoindex_get(dir->fd, &dir->st, path);
+		err = errno;
+		fdcache_put(dir);
+		if (*listing)
+			return 0;
+
+		return route->autoindex ? response_status_from_errno(err) : 404;
+	}
+
+	// Only regular files can be sent
+	if (!S_ISREG(dir->st.st_mode)) {
+		fdcache_put(dir);
+		return 404;
+	}
+
+	*file = dir;
 
-	if (conn->recv_len >= 4 && strstr(conn->recv_buffer, end) != NULL)
-		return 1;
 	return 0;
 }
 
 int connection_open_file(struct connection *conn)
 {
+	int status;
+
 	if (!conn)
 		return -1;
 
-	// Open the file
-	conn->fd = open(conn->filename, O_RDONLY);
-	if (conn->fd < 0) {
-		perror("open");
+	status = resource_open(conn->site, conn->route, conn->filename, conn->request_path,
+			       &conn->file, &conn->listing);
+	if (status) {
+		conn->status = status;
 		return -1;
 	}
 
-	struct stat buf;
-	// Get the file size
-	if (fstat(conn->fd, &buf) < 0) {
-		perror("fstat");
-		close(conn->fd);
-		conn->fd = -1;
-		return -1;
+	// A listing is sent from memory, whatever the route type
+	if (conn->listing) {
+		conn->file_size = conn->listing->len;
+		response_file_headers(&conn->file_hdr, conn->listing->mtime.tv_sec, "text/html",
+				      NULL);
+		return 0;
 	}
-	conn->file_size = buf.st_size;
+
+	// The per-file headers were rendered when the file was opened
+	conn->fd = conn->file->fd;
+	conn->file_size = conn->file->st.st_size;
+	conn->file_hdr = conn->file->hdr;
+
+	// Files mapped by the cache are sent straight from the page cache
+	conn->zerocopy = conn->file->map && zerocopy_enable(conn->sockfd) == 0;
+
+	// Large dynamic replies are read into pages sent with MSG_ZEROCOPY
+	if (config.zerocopy_min && !conn->zerocopy && !connection_in_memory(conn) &&
+	    conn->res_type == RESOURCE_TYPE_DYNAMIC && !conn->head_only &&
+	    conn->file_size >= config.zerocopy_min && zerocopy_enable(conn->sockfd) == 0)
+		conn->zc_ring = zerocopy_ring_new();
 
 	return 0;
 }
 
+// Function to check if the request line starts with a method token
+static int has_method_token(const char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && buf[i] != ' '; i++)
+		if (buf[i] < 'A' || buf[i] > 'Z')
+			return 0;
+
+	return i > 0 && i < len;
+}
+
 // Function to parse the header
 int parse_header(struct connection *conn)
 {
@@ -345,24 +744,53 @@ int parse_header(struct connection *conn)
 		return -1;
 
 	http_parser_settings settings_on_path = {.on_message_begin = 0,
-											 .on_header_field = 0,
-											 .on_header_value = 0,
+											 .on_header_field = aws_on_header_field_cb,
+											 .on_header_value = aws_on_header_value_cb,
 											 .on_path = aws_on_path_cb,
-											 .on_url = 0,
+											 .on_url = aws_on_url_cb,
 											 .on_fragment = 0,
 											 .on_query_string = 0,
-											 .on_body = 0,
-											 .on_headers_complete = 0,
-											 .on_message_complete = 0};
+											 .on_body = aws_on_body_cb,
+											 .on_headers_complete = aws_on_headers_complete_cb,
+											 .on_message_complete = aws_on_message_complete_cb};
+
+	// If the buffer filled up before the end of the headers
+	if (!memmem(conn->recv_buffer, conn->recv_len, "\r\n\r\n", 4)) {
+		// Either the request line or the header fields are too long
+		if (!memmem(conn->recv_buffer, conn->recv_len, "\r\n", 2))
+			conn->status = 414;
+		else
+			conn->status = 431;
+		return -1;
+	}
 
 	// Set the data to the connection
 	conn->request_parser.data = conn;
 	// Parse the header
 	size_t nparsed = http_parser_execute(&conn->request_parser, &settings_on_path,
 										 conn->recv_buffer, conn->recv_len);
-	// If the parsing failed, return -1
-	if (!conn->have_path || nparsed != conn->recv_len)
+	// If a callback already picked the error, return -1
+	if (conn->status)
+		return -1;
+	// If the parsing failed, tell unknown methods from bad syntax
+	if (!conn->have_path || nparsed != conn->recv_len) {
+		conn->status = has_method_token(conn->recv_buffer, conn->recv_len) &&
+			nparsed <= strcspn(conn->recv_buffer, " ") ? 405 : 400;
 		return -1;
+	}
+
+	// Only GET and HEAD are served, POST is checked against the route
+	conn->head_only = conn->request_parser.method == HTTP_HEAD;
+	if (conn->request_parser.method != HTTP_GET && !conn->head_only &&
+	    conn->request_parser.method != HTTP_POST) {
+		conn->status = 405;
+		return -1;
+	}
+	// The body did not fit in the buffer
+	if (conn->request_parser.method == HTTP_POST && !conn->message_complete) {
+		conn->status = 413;
+		return -1;
+	}
 
 	return 0;
 }
@@ -404,6 +832,95 @@ enum connection_state connection_send_static(struct connection *conn)
 	return STATE_SENDING_DATA;
 }
 
+// Function to send a mapped file with MSG_ZEROCOPY
+static enum connection_state connection_send_mapped(struct connection *conn)
+{
+	const char *buf = conn->file->map + conn->file_pos;
+	size_t len = conn->file_size - conn->file_pos;
+	struct stat st;
+	ssize_t sent;
+
+	// Pages past the end of a truncated file cannot be read
+	if (conn->file->changed &&
+	    (fstat(conn->fd, &st) < 0 || (size_t)st.st_size < conn->file_size))
+		return STATE_CONNECTION_CLOSED;
+
+	sent = zerocopy_send(conn->sockfd, buf, len);
+	if (sent >= 0) {
+		conn->zerocopy_pending++;
+		server_stats.zerocopy_sends++;
+	} else if (errno == ENOBUFS) {
+		// Out of locked memory for the pinned pages, copy this part
+		sent = send(conn->sockfd, buf, len, MSG_NOSIGNAL);
+	}
+	if (sent < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return STATE_SENDING_DATA;
+		perror("send");
+		return STATE_CONNECTION_CLOSED;
+	}
+
+	conn->file_pos += sent;
+	if (conn->file_pos < conn->file_size)
+		return STATE_SENDING_DATA;
+
+	// The mapping stays referenced until the kernel is done with it
+	return conn->zerocopy_pending ? STATE_ZEROCOPY_WAIT : STATE_DATA_SENT;
+}
+
+// Function to read the next dynamic chunk, once the kernel released its buffer
+static void connection_next_chunk(struct connection *conn)
+{
+	if (conn->zc_ring && !zerocopy_ring_buf(conn->zc_ring)) {
+		conn->state = STATE_ZEROCOPY_WAIT;
+		return;
+	}
+
+	// Continue the async io
+	connection_continue_async_io(conn);
+	// If the all dynamic data was sent, complete the async io
+	if (conn->file_pos == conn->file_size)
+		connection_complete_async_io(conn);
+	// If the chunk of data was read, update the epoll for the sending
+	if (conn->state == STATE_SENDING_DATA)
+		w_epoll_update_ptr_out(epollfd, conn->eventfd, conn);
+	// Else if async io is still ongoing, update the epoll for the reading
+	else if (conn->state == STATE_ASYNC_ONGOING)
+		w_epoll_update_ptr_in(epollfd, conn->eventfd, conn);
+}
+
+// Function to read the MSG_ZEROCOPY completions of the connection
+static void connection_reap_zerocopy(struct connection *conn)
+{
+	struct zerocopy_ring *ring = conn->zc_ring;
+	int copy = ring && ring->copy;
+	long done = zerocopy_reap(conn->sockfd, &server_stats.zerocopy_copied, ring);
+
+	if (done < 0) {
+		perror("recvmsg");
+		conn->state = STATE_CONNECTION_CLOSED;
+		return;
+	}
+
+	if (ring) {
+		if (!copy && ring->copy)
+			server_stats.zerocopy_fallbacks++;
+		if (conn->state != STATE_ZEROCOPY_WAIT)
+			return;
+		// Either a buffer came back for the next chunk, or the reply is done
+		if (conn->file_pos < conn->file_size)
+			connection_next_chunk(conn);
+		else if (!zerocopy_ring_pending(ring))
+			conn->state = STATE_CONNECTION_CLOSED;
+		return;
+	}
+
+	conn->zerocopy_pending -= (unsigned long)done < conn->zerocopy_pending ?
+				  (unsigned long)done : conn->zerocopy_pending;
+	if (conn->state == STATE_ZEROCOPY_WAIT && !conn->zerocopy_pending)
+		conn->state = STATE_CONNECTION_CLOSED;
+}
+
 // Function to send data
 int connection_send_data(struct connection *conn)
 {
@@ -414,9 +931,25 @@ int connection_send_data(struct connection *conn)
 	if (conn->send_len == 0)
 		return 0;
 
-	// Send the data
-	ssize_t bytes_sent =
-		send(conn->sockfd, conn->send_buffer + conn->send_pos, conn->send_len, 0);
+	struct zerocopy_ring *ring = conn->zc_ring;
+	const char *buf = ring ? ring->buf[ring->head] : conn->send_buffer;
+	ssize_t bytes_sent;
+
+	// Large chunks are sent from their pages, pinned until the kernel is done
+	if (ring && !ring->copy && conn->send_len >= config.zerocopy_min) {
+		bytes_sent = zerocopy_send(conn->sockfd, buf + conn->send_pos, conn->send_len);
+		if (bytes_sent >= 0) {
+			zerocopy_ring_sent(ring);
+			server_stats.zerocopy_sends++;
+		} else if (errno == ENOBUFS) {
+			// Out of locked memory for the pinned pages, copy this part
+			bytes_sent = send(conn->sockfd, buf + conn->send_pos, conn->send_len,
+					  MSG_NOSIGNAL);
+		}
+	} else {
+		// Send the data
+		bytes_sent = send(conn->sockfd, buf + conn->send_pos, conn->send_len, 0);
+	}
 
 	// If the send failed, return -1
 	if (bytes_sent < 0) {
@@ -432,8 +965,12 @@ int connection_send_data(struct connection *conn)
 	conn->send_len -= bytes_sent;
 
 	// If all the data was sent, reset the send position
-	if (conn->send_len == 0)
+	if (conn->send_len == 0) {
 		conn->send_pos = 0;
+		// The next chunk goes to the next buffer, this one may still be held
+		if (ring)
+			zerocopy_ring_next(ring);
+	}
 
 	return bytes_sent;
 }
@@ -444,8 +981,29 @@ int connection_send_dynamic(struct connection *conn)
 	if (!conn)
 		return -1;
 
-	// Send the data
-	int bytes_sent = connection_send_data(conn);
+	int bytes_sent;
+
+	// The header waited for the first chunk, so both share one writev()
+	if (response_header_pending(&conn->reply) && conn->zc_ring) {
+		// Except a chunk sent from its own pages, which goes right behind it
+		bytes_sent = response_header_send(conn->sockfd, &conn->reply, MSG_MORE);
+		if (bytes_sent >= 0 && response_header_pending(&conn->reply) == 0)
+			bytes_sent = connection_send_data(conn);
+	} else if (response_header_pending(&conn->reply)) {
+		if (!conn->coalesced) {
+			response_header_body(&conn->reply, conn->send_buffer + conn->send_pos,
+					     conn->send_len);
+			conn->coalesced = 1;
+		}
+		bytes_sent = response_header_send(conn->sockfd, &conn->reply, 0);
+		if (bytes_sent >= 0 && response_header_pending(&conn->reply) == 0) {
+			conn->send_pos = 0;
+			conn->send_len = 0;
+		}
+	} else {
+		// Send the data
+		bytes_sent = connection_send_data(conn);
+	}
 
 	// If the send failed, return -1
 	if (bytes_sent < 0) {
@@ -508,6 +1066,8 @@ void receive_data(struct connection *conn)
 // Function to handle the input
 void handle_input(struct connection *conn)
 {
+	int rc;
+
 	if (!conn)
 		return;
 
@@ -527,47 +1087,77 @@ void handle_input(struct connection *conn)
 			break;
 
 		// If async reading is complete, send the data
-		if (res > 0) {
-			// Continue the async io
-			connection_continue_async_io(conn);
-			// If the all dynamic data was sent, complete the async io
-			if (conn->file_pos == conn->file_size)
-				connection_complete_async_io(conn);
-			// If the chunk of data was read, update the epoll for the sending
-			if (conn->state == STATE_SENDING_DATA)
-				w_epoll_update_ptr_out(epollfd, conn->eventfd, conn);
-			// Else if async io is still ongoing, update the epoll for the reading
-			else if (conn->state == STATE_ASYNC_ONGOING)
-				w_epoll_update_ptr_in(epollfd, conn->eventfd, conn);
-		}
+		if (res > 0)
+			connection_next_chunk(conn);
 		break;
 	}
 	// If the state is receiving data, then call the receive data function
 	case STATE_RECEIVING_DATA:
 		receive_data(conn);
-		// If still receiving data or the connection is closed, break
-		if (conn->state == STATE_RECEIVING_DATA ||
-			conn->state == STATE_CONNECTION_CLOSED)
+		if (conn->state == STATE_CONNECTION_CLOSED)
+			break;
+
+		// If the client sent the HTTP/2 preface, switch to h2c
+		rc = http2_check_preface(conn->recv_buffer, conn->recv_len);
+		if (rc > 0) {
+			if (http2_session_start(conn, epollfd) < 0)
+				conn->state = STATE_CONNECTION_CLOSED;
+			break;
+		} else if (rc < 0 && conn->recv_len < BUFSIZ) {
+			conn->state = STATE_RECEIVING_DATA;
 			break;
+		}
 
-		// If cannot parse the header, change the state to sending 404
+		// If still receiving data, break
+		if (conn->state == STATE_RECEIVING_DATA)
+			break;
+
+		// If cannot parse the header, send the error it was classified as
 		if (parse_header(conn) == -1) {
-			conn->state = STATE_SENDING_404;
+			connection_prepare_send_error(conn, conn->status);
 			// Else parse the header
 		} else {
+			server_stats.requests++;
 			// Get the type of the resource
 			conn->res_type = connection_get_resource_type(conn);
-			// If the resource is static or dynamic, try to open the file
-			if (conn->res_type == RESOURCE_TYPE_STATIC ||
+			// POST only publishes to event routes that allow it
+			if (conn->request_parser.method == HTTP_POST) {
+				if (conn->res_type == RESOURCE_TYPE_NONE)
+					connection_prepare_send_error(conn, 404);
+				else if (conn->res_type != RESOURCE_TYPE_EVENTS || !conn->route->publish)
+					connection_prepare_send_error(conn, 405);
+				else if (connection_publish(conn) < 0)
+					connection_prepare_send_error(conn, 503);
+				// If the resource is static or dynamic, try to open the file
+			} else if (conn->res_type == RESOURCE_TYPE_STATIC ||
 				conn->res_type == RESOURCE_TYPE_DYNAMIC) {
-				// If the file cannot be opened, change the state to sending 404
+				// If the file cannot be opened, send the matching error
 				if (connection_open_file(conn) != 0)
-					conn->state = STATE_SENDING_404;
+					connection_prepare_send_error(conn, conn->status);
+				// Status routes answer with a body generated in memory
+			} else if (conn->res_type == RESOURCE_TYPE_STATUS) {
+				connection_prepare_status(conn);
+				// Event routes keep the connection as a subscriber
+			} else if (conn->res_type == RESOURCE_TYPE_EVENTS) {
+				if (connection_subscribe(conn) < 0)
+					connection_prepare_send_error(conn, 503);
 			} else {
-				conn->state = STATE_SENDING_404;
+				connection_prepare_send_error(conn, 404);
 			}
 		}
 		break;
+	// Subscribers with nothing to send only wait for the peer to close, as
+	// do replies whose pages the kernel still holds
+	case STATE_EVENT_WAIT:
+	case STATE_ZEROCOPY_WAIT:
+	{
+		char discard[256];
+		ssize_t n = recv(conn->sockfd, discard, sizeof(discard), 0);
+
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+			conn->state = STATE_CONNECTION_CLOSED;
+		break;
+	}
 
 	default:
 		// If the state is not valid, change the state to connection closed
@@ -578,6 +1168,8 @@ void handle_input(struct connection *conn)
 
 void handle_output(struct connection *conn)
 {
+	int rc;
+
 	if (!conn)
 		return;
 
@@ -585,29 +1177,39 @@ void handle_output(struct connection *conn)
 	// If the state is request received, then prepare the header
 	case STATE_REQUEST_RECEIVED:
 		connection_prepare_send_reply_header(conn);
+		// Dynamic bodies are read first, the header goes out with the first chunk
+		if (!conn->coalesced && !conn->zerocopy &&
+		    conn->res_type == RESOURCE_TYPE_DYNAMIC) {
+			connection_start_async_io(conn);
+			conn->state = STATE_ASYNC_ONGOING;
+			break;
+		}
 		conn->state = STATE_SENDING_HEADER;
-		break;
+		// The socket is writable already, no need to wait for another event
+		/* fallthrough */
 	// If the state is sending header, then send the data
 	case STATE_SENDING_HEADER:
-		// If the header cannot be sent, change the state to connection closed
-		if (connection_send_data(conn) == -1) {
-			conn->state = STATE_CONNECTION_CLOSED;
-			// Else if the header was sent, then begin sending the data
-		} else if (conn->send_len == 0) {
-			// If the resource is static, change the state to sending data
-			if (conn->res_type == RESOURCE_TYPE_STATIC) {
-				conn->state = STATE_SENDING_DATA;
-				// Else if the resource is dynamic, start the async io
-			} else if (conn->res_type == RESOURCE_TYPE_DYNAMIC) {
-				connection_start_async_io(conn);
-				conn->state = STATE_ASYNC_ONGOING;
-			}
-		}
+		connection_send_header(conn);
+		// The body follows in the same wakeup, behind the held back header
+		if (conn->state == STATE_SENDING_DATA)
+			handle_output(conn);
 		break;
 	// Sending data
 	case STATE_SENDING_DATA:
-		// If the resource is static, call the static function
-		if (conn->res_type == RESOURCE_TYPE_STATIC) {
+		// Subscribers send their queued events, then go idle
+		if (conn->sse) {
+			rc = sse_send(conn->sse);
+			if (rc < 0)
+				conn->state = STATE_CONNECTION_CLOSED;
+			else if (rc == 0)
+				conn->state = STATE_EVENT_WAIT;
+			// Mapped files are sent from the mapping, whatever the route type
+		} else if (conn->zerocopy) {
+			conn->state = connection_send_mapped(conn);
+			if (conn->state == STATE_DATA_SENT)
+				conn->state = STATE_CONNECTION_CLOSED;
+			// If the resource is static, call the static function
+		} else if (conn->res_type == RESOURCE_TYPE_STATIC) {
 			// If all the data was sent, change the state to connection closed
 			if (connection_send_static(conn) == STATE_DATA_SENT)
 				conn->state = STATE_CONNECTION_CLOSED;
@@ -616,19 +1218,20 @@ void handle_output(struct connection *conn)
 			// If the send failed, change the state to connection closed
 			if (connection_send_dynamic(conn) == -1)
 				conn->state = STATE_CONNECTION_CLOSED;
-			// If all the data was sent, change the state to connection closed
+			// If all the data was sent, close once the kernel released the pages
 			if (conn->state == STATE_DATA_SENT)
-				conn->state = STATE_CONNECTION_CLOSED;
+				conn->state = conn->zc_ring && zerocopy_ring_pending(conn->zc_ring) ?
+					      STATE_ZEROCOPY_WAIT : STATE_CONNECTION_CLOSED;
+			// Else send the generated body from the send buffer
+		} else if (connection_send_data(conn) == -1 || conn->send_len == 0) {
+			conn->state = STATE_CONNECTION_CLOSED;
 		}
 		break;
-	// If the state is sending 404, then prepare the 404 header
-	case STATE_SENDING_404:
-		// Prepare the 404 header
-		connection_prepare_send_404(conn);
-		// Send the 404 header
-		if (connection_send_data(conn) == -1)
+	// If the state is sending an error, send the pre-rendered response
+	case STATE_SENDING_ERROR:
+		if (response_header_send(conn->sockfd, &conn->reply, 0) == -1)
 			conn->state = STATE_CONNECTION_CLOSED;
-		else if (conn->send_len == 0)
+		else if (response_header_pending(&conn->reply) == 0)
 			conn->state = STATE_CONNECTION_CLOSED;
 		break;
 
@@ -641,19 +1244,23 @@ void handle_output(struct connection *conn)
 
 void update_states(int epollfd, struct connection *conn)
 {
-	int rc;
+	// States waiting for nothing, such as closed, keep their interest
+	int rc = 0;
 
-	// If the state is sending data or request received or sending 404, update the
-	// epoll for the sending
+	// If the state is sending data, header or an error, or request received,
+	// update the epoll for the sending
 	if (conn->state == STATE_SENDING_DATA ||
+		conn->state == STATE_SENDING_HEADER ||
 		conn->state == STATE_REQUEST_RECEIVED ||
-		conn->state == STATE_SENDING_404) {
+		conn->state == STATE_SENDING_ERROR) {
 		rc = w_epoll_update_ptr_out(epollfd, conn->sockfd, conn);
 		// Else if the state is receiving data or initial or async ongoing, update
 		// the epoll for the reading
 	} else if (conn->state == STATE_RECEIVING_DATA ||
 			 conn->state == STATE_INITIAL ||
-			 conn->state == STATE_ASYNC_ONGOING) {
+			 conn->state == STATE_ASYNC_ONGOING ||
+			 conn->state == STATE_EVENT_WAIT ||
+			 conn->state == STATE_ZEROCOPY_WAIT) {
 		rc = w_epoll_update_ptr_in(epollfd, conn->sockfd, conn);
 	}
 
@@ -670,12 +1277,26 @@ void handle_client(uint32_t event, struct connection *conn)
 	if (!conn)
 		return;
 
-	// If is input event, call the handle input function
-	if (event & EPOLLIN)
-		handle_input(conn);
-	// If is output event, call the handle output function
-	if (event & EPOLLOUT)
-		handle_output(conn);
+	// HTTP/2 connections are driven by their session
+	if (conn->h2) {
+		if (http2_handle_event(conn->h2, event) < 0)
+			conn->state = STATE_CONNECTION_CLOSED;
+	} else {
+		// MSG_ZEROCOPY completions are reported on the error queue
+		if ((event & EPOLLERR) && (conn->zerocopy || conn->zc_ring))
+			connection_reap_zerocopy(conn);
+		// If is input event, call the handle input function
+		if ((event & EPOLLIN) && conn->state != STATE_CONNECTION_CLOSED) {
+			handle_input(conn);
+			// A new socket has room for the reply: write it without waiting
+			if (conn->state == STATE_REQUEST_RECEIVED ||
+			    conn->state == STATE_SENDING_ERROR)
+				event |= EPOLLOUT;
+		}
+		// If is output event, call the handle output function
+		if ((event & EPOLLOUT) && !conn->h2)
+			handle_output(conn);
+	}
 	// If the state is connection closed, remove the connection
 	if (conn->state == STATE_CONNECTION_CLOSED) {
 		rc = w_epoll_remove_ptr(epollfd, conn->sockfd, conn);
@@ -684,26 +1305,162 @@ void handle_client(uint32_t event, struct connection *conn)
 		connection_remove(conn);
 		return;
 	}
+	// The HTTP/2 session keeps its own epoll interest up to date
+	if (conn->h2)
+		return;
 	// Update the epoll
 	update_states(epollfd, conn);
 }
 
-int main(void)
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-c config] [-i]\n", argv0);
+	fprintf(stderr, "  -i  write the metadata index of the configured sites and exit\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
 {
+	const char *config_file = NULL;
+	struct signalfd_siginfo si;
+	int build_index = 0;
+	sigset_t stop;
+	int running = 1;
+	struct treewalk_stats walk;
+	long n;
+	int opt;
 	int rc;
 
+	while ((opt = getopt(argc, argv, "c:i")) != -1) {
+		if (opt == 'c')
+			config_file = optarg;
+		else if (opt == 'i')
+			build_index = 1;
+		else
+			usage(argv[0]);
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	if (config_file)
+		rc = config_load(&config, config_file);
+	else
+		rc = config_default(&config);
+	// config_load already reported what is wrong with the file
+	if (rc < 0)
+		exit(EXIT_FAILURE);
+
+	/* offline index build, e.g. after a deploy, instead of serving */
+	if (build_index) {
+		if (!config.metaindex) {
+			fprintf(stderr, "%s: -i needs a metaindex directive\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		// Hashes of the files that did not change are kept
+		if (metaindex_open(&file_index, config.metaindex) < 0 && errno != ENOENT)
+			perror(config.metaindex);
+		n = metaindex_build(config.sites, config.metaindex, config.etag_content,
+				    &file_index, &walk);
+		metaindex_close(&file_index);
+		if (n < 0) {
+			perror(config.metaindex);
+			exit(EXIT_FAILURE);
+		}
+		printf("%ld files indexed in %s, %lu entries could not be read\n", n,
+		       config.metaindex, walk.errors);
+		config_free(&config);
+		return 0;
+	}
+
+	/* a client closing mid-transfer must not kill the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* stop requests are handled by the loop, so the hot list can be saved */
+	sigemptyset(&stop);
+	sigaddset(&stop, SIGINT);
+	sigaddset(&stop, SIGTERM);
+	rc = sigprocmask(SIG_BLOCK, &stop, NULL);
+	DIE(rc < 0, "sigprocmask");
+	sigfd = signalfd(-1, &stop, SFD_NONBLOCK | SFD_CLOEXEC);
+	DIE(sigfd < 0, "signalfd");
+
+	/* render the static parts of the responses */
+	response_init();
+	response_alt_svc(config.h3_port, config.h3_max_age);
+
+	rc = fdcache_init(config.fd_cache, config.data_max, config.data_budget,
+			  config.map_max, config.map_budget);
+	DIE(rc < 0, "fdcache_init");
+
+	/* small files shared with the other server processes of the host */
+	if (config.shmcache && shmcache_init(config.shmcache, config.shm_size,
+					     config.shm_file_max) < 0)
+		perror(config.shmcache);
+
+	/* metadata of the previous run, checked file by file as they are opened */
+	if (config.metaindex) {
+		if (metaindex_open(&file_index, config.metaindex) == 0)
+			fdcache_use_index(&file_index);
+		else if (errno != ENOENT)
+			perror(config.metaindex);
+	}
+
 	/* init multiplexing */
 	epollfd = w_epoll_create();
 	DIE(epollfd < 0, "w_epoll_create");
 
-	/* create server socket */
-	listenfd = tcp_create_listener(AWS_LISTEN_PORT, DEFAULT_LISTEN_BACKLOG);
-	DIE(listenfd < 0, "tcp_create_listener");
+	/* create server socket, its options set before listen() */
+	listenfd = tcp_bind_listener(config.port);
+	DIE(listenfd < 0, "tcp_bind_listener");
+	rc = sock_profile_listener(listenfd, config.listen_profile);
+	DIE(rc < 0, "sock_profile_listener");
+	rc = listen(listenfd, sock_profile_backlog(config.listen_profile));
+	DIE(rc < 0, "listen");
+	dlog(LOG_INFO, "socket profile %s, backlog %d\n", config.listen_profile->name,
+	     sock_profile_backlog(config.listen_profile));
 
 	rc = w_epoll_add_fd_in(epollfd, listenfd);
 	DIE(rc < 0, "w_epoll_add_fd_in");
 
-	while (1) {
+	/* cached files are invalidated on change instead of checked every second */
+	if (fswatch_init(&watch, config.sites) == 0) {
+		rc = w_epoll_add_fd_in(epollfd, watch.fd);
+		DIE(rc < 0, "w_epoll_add_fd_in");
+		fdcache_watched(1);
+	} else {
+		dlog(LOG_WARNING, "no change notification, revalidating cached files\n");
+	}
+
+	rc = w_epoll_add_fd_in(epollfd, sigfd);
+	DIE(rc < 0, "w_epoll_add_fd_in");
+
+	/* strong ETags hashed in the background, weak ones until they are ready */
+	if (config.etag_content) {
+		etagfd = etag_pool_init(config.etag_threads);
+		DIE(etagfd < 0, "etag_pool_init");
+		rc = w_epoll_add_fd_in(epollfd, etagfd);
+		DIE(rc < 0, "w_epoll_add_fd_in");
+		fdcache_hash_etags(1);
+	}
+
+	/* nothing is accepted before the trees and the hot files are warm */
+	if (config.prewarm_scan &&
+	    prewarm_scan(config.sites, config.metaindex ? &file_index : NULL, config.metaindex) < 0) {
+		dlog(LOG_WARNING, "prewarm: cannot start the scan threads\n");
+	}
+	// The scan may have written the first index
+	if (file_index.map)
+		fdcache_use_index(&file_index);
+	if (config.prewarm_hot) {
+		n = prewarm_load(config.sites, config.prewarm_hot, config.fd_cache);
+		if (n < 0) {
+			dlog(LOG_WARNING, "prewarm: cannot read %s\n", config.prewarm_hot);
+		} else {
+			dlog(LOG_INFO, "prewarm: %ld hot files opened\n", n);
+		}
+	}
+
+	while (running) {
 		struct epoll_event rev;
 
 		/* wait for events */
@@ -712,6 +1469,9 @@ int main(void)
 
 		DIE(rc < 0, "w_epoll_wait_infinite");
 
+		/* refresh the cached Date header once per second at most */
+		response_date_update();
+
 		/*
 		 * switch event types; consider
 		 *   - new connection requests (on server socket)
@@ -721,11 +1481,31 @@ int main(void)
 		if (rev.data.fd == listenfd) {
 			if (rev.events & EPOLLIN)
 				handle_new_connection();
+		} else if (watch.fd >= 0 && rev.data.fd == watch.fd) {
+			fswatch_handle_input(&watch);
+		} else if (etagfd >= 0 && rev.data.fd == etagfd) {
+			etag_handle_input();
+		} else if (rev.data.fd == sigfd) {
+			if (read(sigfd, &si, sizeof(si)) == sizeof(si))
+				running = 0;
 		} else {
 			handle_client(rev.events, rev.data.ptr);
 		}
 	}
 
+	/* the next run starts from the files in use now */
+	if (config.prewarm_save && prewarm_save(config.sites, config.prewarm_hot) < 0)
+		perror("prewarm_save");
+	if (config.metaindex && metaindex_save(&file_index, config.metaindex) < 0)
+		perror("metaindex_save");
+
 	close(listenfd);
+	close(sigfd);
+	etag_pool_close();
+	fswatch_close(&watch);
+	fdcache_use_index(NULL);
+	metaindex_close(&file_index);
+	shmcache_close();
+	config_free(&config);
 	return 0;
 }
@@ -3,7 +3,15 @@
 #ifndef AWS_H_
 #define AWS_H_		1
 
+#include <libaio.h>
+
+#include "autoindex.h"
+#include "fdcache.h"
 #include "http-parser/http_parser.h"
+#include "response.h"
+#include "router.h"
+#include "sse.h"
+#include "vhost.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,35 +24,89 @@ extern "C" {
 #define AWS_ABS_STATIC_FOLDER	(AWS_DOCUMENT_ROOT AWS_REL_STATIC_FOLDER)
 #define AWS_ABS_DYNAMIC_FOLDER	(AWS_DOCUMENT_ROOT AWS_REL_DYNAMIC_FOLDER)
 
+/* Unsent bytes a connection may queue in the kernel, unless configured */
+#define AWS_NOTSENT_LOWAT	(64 << 10)
+
+/* File served for requests naming a directory */
+#define AWS_INDEX_FILE		"index.html"
+
+/* Request limits, answered with 414 and 413 respectively */
+#define AWS_MAX_URI_LEN		2048
+#define AWS_MAX_REQUEST_BODY	BUFSIZ
+
 enum connection_state {
 	STATE_INITIAL,
 	STATE_RECEIVING_DATA,
 	STATE_REQUEST_RECEIVED,
 	STATE_SENDING_DATA,
 	STATE_SENDING_HEADER,
-	STATE_SENDING_404,
+	STATE_SENDING_ERROR,
 	STATE_ASYNC_ONGOING,
+	/* event stream subscriber with nothing queued, watching for close */
+	STATE_EVENT_WAIT,
+	/* file sent with MSG_ZEROCOPY, waiting for the kernel to release it */
+	STATE_ZEROCOPY_WAIT,
 	STATE_DATA_SENT,
 	STATE_HEADER_SENT,
-	STATE_404_SENT,
+	STATE_ERROR_SENT,
 	STATE_CONNECTION_CLOSED,
 	STATE_NO_STATE // Used for assignment skelethon
 };
 
 #define OUT_STATE(s) (((s) == STATE_SENDING_DATA) ||	\
-	((s) == STATE_SENDING_HEADER) || ((s) == STATE_SENDING_404))
-
-/* Resource type request by HTTP (either static or dynamic) */
-enum resource_type {
-	RESOURCE_TYPE_NONE,
-	RESOURCE_TYPE_STATIC,
-	RESOURCE_TYPE_DYNAMIC
+	((s) == STATE_SENDING_HEADER) || ((s) == STATE_SENDING_ERROR))
+
+/* Counters reported by status routes */
+struct server_stats {
+	unsigned long connections_accepted;
+	unsigned long connections_active;
+	/* connections whose request was taken with the SYN (TCP Fast Open) */
+	unsigned long tfo_accepts;
+	unsigned long requests;
+	unsigned long h2_sessions;
+	unsigned long sse_subscribers;
+	unsigned long sse_events;
+	unsigned long sse_overflows;
+	unsigned long fd_cache_hits;
+	unsigned long fd_cache_misses;
+	unsigned long fd_cache_negative_hits;
+	/* small file contents held by the descriptor cache */
+	unsigned long fd_cache_bytes;
+	/* medium files mapped by the descriptor cache */
+	unsigned long fd_cache_mapped;
+	unsigned long zerocopy_sends;
+	/* MSG_ZEROCOPY sends the kernel copied anyway */
+	unsigned long zerocopy_copied;
+	/* dynamic replies switched to copying after a copied send */
+	unsigned long zerocopy_fallbacks;
+	/* files opened with a current record in the metadata index, or without */
+	unsigned long metaindex_hits;
+	unsigned long metaindex_misses;
+	/* files given a strong ETag by the etag threads */
+	unsigned long etag_hashes;
+	/* files found in the shared segment, put there, or left out for now */
+	unsigned long shmcache_hits;
+	unsigned long shmcache_fills;
+	unsigned long shmcache_busy;
+	unsigned long fs_events;
+	unsigned long fs_overflows;
+	/* indexed by status / 100 */
+	unsigned long responses[6];
 };
 
+extern struct server_stats server_stats;
+
+static inline void server_stats_response(int status)
+{
+	if (status >= 100 && status < 600)
+		server_stats.responses[status / 100]++;
+}
+
 /* Structure acting as a connection handler */
 struct connection {
-    /* file to be sent */
+    /* file to be sent, borrowed from the shared cache entry */
 	int fd;
+	struct fd_entry *file;
 	char filename[BUFSIZ];
 
     /* asynchronous notification */
@@ -60,21 +122,55 @@ struct connection {
 	char recv_buffer[BUFSIZ];
 	size_t recv_len;
 
-	/* Used for sending data (headers, 404 or data populated through async IO). */
+	/* Used for sending data populated through async IO. */
 	char send_buffer[BUFSIZ];
 	size_t send_len;
 	size_t send_pos;
 	size_t file_pos;
 	size_t async_read_len;
 
+	/* the file mapping is sent with MSG_ZEROCOPY, completions pending */
+	int zerocopy;
+	unsigned long zerocopy_pending;
+	/* large dynamic replies are read into these pages instead of send_buffer */
+	struct zerocopy_ring *zc_ring;
+	/* TCP_NOTSENT_LOWAT of the socket, 0 while the kernel default */
+	unsigned int notsent_lowat;
+
+	/* generated directory listing sent instead of a file, if any */
+	struct autoindex *listing;
+
+	/* event stream subscription, on events routes */
+	struct sse_subscriber *sse;
+
+	/* Reply header, assembled from pre-rendered fragments */
+	struct file_headers file_hdr;
+	struct response_header reply;
+	/* the whole body goes out with the reply header */
+	int coalesced;
+
 	/* HTTP request path */
 	int have_path;
 	char request_path[BUFSIZ];
+	/* site picked by the Host field, then the route within it */
+	const struct site *site;
+	int in_host_header;
+	const struct route *route;
 	enum resource_type res_type;
 	enum connection_state state;
+	int head_only;
+	/* request body, inside recv_buffer, once the whole message is parsed */
+	const char *body;
+	size_t body_len;
+	int message_complete;
+	/* HTTP status of the error reply, set where the request failed */
+	int status;
 
 	/* HTTP_REQUEST parser */
 	http_parser request_parser;
+
+	/* HTTP/2 session, set once the client sent the h2c preface */
+	struct http2_session *h2;
 };
 
 void handle_client(uint32_t event, struct connection *conn);
@@ -95,6 +191,30 @@ void connection_start_async_io(struct connection *conn);
 
 int parse_header(struct connection *conn);
 
+/*
+ * Open what filename, resolved through route, names under the site root.
+ * A directory is served by its AWS_INDEX_FILE, or by a generated listing
+ * of path if the route has autoindex. Returns 0 with a reference on the
+ * regular file in *file or on the listing in *listing, or the HTTP status
+ * to answer with.
+ */
+int resource_open(const struct site *site, const struct route *route, const char *filename,
+		  const char *path, struct fd_entry **file, struct autoindex **listing);
+
+/* Site serving a Host value, the default site if no name matches */
+const struct site *resolve_site(const char *host, size_t len);
+
+/*
+ * Find the route of site serving path and build the name of the file it
+ * maps to, relative to site->root_fd. Returns NULL if no route matches or
+ * the path escapes its directory.
+ */
+const struct route *resolve_route(const struct site *site, const char *path,
+				  char *filename, size_t size);
+
+/* Render the server counters as text/plain; returns the body length */
+size_t server_stats_render(char *buf, size_t size);
+
 void receive_data(struct connection *conn);
 
 
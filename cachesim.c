@@ -0,0 +1,276 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Replay the request paths of an access log against a plain LRU and the
+ * W-TinyLFU policy of the descriptor cache, and print the hit rate of
+ * each for the given capacities:
+ *
+ *   cachesim <entries> [<entries>...] < access.log
+ *
+ * Lines in the common or combined log format give the path of their
+ * request line; any other line is taken as a path by its first word.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tinylfu.h"
+
+/* Requests as indices into the distinct paths */
+struct trace {
+	uint32_t *ids;
+	size_t len;
+	size_t size;
+	char **names;
+	uint32_t *hashes;
+	size_t nnames;
+	size_t names_size;
+	/* open addressing from path to id + 1, 0 when free */
+	uint32_t *table;
+	size_t mask;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static void *grow(void *array, size_t *size, size_t elem)
+{
+	*size = *size ? *size * 2 : 1024;
+	array = realloc(array, *size * elem);
+	if (!array)
+		die("realloc");
+
+	return array;
+}
+
+// FNV-1a, as the descriptor cache hashes its names
+static uint32_t path_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static void table_insert(struct trace *t, uint32_t hash, uint32_t id)
+{
+	size_t i;
+
+	for (i = hash & t->mask; t->table[i]; i = (i + 1) & t->mask)
+		;
+	t->table[i] = id + 1;
+}
+
+// Function to map a path to its id, adding it if new
+static uint32_t intern(struct trace *t, const char *path, size_t len)
+{
+	uint32_t hash = path_hash(path, len), id;
+	size_t i, size;
+
+	for (i = hash & t->mask; t->table && t->table[i]; i = (i + 1) & t->mask) {
+		id = t->table[i] - 1;
+		if (t->hashes[id] == hash && !strncmp(t->names[id], path, len) &&
+		    !t->names[id][len])
+			return id;
+	}
+
+	// Kept at most half full
+	if ((t->nnames + 1) * 2 > t->mask + 1) {
+		size = t->table ? (t->mask + 1) * 2 : 4096;
+		free(t->table);
+		t->table = calloc(size, sizeof(*t->table));
+		if (!t->table)
+			die("calloc");
+		t->mask = size - 1;
+		for (id = 0; id < t->nnames; id++)
+			table_insert(t, t->hashes[id], id);
+	}
+	if (t->nnames == t->names_size) {
+		size = t->names_size;
+		t->names = grow(t->names, &size, sizeof(*t->names));
+		t->hashes = grow(t->hashes, &t->names_size, sizeof(*t->hashes));
+	}
+
+	id = t->nnames++;
+	t->names[id] = strndup(path, len);
+	if (!t->names[id])
+		die("strndup");
+	t->hashes[id] = hash;
+	table_insert(t, hash, id);
+
+	return id;
+}
+
+// Function to find the path of a log line; returns its length, 0 if none
+static size_t line_path(const char *line, const char **path)
+{
+	const char *p = strchr(line, '"');
+
+	// "GET /path HTTP/1.1"
+	if (p) {
+		p = strchr(p, ' ');
+		if (!p)
+			return 0;
+		p++;
+	} else {
+		p = line + strspn(line, " \t");
+	}
+
+	*path = p;
+	return strcspn(p, " \t\r\n\"?");
+}
+
+static void trace_read(struct trace *t, FILE *f)
+{
+	char *line = NULL;
+	const char *path;
+	size_t cap = 0, len;
+
+	while (getline(&line, &cap, f) >= 0) {
+		len = line_path(line, &path);
+		if (!len)
+			continue;
+		if (t->len == t->size)
+			t->ids = grow(t->ids, &t->size, sizeof(*t->ids));
+		t->ids[t->len++] = intern(t, path, len);
+	}
+	free(line);
+}
+
+static size_t simulate_lru(const struct trace *t, size_t capacity)
+{
+	int64_t *prev, *next, head = -1, tail = -1;
+	size_t i, count = 0, hits = 0;
+	unsigned char *cached;
+	uint32_t id;
+
+	prev = malloc(t->nnames * sizeof(*prev));
+	next = malloc(t->nnames * sizeof(*next));
+	cached = calloc(t->nnames, 1);
+	if (!prev || !next || !cached)
+		die("malloc");
+
+	for (i = 0; i < t->len; i++) {
+		id = t->ids[i];
+		if (cached[id]) {
+			hits++;
+			if (head == id)
+				continue;
+			// Unlink, then push back at the head
+			next[prev[id]] = next[id];
+			if (next[id] >= 0)
+				prev[next[id]] = prev[id];
+			else
+				tail = prev[id];
+		} else if (count == capacity) {
+			cached[tail] = 0;
+			tail = prev[tail];
+			if (tail >= 0)
+				next[tail] = -1;
+			else
+				head = -1;
+		} else {
+			count++;
+		}
+
+		cached[id] = 1;
+		prev[id] = -1;
+		next[id] = head;
+		if (head >= 0)
+			prev[head] = id;
+		head = id;
+		if (tail < 0)
+			tail = id;
+	}
+
+	free(prev);
+	free(next);
+	free(cached);
+
+	return hits;
+}
+
+static size_t simulate_tinylfu(const struct trace *t, size_t capacity)
+{
+	struct tlfu_node *nodes, *victim;
+	unsigned char *cached;
+	size_t i, hits = 0;
+	struct tlfu policy;
+	uint32_t id;
+
+	nodes = calloc(t->nnames, sizeof(*nodes));
+	cached = calloc(t->nnames, 1);
+	if (!nodes || !cached || tlfu_init(&policy, capacity) < 0)
+		die("calloc");
+
+	for (i = 0; i < t->len; i++) {
+		id = t->ids[i];
+		tlfu_record(&policy, t->hashes[id]);
+		if (cached[id]) {
+			hits++;
+			tlfu_hit(&policy, &nodes[id]);
+			continue;
+		}
+
+		nodes[id].hash = t->hashes[id];
+		cached[id] = 1;
+		victim = tlfu_admit(&policy, &nodes[id]);
+		if (victim) {
+			tlfu_remove(&policy, victim);
+			cached[victim - nodes] = 0;
+		}
+	}
+
+	tlfu_free(&policy);
+	free(nodes);
+	free(cached);
+
+	return hits;
+}
+
+int main(int argc, char **argv)
+{
+	struct trace t;
+	size_t lru, tinylfu;
+	long capacity;
+	char *end;
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <entries> [<entries>...] < access.log\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&t, 0, sizeof(t));
+	trace_read(&t, stdin);
+	printf("%zu requests, %zu distinct paths\n", t.len, t.nnames);
+	if (!t.len)
+		return 0;
+
+	printf("%10s %10s %10s\n", "entries", "lru", "tinylfu");
+	for (i = 1; i < argc; i++) {
+		capacity = strtol(argv[i], &end, 10);
+		if (*end || end == argv[i] || capacity < 1) {
+			fprintf(stderr, "invalid cache size '%s'\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+
+		lru = simulate_lru(&t, capacity);
+		tinylfu = simulate_tinylfu(&t, capacity);
+		printf("%10ld %9.2f%% %9.2f%%\n", capacity,
+		       100.0 * lru / t.len, 100.0 * tinylfu / t.len);
+	}
+
+	return 0;
+}
@@ -0,0 +1,753 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aws.h"
+#include "config.h"
+#include "etag.h"
+#include "shmcache.h"
+#include "zerocopy.h"
+
+struct config_parser {
+	struct server_config *config;
+	/* site the root and route directives apply to */
+	struct site *site;
+	const char *file;
+	int line;
+};
+
+static int config_error(struct config_parser *parser, const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s:%d: ", parser->file, parser->line);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+
+	return -1;
+}
+
+static int set_document_root(struct site *site, const char *dir)
+{
+	size_t len = strlen(dir);
+
+	if (len == 0 || len + 2 > sizeof(site->document_root))
+		return -1;
+
+	memcpy(site->document_root, dir, len + 1);
+	if (dir[len - 1] != '/')
+		strcat(site->document_root, "/");
+
+	return 0;
+}
+
+// Function to append a new site to the configuration
+static struct site *add_site(struct server_config *config, const char *document_root)
+{
+	struct site *site, **pp;
+
+	site = calloc(1, sizeof(*site));
+	if (!site)
+		return NULL;
+	site->root_fd = -1;
+	router_init(&site->router);
+	if (set_document_root(site, document_root) < 0) {
+		free(site);
+		return NULL;
+	}
+
+	for (pp = &config->sites; *pp; pp = &(*pp)->next)
+		;
+	*pp = site;
+
+	return site;
+}
+
+// Function to mount a route, by default on the directory named like it
+static struct route *add_route(struct site *site, const char *prefix,
+			       enum resource_type type, const char *dir)
+{
+	struct route *route = router_add(&site->router, prefix, type);
+	size_t len;
+
+	if (!route)
+		return NULL;
+
+	// File names are built as root + dir + rest of the path
+	if (!dir)
+		dir = prefix + 1;
+	len = strlen(dir);
+	route->dir = malloc(len + 2);
+	if (!route->dir)
+		return NULL;
+	memcpy(route->dir, dir, len + 1);
+	if (len && dir[len - 1] != '/')
+		strcat(route->dir, "/");
+
+	return route;
+}
+
+// Function to find a socket profile, or add an empty one
+static struct sock_profile *find_profile(struct server_config *config, const char *name,
+					 int create)
+{
+	struct sock_profile *profile, **pp;
+
+	for (pp = &config->profiles; *pp; pp = &(*pp)->next)
+		if (!strcmp((*pp)->name, name))
+			return *pp;
+	if (!create)
+		return NULL;
+
+	profile = calloc(1, sizeof(*profile));
+	if (!profile)
+		return NULL;
+	profile->name = strdup(name);
+	if (!profile->name) {
+		free(profile);
+		return NULL;
+	}
+	*pp = profile;
+
+	return profile;
+}
+
+static int parse_listen(struct config_parser *parser, int argc, char **argv)
+{
+	struct sock_profile *profile = NULL;
+	char *end;
+	long port;
+
+	if (argc < 2 || argc > 3)
+		return config_error(parser, "usage: listen <port> [<profile>]");
+	if (parser->site != parser->config->sites)
+		return config_error(parser, "listen is not allowed after host");
+
+	port = strtol(argv[1], &end, 10);
+	if (*end || port <= 0 || port > 65535)
+		return config_error(parser, "invalid port '%s'", argv[1]);
+	if (argc == 3) {
+		profile = find_profile(parser->config, argv[2], 0);
+		if (!profile)
+			return config_error(parser, "unknown socket profile '%s'", argv[2]);
+		parser->config->listen_profile = profile;
+	}
+	parser->config->port = port;
+
+	return 0;
+}
+
+// Function to parse a non-negative int option value
+static int parse_int(const char *arg, int *value)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(arg, &end, 10);
+	if (errno || *end || end == arg || n < 0 || n > INT_MAX)
+		return -1;
+	*value = n;
+
+	return 0;
+}
+
+static int parse_sockprofile(struct config_parser *parser, int argc, char **argv)
+{
+	struct sock_profile *profile, *next;
+	char *name;
+	int i;
+
+	if (argc < 2)
+		return config_error(parser, "usage: sockprofile <name> [options]");
+	if (parser->site != parser->config->sites)
+		return config_error(parser, "sockprofile is not allowed after host");
+
+	profile = find_profile(parser->config, argv[1], 1);
+	if (!profile)
+		return config_error(parser, "out of memory");
+	// A redefinition starts over, the listener may point at it already
+	name = profile->name;
+	next = profile->next;
+	memset(profile, 0, sizeof(*profile));
+	profile->name = name;
+	profile->next = next;
+
+	for (i = 2; i < argc; i++) {
+		const char *arg = argv[i];
+
+		if (!strncmp(arg, "backlog=", 8)) {
+			if (parse_int(arg + 8, &profile->backlog) < 0 || !profile->backlog)
+				return config_error(parser, "invalid backlog '%s'", arg + 8);
+		} else if (!strncmp(arg, "defer_accept=", 13)) {
+			if (parse_int(arg + 13, &profile->defer_accept) < 0)
+				return config_error(parser, "invalid defer_accept '%s'", arg + 13);
+			profile->set |= SOCKOPT_DEFER_ACCEPT;
+		} else if (!strcmp(arg, "nodelay")) {
+			profile->set |= SOCKOPT_NODELAY;
+		} else if (!strncmp(arg, "sndbuf=", 7)) {
+			if (parse_int(arg + 7, &profile->sndbuf) < 0 || !profile->sndbuf)
+				return config_error(parser, "invalid sndbuf '%s'", arg + 7);
+			profile->set |= SOCKOPT_SNDBUF;
+		} else if (!strncmp(arg, "rcvbuf=", 7)) {
+			if (parse_int(arg + 7, &profile->rcvbuf) < 0 || !profile->rcvbuf)
+				return config_error(parser, "invalid rcvbuf '%s'", arg + 7);
+			profile->set |= SOCKOPT_RCVBUF;
+		} else if (!strncmp(arg, "keepalive=", 10)) {
+			if (sscanf(arg + 10, "%d,%d,%d", &profile->keep_idle,
+				   &profile->keep_intvl, &profile->keep_cnt) != 3 ||
+			    profile->keep_idle <= 0 || profile->keep_intvl <= 0 ||
+			    profile->keep_cnt <= 0)
+				return config_error(parser, "invalid keepalive '%s'", arg + 10);
+			profile->set |= SOCKOPT_KEEPALIVE;
+		} else if (!strcmp(arg, "quickack")) {
+			profile->set |= SOCKOPT_QUICKACK;
+		} else if (!strncmp(arg, "fastopen=", 9)) {
+			if (parse_int(arg + 9, &profile->fastopen) < 0 || !profile->fastopen)
+				return config_error(parser, "invalid fastopen queue '%s'", arg + 9);
+			profile->set |= SOCKOPT_FASTOPEN;
+		} else {
+			return config_error(parser, "unknown socket option '%s'", arg);
+		}
+	}
+
+	return 0;
+}
+
+static int parse_fdcache(struct config_parser *parser, int argc, char **argv)
+{
+	char *end;
+	long entries;
+
+	if (argc != 2)
+		return config_error(parser, "usage: fdcache <entries>");
+	if (parser->site != parser->config->sites)
+		return config_error(parser, "fdcache is not allowed after host");
+
+	errno = 0;
+	entries = strtol(argv[1], &end, 10);
+	if (errno || *end || end == argv[1] || entries < 0 || entries > 65536)
+		return config_error(parser, "invalid cache size '%s'", argv[1]);
+	parser->config->fd_cache = entries;
+
+	return 0;
+}
+
+// Function to parse "<directive> <max file size> <total size>"
+static int parse_cache_sizes(struct config_parser *parser, int argc, char **argv,
+			     size_t *max_size, size_t *total)
+{
+	char *end;
+	long max, budget;
+
+	if (argc != 3)
+		return config_error(parser, "usage: %s <max file size> <total size>", argv[0]);
+	if (parser->site != parser->config->sites)
+		return config_error(parser, "%s is not allowed after host", argv[0]);
+
+	errno = 0;
+	max = strtol(argv[1], &end, 10);
+	if (errno || *end || end == argv[1] || max < 0)
+		return config_error(parser, "invalid file size '%s'", argv[1]);
+	budget = strtol(argv[2], &end, 10);
+	if (errno || *end || end == argv[2] || budget < 0)
+		return config_error(parser, "invalid total size '%s'", argv[2]);
+	*max_size = max;
+	*total = budget;
+
+	return 0;
+}
+
+static int parse_memcache(struct config_parser *parser, int argc, char **argv)
+{
+	return parse_cache_sizes(parser, argc, argv, &parser->config->data_max,
+				 &parser->config->data_budget);
+}
+
+static int parse_mmapcache(struct config_parser *parser, int argc, char **argv)
+{
+	return parse_cache_sizes(parser, argc, argv, &parser->config->map_max,
+				 &parser->config->map_budget);
+}
+
+static int parse_zerocopy(struct config_parser *parser, int argc, char **argv)
+{
+	char *end;
+	long min;
+
+	if (argc != 2)
+		return config_error(parser, "usage: zerocopy <min chunk size>");
+	if (parser->site != parser->config->sites)
+		return config_error(parser, "zerocopy is not allowed after host");
+
+	// Chunks are never larger than a ring buffer
+	errno = 0;
+	min = strtol(argv[1], &end, 10);
+	if (errno || *end || end == argv[1] || min < 0 || min > ZEROCOPY_CHUNK)
+		return config_error(parser, "invalid chunk size '%s'", argv[1]);
+	parser->config->zerocopy_min = min;
+
+	return 0;
+}
+
+// Function to parse a TCP_NOTSENT_LOWAT size
+static int parse_lowat(const char *arg, unsigned int *bytes)
+{
+	int n;
+
+	if (parse_int(arg, &n) < 0)
+		return -1;
+	*bytes = n;
+
+	return 0;
+}
+
+static int parse_http3_alt_svc(struct config_parser *parser, int argc, char **argv)
+{
+	struct server_config *config = parser->config;
+	int port;
+
+	if (argc < 2 || argc > 3)
+		return config_error(parser, "usage: http3_alt_svc <udp port> [max_age=<seconds>]");
+	if (parser->site != config->sites)
+		return config_error(parser, "http3_alt_svc is not allowed after host");
+	if (parse_int(argv[1], &port) < 0 || !port || port > 65535)
+		return config_error(parser, "invalid port '%s'", argv[1]);
+	config->h3_port = port;
+	config->h3_max_age = RESPONSE_ALT_SVC_MAX_AGE;
+	if (argc == 3 && (strncmp(argv[2], "max_age=", 8) ||
+			  parse_int(argv[2] + 8, &config->h3_max_age) < 0))
+		return config_error(parser, "invalid option '%s'", argv[2]);
+
+	return 0;
+}
+
+static int parse_notsent_lowat(struct config_parser *parser, int argc, char **argv)
+{
+	if (argc != 2)
+		return config_error(parser, "usage: notsent_lowat <bytes>");
+	if (parser->site != parser->config->sites)
+		return config_error(parser, "notsent_lowat is not allowed after host");
+	if (parse_lowat(argv[1], &parser->config->notsent_lowat) < 0)
+		return config_error(parser, "invalid size '%s'", argv[1]);
+
+	return 0;
+}
+
+static int parse_prewarm(struct config_parser *parser, int argc, char **argv)
+{
+	struct server_config *config = parser->config;
+	int i;
+
+	if (argc < 2)
+		return config_error(parser, "usage: prewarm [scan] [hot=<file>] [save]");
+	if (parser->site != config->sites)
+		return config_error(parser, "prewarm is not allowed after host");
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "scan")) {
+			config->prewarm_scan = 1;
+		} else if (!strcmp(argv[i], "save")) {
+			config->prewarm_save = 1;
+		} else if (!strncmp(argv[i], "hot=", 4) && argv[i][4]) {
+			free(config->prewarm_hot);
+			config->prewarm_hot = strdup(argv[i] + 4);
+			if (!config->prewarm_hot)
+				return config_error(parser, "out of memory");
+		} else {
+			return config_error(parser, "unknown prewarm option '%s'", argv[i]);
+		}
+	}
+	if (config->prewarm_save && !config->prewarm_hot)
+		return config_error(parser, "prewarm save needs hot=<file>");
+
+	return 0;
+}
+
+static int parse_metaindex(struct config_parser *parser, int argc, char **argv)
+{
+	struct server_config *config = parser->config;
+
+	if (argc != 2)
+		return config_error(parser, "usage: metaindex <file>");
+	if (parser->site != config->sites)
+		return config_error(parser, "metaindex is not allowed after host");
+
+	free(config->metaindex);
+	config->metaindex = strdup(argv[1]);
+	if (!config->metaindex)
+		return config_error(parser, "out of memory");
+
+	return 0;
+}
+
+static int parse_shmcache(struct config_parser *parser, int argc, char **argv)
+{
+	struct server_config *config = parser->config;
+	char *end;
+	long size, max = SHMCACHE_DEFAULT_FILE_MAX;
+
+	if (argc < 3 || argc > 4)
+		return config_error(parser, "usage: shmcache <name> <size> [max file size]");
+	if (parser->site != config->sites)
+		return config_error(parser, "shmcache is not allowed after host");
+	if (argv[1][0] != '/' || strchr(argv[1] + 1, '/'))
+		return config_error(parser, "invalid segment name '%s'", argv[1]);
+
+	errno = 0;
+	size = strtol(argv[2], &end, 10);
+	if (errno || *end || end == argv[2] || size <= 0)
+		return config_error(parser, "invalid total size '%s'", argv[2]);
+	if (argc == 4) {
+		max = strtol(argv[3], &end, 10);
+		if (errno || *end || end == argv[3] || max < 0)
+			return config_error(parser, "invalid file size '%s'", argv[3]);
+	}
+
+	free(config->shmcache);
+	config->shmcache = strdup(argv[1]);
+	if (!config->shmcache)
+		return config_error(parser, "out of memory");
+	config->shm_size = size;
+	config->shm_file_max = max;
+
+	return 0;
+}
+
+static int parse_etag(struct config_parser *parser, int argc, char **argv)
+{
+	struct server_config *config = parser->config;
+	char *end;
+	long threads;
+
+	if (argc < 2 || argc > 3)
+		return config_error(parser, "usage: etag <stat|content> [threads=<n>]");
+	if (parser->site != config->sites)
+		return config_error(parser, "etag is not allowed after host");
+
+	if (!strcmp(argv[1], "stat"))
+		config->etag_content = 0;
+	else if (!strcmp(argv[1], "content"))
+		config->etag_content = 1;
+	else
+		return config_error(parser, "unknown etag mode '%s'", argv[1]);
+
+	if (argc == 3) {
+		if (strncmp(argv[2], "threads=", 8))
+			return config_error(parser, "unknown etag option '%s'", argv[2]);
+		errno = 0;
+		threads = strtol(argv[2] + 8, &end, 10);
+		if (errno || *end || end == argv[2] + 8 || threads < 1 ||
+		    threads > ETAG_MAX_THREADS)
+			return config_error(parser, "invalid thread count '%s'", argv[2] + 8);
+		config->etag_threads = threads;
+	}
+
+	return 0;
+}
+
+static int parse_root(struct config_parser *parser, int argc, char **argv)
+{
+	if (argc != 2)
+		return config_error(parser, "usage: root <directory>");
+
+	if (set_document_root(parser->site, argv[1]) < 0)
+		return config_error(parser, "invalid document root '%s'", argv[1]);
+
+	return 0;
+}
+
+static int parse_route(struct config_parser *parser, int argc, char **argv)
+{
+	struct cache_policy cache = { .max_age = -1 };
+	enum sse_overflow overflow = SSE_OVERFLOW_DISCONNECT;
+	long queue = SSE_DEFAULT_QUEUE;
+	int autoindex = 0, publish = 0, events_opts = 0;
+	unsigned int lowat = 0;
+	enum resource_type type;
+	const char *dir = NULL;
+	struct route *route;
+	char *end;
+	int i;
+
+	if (argc < 3)
+		return config_error(parser, "usage: route <mount point> <type> [options]");
+
+	if (argv[1][0] != '/')
+		return config_error(parser, "mount point '%s' must start with '/'", argv[1]);
+
+	if (router_type_parse(argv[2], &type) < 0)
+		return config_error(parser, "unknown route type '%s'", argv[2]);
+
+	for (i = 3; i < argc; i++) {
+		if (!strncmp(argv[i], "dir=", 4)) {
+			dir = argv[i] + 4;
+		} else if (!strncmp(argv[i], "max-age=", 8)) {
+			errno = 0;
+			cache.max_age = strtol(argv[i] + 8, &end, 10);
+			if (errno || *end || end == argv[i] + 8 || cache.max_age < 0)
+				return config_error(parser, "invalid max-age '%s'", argv[i] + 8);
+		} else if (!strcmp(argv[i], "immutable")) {
+			cache.immutable = 1;
+		} else if (!strcmp(argv[i], "no-cache")) {
+			cache.no_cache = 1;
+		} else if (!strcmp(argv[i], "autoindex")) {
+			autoindex = 1;
+		} else if (!strncmp(argv[i], "lowat=", 6)) {
+			if (parse_lowat(argv[i] + 6, &lowat) < 0 || !lowat)
+				return config_error(parser, "invalid lowat '%s'", argv[i] + 6);
+		} else if (!strncmp(argv[i], "queue=", 6)) {
+			errno = 0;
+			queue = strtol(argv[i] + 6, &end, 10);
+			// Skipping ahead keeps the event on the wire plus the new one
+			if (errno || *end || queue < 2 || queue > 65536)
+				return config_error(parser, "invalid queue length '%s'", argv[i] + 6);
+			events_opts = 1;
+		} else if (!strcmp(argv[i], "overflow=skip")) {
+			overflow = SSE_OVERFLOW_SKIP;
+			events_opts = 1;
+		} else if (!strcmp(argv[i], "overflow=disconnect")) {
+			overflow = SSE_OVERFLOW_DISCONNECT;
+			events_opts = 1;
+		} else if (!strcmp(argv[i], "publish")) {
+			publish = 1;
+			events_opts = 1;
+		} else {
+			return config_error(parser, "unknown route option '%s'", argv[i]);
+		}
+	}
+
+	if ((type == RESOURCE_TYPE_STATUS || type == RESOURCE_TYPE_EVENTS) &&
+	    (cache.max_age >= 0 || cache.immutable || cache.no_cache))
+		return config_error(parser, "%s routes are always sent with no-cache", argv[2]);
+	if (type != RESOURCE_TYPE_EVENTS && events_opts)
+		return config_error(parser, "queue, overflow and publish only apply to events routes");
+	if (response_cache_policy(&cache) < 0)
+		return config_error(parser, "no-cache cannot be combined with max-age or immutable");
+
+	route = add_route(parser->site, argv[1], type, dir);
+	if (!route)
+		return config_error(parser, "cannot mount '%s' (already mounted?)", argv[1]);
+	route->cache = cache;
+	route->autoindex = autoindex;
+	route->notsent_lowat = lowat;
+
+	if (type == RESOURCE_TYPE_EVENTS) {
+		route->hub = malloc(sizeof(*route->hub));
+		if (!route->hub)
+			return config_error(parser, "out of memory");
+		sse_hub_init(route->hub, queue, overflow);
+		route->publish = publish;
+	}
+
+	return 0;
+}
+
+static int parse_host(struct config_parser *parser, int argc, char **argv)
+{
+	struct server_config *config = parser->config;
+	struct site *site;
+	int i;
+
+	if (argc < 2)
+		return config_error(parser, "usage: host <name> [<name>...]");
+
+	site = add_site(config, config->sites->document_root);
+	if (!site)
+		return config_error(parser, "out of memory");
+	parser->site = site;
+
+	for (i = 1; i < argc; i++)
+		if (vhost_add(&config->hosts, argv[i], site) < 0)
+			return config_error(parser, "invalid or duplicate host name '%s'", argv[i]);
+
+	return 0;
+}
+
+static int parse_default(struct config_parser *parser, int argc, char **argv)
+{
+	struct server_config *config = parser->config;
+
+	if (argc != 1)
+		return config_error(parser, "usage: default");
+	if (parser->site == config->sites)
+		return config_error(parser, "default must follow a host line");
+	if (config->hosts.default_site != config->sites)
+		return config_error(parser, "more than one default host");
+
+	config->hosts.default_site = parser->site;
+
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int (*parse)(struct config_parser *parser, int argc, char **argv);
+} directives[] = {
+	{ "sockprofile", parse_sockprofile },
+	{ "listen", parse_listen },
+	{ "fdcache", parse_fdcache },
+	{ "memcache", parse_memcache },
+	{ "mmapcache", parse_mmapcache },
+	{ "zerocopy", parse_zerocopy },
+	{ "notsent_lowat", parse_notsent_lowat },
+	{ "http3_alt_svc", parse_http3_alt_svc },
+	{ "prewarm", parse_prewarm },
+	{ "metaindex", parse_metaindex },
+	{ "etag", parse_etag },
+	{ "shmcache", parse_shmcache },
+	{ "root", parse_root },
+	{ "route", parse_route },
+	{ "host", parse_host },
+	{ "default", parse_default },
+};
+
+static int parse_line(struct config_parser *parser, char *line)
+{
+	char *argv[CONFIG_MAX_ARGS];
+	char *comment, *save, *word;
+	int argc = 0;
+	size_t i;
+
+	comment = strchr(line, '#');
+	if (comment)
+		*comment = '\0';
+
+	for (word = strtok_r(line, " \t\r\n", &save); word;
+	     word = strtok_r(NULL, " \t\r\n", &save)) {
+		if (argc == CONFIG_MAX_ARGS)
+			return config_error(parser, "too many words");
+		argv[argc++] = word;
+	}
+
+	if (!argc)
+		return 0;
+
+	for (i = 0; i < sizeof(directives) / sizeof(directives[0]); i++)
+		if (!strcmp(argv[0], directives[i].name))
+			return directives[i].parse(parser, argc, argv);
+
+	return config_error(parser, "unknown directive '%s'", argv[0]);
+}
+
+static int config_init(struct server_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->port = AWS_LISTEN_PORT;
+	config->fd_cache = FDCACHE_DEFAULT_SIZE;
+	config->data_max = FDCACHE_DEFAULT_DATA_MAX;
+	config->data_budget = FDCACHE_DEFAULT_DATA_BUDGET;
+	config->etag_threads = ETAG_DEFAULT_THREADS;
+	config->notsent_lowat = AWS_NOTSENT_LOWAT;
+	vhost_table_init(&config->hosts);
+
+	// Listeners without a profile only get the full backlog
+	config->listen_profile = find_profile(config, "default", 1);
+	if (!config->listen_profile) {
+		perror("calloc");
+		return -1;
+	}
+
+	// The top level site answers every host until told otherwise
+	config->hosts.default_site = add_site(config, AWS_DOCUMENT_ROOT);
+	if (!config->hosts.default_site) {
+		perror("calloc");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Function to open the document root of every site
+static int config_open_sites(struct server_config *config)
+{
+	struct site *site;
+
+	for (site = config->sites; site; site = site->next) {
+		site->root_fd = open(site->document_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (site->root_fd < 0) {
+			fprintf(stderr, "%s: %s\n", site->document_root, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int config_default(struct server_config *config)
+{
+	if (config_init(config) < 0)
+		return -1;
+
+	if (!add_route(config->sites, "/" AWS_REL_STATIC_FOLDER, RESOURCE_TYPE_STATIC, NULL) ||
+	    !add_route(config->sites, "/" AWS_REL_DYNAMIC_FOLDER, RESOURCE_TYPE_DYNAMIC, NULL))
+		return -1;
+
+	return config_open_sites(config);
+}
+
+int config_load(struct server_config *config, const char *path)
+{
+	struct config_parser parser = { config, NULL, path, 0 };
+	char line[BUFSIZ];
+	FILE *file;
+	int rc = 0;
+
+	if (config_init(config) < 0)
+		return -1;
+	parser.site = config->sites;
+
+	file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (rc == 0 && fgets(line, sizeof(line), file)) {
+		parser.line++;
+		rc = parse_line(&parser, line);
+	}
+	fclose(file);
+
+	if (rc < 0)
+		return -1;
+
+	return config_open_sites(config);
+}
+
+void config_free(struct server_config *config)
+{
+	struct sock_profile *profile, *next_profile;
+	struct site *site, *next;
+
+	for (site = config->sites; site; site = next) {
+		next = site->next;
+		if (site->root_fd >= 0)
+			close(site->root_fd);
+		router_free(&site->router);
+		free(site);
+	}
+	vhost_table_free(&config->hosts);
+	config->sites = NULL;
+	free(config->prewarm_hot);
+	config->prewarm_hot = NULL;
+	free(config->metaindex);
+	config->metaindex = NULL;
+	free(config->shmcache);
+	config->shmcache = NULL;
+	for (profile = config->profiles; profile; profile = next_profile) {
+		next_profile = profile->next;
+		free(profile->name);
+		free(profile);
+	}
+	config->profiles = NULL;
+	config->listen_profile = NULL;
+}
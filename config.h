@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef CONFIG_H_
+#define CONFIG_H_	1
+
+#include <limits.h>
+
+#include "router.h"
+#include "sockprofile.h"
+#include "vhost.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Most words on a single configuration line */
+#define CONFIG_MAX_ARGS		16
+
+struct server_config {
+	unsigned short port;
+	/* socket profiles, "default" first, and the one of the listener */
+	struct sock_profile *profiles;
+	struct sock_profile *listen_profile;
+	/* open files kept in the descriptor cache, 0 to disable it */
+	size_t fd_cache;
+	/* largest file read into memory and the total kept, 0 to disable */
+	size_t data_max;
+	size_t data_budget;
+	/* largest file mapped and sent with MSG_ZEROCOPY and the total, 0 to disable */
+	size_t map_max;
+	size_t map_budget;
+	/* dynamic chunks of this many bytes or more go out with MSG_ZEROCOPY, 0 to copy */
+	size_t zerocopy_min;
+	/* TCP_NOTSENT_LOWAT of accepted sockets, 0 to keep the kernel default */
+	unsigned int notsent_lowat;
+	/* UDP port of an HTTP/3 endpoint advertised with Alt-Svc, 0 for none */
+	unsigned short h3_port;
+	int h3_max_age;
+	/* startup tree walk, hot list opened before accepting, rewritten at exit */
+	int prewarm_scan;
+	char *prewarm_hot;
+	int prewarm_save;
+	/* metadata index loaded at startup and rewritten at exit, or NULL */
+	char *metaindex;
+	/* ETags hashed from the contents on etag_threads threads, else from stat */
+	int etag_content;
+	unsigned int etag_threads;
+	/* shared memory segment of the contents of small files, or NULL */
+	char *shmcache;
+	size_t shm_size;
+	size_t shm_file_max;
+	/* every configured site, the top level one first */
+	struct site *sites;
+	struct vhost_table hosts;
+};
+
+/*
+ * Built-in configuration, used when no file is given: AWS_LISTEN_PORT and
+ * a default site on AWS_DOCUMENT_ROOT with the static/ and dynamic/ mount
+ * points.
+ */
+int config_default(struct server_config *config);
+
+/*
+ * Load a configuration file. Each line holds one directive:
+ *
+ *   sockprofile <name> [options]
+ *   listen <port> [<profile>]
+ *   fdcache <entries>
+ *   memcache <max file size> <total size>
+ *   mmapcache <max file size> <total size>
+ *   zerocopy <min chunk size>
+ *   notsent_lowat <bytes>
+ *   http3_alt_svc <udp port> [max_age=<seconds>]
+ *   prewarm [scan] [hot=<file>] [save]
+ *   metaindex <file>
+ *   etag <stat|content> [threads=<n>]
+ *   shmcache <name> <size> [max file size]
+ *   root <directory>
+ *   route <mount point> <static|dynamic|status|events> [options]
+ *   host <name> [<name>...]
+ *   default
+ *
+ * Route options are dir=<directory>, the directory under the root the
+ * route serves, and the caching policy of its replies: max-age=<seconds>,
+ * immutable (for fingerprinted paths, one year unless max-age is given)
+ * or no-cache. autoindex lists directories that have no index.html.
+ * lowat=<bytes> replaces notsent_lowat for HTTP/1.1 replies of the route.
+ * events routes take queue=<events> and overflow=<disconnect|skip> for
+ * slow subscribers, and publish to let POST requests publish events.
+ *
+ * sockprofile defines a named set of socket options: backlog=<n> (up to
+ * net.core.somaxconn, the default), defer_accept=<seconds>, nodelay,
+ * sndbuf=<bytes>, rcvbuf=<bytes>, keepalive=<idle>,<interval>,<count>,
+ * quickack and fastopen=<queue length>, which also needs the server bit
+ * (2) of net.ipv4.tcp_fastopen. listen uses the profile it names, which
+ * must be defined above it, or "default"; a later line with the same
+ * name replaces the profile.
+ *
+ * fdcache bounds the number of files kept open between requests;
+ * memcache sets which of them are also kept in memory, in bytes;
+ * mmapcache which larger ones are mapped once requested again and sent
+ * with MSG_ZEROCOPY (off by default, it only pays off for large replies
+ * on real NICs). zerocopy reads dynamic replies at least that large into
+ * pinned buffers of up to ZEROCOPY_CHUNK bytes and sends the chunks that
+ * big with MSG_ZEROCOPY, until the kernel reports it copied one anyway
+ * (0, the default, always copies). notsent_lowat bounds the bytes a
+ * connection keeps queued but unsent in the kernel (AWS_NOTSENT_LOWAT by
+ * default, 0 for no bound), so writes follow the pace of the peer.
+ * http3_alt_svc advertises an HTTP/3 endpoint on that UDP port in the
+ * Alt-Svc field of HTTP/1.1 replies, for max_age seconds (a day by
+ * default). The server has no QUIC stack of its own: set it only when
+ * something else on the host, such as a QUIC terminating proxy in front
+ * of it, answers HTTP/3 there. It is off by default.
+ * prewarm walks the site trees at startup (scan) and opens the files
+ * listed in the hot list before accepting; save rewrites the list with
+ * the cached files when the server is stopped by SIGINT or SIGTERM.
+ * metaindex maps an index of file metadata at startup and rewrites it,
+ * merged with the cached files, on the same signals. etag content
+ * replaces the ETags derived from mtime and size, which differ between
+ * hosts serving the same tree, with a hash of the contents computed in
+ * the background; replies sent before it is ready carry the weak
+ * mtime-size one. shmcache keeps the contents of files up to the max
+ * size (64 KiB by default) in the POSIX shared memory segment /name,
+ * created with size bytes by the first process that uses it, instead of
+ * in memcache. root and route set up the top level site until the first
+ * host line; each host line starts a new site, served for the given
+ * names and inheriting the top level root. default makes the current
+ * site answer unknown hosts instead of the top level one. Text after '#'
+ * is a comment. Errors are reported with their line number on stderr and
+ * make the function return -1.
+ */
+int config_load(struct server_config *config, const char *path);
+
+void config_free(struct server_config *config);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONFIG_H_ */
@@ -0,0 +1,362 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aws.h"
+#include "etag.h"
+#include "response.h"
+#include "utils/debug.h"
+
+#define PRIME64_1	11400714785074694791ULL
+#define PRIME64_2	14029467366897019727ULL
+#define PRIME64_3	1609587929392839161ULL
+#define PRIME64_4	9650029242287828579ULL
+#define PRIME64_5	2870177450012600261ULL
+
+/* A file being hashed; the entry is referenced until the job is applied */
+struct etag_job {
+	struct fd_entry *entry;
+	/* empty if the file changed or could not be read */
+	char etag[RESPONSE_ETAG_MAX];
+	struct etag_job *next;
+};
+
+/* Jobs handed to the threads and the results they hand back */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct etag_job *todo;
+	struct etag_job **todo_tail;
+	struct etag_job *done;
+	int stop;
+	int efd;
+	pthread_t threads[ETAG_MAX_THREADS];
+	unsigned int nthreads;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.efd = -1,
+};
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+// Lanes are read little endian, as on every host the server runs on
+static inline uint64_t read64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+// Function to consume 32-byte stripes, the four lanes independent
+static void xxh64_stripes(struct xxh64 *h, const unsigned char *p, size_t n)
+{
+	uint64_t v0 = h->v[0], v1 = h->v[1], v2 = h->v[2], v3 = h->v[3];
+
+	for (; n; n--, p += 32) {
+		v0 = xxh64_round(v0, read64(p));
+		v1 = xxh64_round(v1, read64(p + 8));
+		v2 = xxh64_round(v2, read64(p + 16));
+		v3 = xxh64_round(v3, read64(p + 24));
+	}
+	h->v[0] = v0;
+	h->v[1] = v1;
+	h->v[2] = v2;
+	h->v[3] = v3;
+}
+
+void xxh64_init(struct xxh64 *h, uint64_t seed)
+{
+	memset(h, 0, sizeof(*h));
+	h->v[0] = seed + PRIME64_1 + PRIME64_2;
+	h->v[1] = seed + PRIME64_2;
+	h->v[2] = seed;
+	h->v[3] = seed - PRIME64_1;
+}
+
+void xxh64_update(struct xxh64 *h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t n;
+
+	h->total += len;
+	if (h->buf_len) {
+		n = sizeof(h->buf) - h->buf_len;
+		if (n > len)
+			n = len;
+		memcpy(h->buf + h->buf_len, p, n);
+		h->buf_len += n;
+		p += n;
+		len -= n;
+		if (h->buf_len < sizeof(h->buf))
+			return;
+		xxh64_stripes(h, h->buf, 1);
+		h->buf_len = 0;
+	}
+
+	xxh64_stripes(h, p, len / 32);
+	p += len & ~(size_t)31;
+	len &= 31;
+	memcpy(h->buf, p, len);
+	h->buf_len = len;
+}
+
+uint64_t xxh64_digest(const struct xxh64 *h)
+{
+	const unsigned char *p = h->buf, *end = h->buf + h->buf_len;
+	uint64_t acc;
+
+	if (h->total >= 32) {
+		acc = rotl64(h->v[0], 1) + rotl64(h->v[1], 7) + rotl64(h->v[2], 12) +
+		      rotl64(h->v[3], 18);
+		acc = xxh64_merge(acc, h->v[0]);
+		acc = xxh64_merge(acc, h->v[1]);
+		acc = xxh64_merge(acc, h->v[2]);
+		acc = xxh64_merge(acc, h->v[3]);
+	} else {
+		// Only the seed is in v[2] then
+		acc = h->v[2] + PRIME64_5;
+	}
+	acc += h->total;
+
+	for (; p + 8 <= end; p += 8) {
+		acc ^= xxh64_round(0, read64(p));
+		acc = rotl64(acc, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		acc ^= (uint64_t)read32(p) * PRIME64_1;
+		acc = rotl64(acc, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		acc ^= *p * PRIME64_5;
+		acc = rotl64(acc, 11) * PRIME64_1;
+	}
+
+	acc ^= acc >> 33;
+	acc *= PRIME64_2;
+	acc ^= acc >> 29;
+	acc *= PRIME64_3;
+	acc ^= acc >> 32;
+
+	return acc;
+}
+
+int etag_hash_fd(int fd, off_t size, void *buf, uint64_t *hash)
+{
+	struct xxh64 h;
+	off_t pos = 0;
+	ssize_t n;
+
+	xxh64_init(&h, 0);
+	while (pos < size) {
+		n = pread(fd, buf, ETAG_CHUNK, pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		xxh64_update(&h, buf, n);
+		pos += n;
+	}
+	*hash = xxh64_digest(&h);
+
+	return 0;
+}
+
+// Function to hash a file, leaving etag empty if it changed meanwhile
+static void hash_file(struct etag_job *job, void *buf)
+{
+	const struct stat *st = &job->entry->st;
+	struct stat now;
+	uint64_t hash;
+
+	job->etag[0] = '\0';
+	if (etag_hash_fd(job->entry->fd, st->st_size, buf, &hash) < 0)
+		return;
+
+	// The weak ETag stays if the contents moved under us
+	if (fstat(job->entry->fd, &now) < 0 || now.st_size != st->st_size ||
+	    now.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+	    now.st_mtim.tv_nsec != st->st_mtim.tv_nsec)
+		return;
+	response_hash_etag(job->etag, hash);
+}
+
+static void *hash_thread(void *arg)
+{
+	struct etag_job *job;
+	uint64_t one = 1;
+	void *buf;
+
+	(void)arg;
+	buf = malloc(ETAG_CHUNK);
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (!pool.todo && !pool.stop)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		if (pool.stop)
+			break;
+		job = pool.todo;
+		pool.todo = job->next;
+		if (!pool.todo)
+			pool.todo_tail = &pool.todo;
+		pthread_mutex_unlock(&pool.lock);
+
+		if (buf)
+			hash_file(job, buf);
+		else
+			job->etag[0] = '\0';
+
+		pthread_mutex_lock(&pool.lock);
+		job->next = pool.done;
+		pool.done = job;
+		// The counter only wakes the loop, results are on the list
+		if (write(pool.efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			dlog(LOG_WARNING, "etag: cannot signal the event loop\n");
+	}
+	pthread_mutex_unlock(&pool.lock);
+	free(buf);
+
+	return NULL;
+}
+
+int etag_pool_init(unsigned int threads)
+{
+	unsigned int i;
+
+	if (threads > ETAG_MAX_THREADS)
+		threads = ETAG_MAX_THREADS;
+	pool.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pool.efd < 0)
+		return -1;
+	pool.todo = NULL;
+	pool.todo_tail = &pool.todo;
+	pool.stop = 0;
+
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&pool.threads[pool.nthreads], NULL, hash_thread, NULL) == 0)
+			pool.nthreads++;
+	if (!pool.nthreads) {
+		close(pool.efd);
+		pool.efd = -1;
+		return -1;
+	}
+
+	return pool.efd;
+}
+
+int etag_submit(struct fd_entry *entry)
+{
+	struct etag_job *job;
+
+	if (!pool.nthreads)
+		return -1;
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -1;
+	job->entry = entry;
+	entry->refs++;
+
+	pthread_mutex_lock(&pool.lock);
+	*pool.todo_tail = job;
+	pool.todo_tail = &job->next;
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	return 0;
+}
+
+void etag_handle_input(void)
+{
+	struct etag_job *job, *next;
+	uint64_t n;
+
+	if (read(pool.efd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	job = pool.done;
+	pool.done = NULL;
+	pthread_mutex_unlock(&pool.lock);
+
+	for (; job; job = next) {
+		next = job->next;
+		if (job->etag[0]) {
+			fdcache_set_etag(job->entry, job->etag);
+			server_stats.etag_hashes++;
+		}
+		fdcache_put(job->entry);
+		free(job);
+	}
+}
+
+// Function to free a list of jobs and the references they hold
+static void jobs_free(struct etag_job *job)
+{
+	struct etag_job *next;
+
+	for (; job; job = next) {
+		next = job->next;
+		fdcache_put(job->entry);
+		free(job);
+	}
+}
+
+void etag_pool_close(void)
+{
+	unsigned int i;
+
+	if (!pool.nthreads)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+	for (i = 0; i < pool.nthreads; i++)
+		pthread_join(pool.threads[i], NULL);
+	pool.nthreads = 0;
+
+	jobs_free(pool.todo);
+	jobs_free(pool.done);
+	pool.todo = NULL;
+	pool.todo_tail = &pool.todo;
+	pool.done = NULL;
+	close(pool.efd);
+	pool.efd = -1;
+}
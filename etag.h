@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef ETAG_H_
+#define ETAG_H_	1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fdcache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Threads hashing file contents unless the configuration sets more */
+#define ETAG_DEFAULT_THREADS	2
+#define ETAG_MAX_THREADS	16
+
+/* Bytes read from a file at once while hashing it */
+#define ETAG_CHUNK		(256 << 10)
+
+/* Streaming XXH64 */
+struct xxh64 {
+	uint64_t v[4];
+	uint64_t total;
+	unsigned char buf[32];
+	size_t buf_len;
+};
+
+void xxh64_init(struct xxh64 *h, uint64_t seed);
+void xxh64_update(struct xxh64 *h, const void *data, size_t len);
+uint64_t xxh64_digest(const struct xxh64 *h);
+
+/*
+ * XXH64 of the first size bytes of fd, read ETAG_CHUNK bytes at a time
+ * into buf. Returns 0, or -1 if the file is shorter or unreadable.
+ */
+int etag_hash_fd(int fd, off_t size, void *buf, uint64_t *hash);
+
+/*
+ * Start threads hashing the contents of cached files, for ETags that
+ * only change with the contents. Returns an eventfd readable when
+ * results are ready for etag_handle_input(), or -1 on error.
+ */
+int etag_pool_init(unsigned int threads);
+
+/*
+ * Queue entry to be hashed, taking a reference until the result is
+ * applied. Returns 0, or -1 if the pool is not running or out of memory.
+ */
+int etag_submit(struct fd_entry *entry);
+
+/* Give the finished hashes to their entries, from the event loop */
+void etag_handle_input(void);
+
+/* Stop the threads, dropping the jobs not done yet */
+void etag_pool_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ETAG_H_ */
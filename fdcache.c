@@ -0,0 +1,584 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "aws.h"
+#include "etag.h"
+#include "fdcache.h"
+#include "shmcache.h"
+
+static struct fd_entry **buckets;
+static size_t nbuckets;
+static size_t capacity;
+static size_t count;
+
+/* small file contents kept with the entries */
+static size_t data_max;
+static size_t data_budget;
+
+/* mappings of medium files kept with the entries */
+static size_t map_max;
+static size_t map_budget;
+
+/* seconds an entry is trusted, longer while changes are notified */
+static time_t revalidate_after = FDCACHE_REVALIDATE;
+
+/* A name that did not exist, and why */
+struct fd_negative {
+	int dirfd;
+	uint32_t hash;
+	int err;
+	time_t expires;
+	/* NULL when the slot is free */
+	char *name;
+};
+
+/* missing names, so repeated 404s need no path walk */
+static struct fd_negative negative[FDCACHE_NEGATIVE_SIZE];
+
+/* metadata saved by a previous run, validated as files are opened */
+static const struct metaindex *index_map;
+
+/* strong ETags hashed from the contents instead of derived from stat */
+static int hash_etags;
+
+/* admission and eviction of the cached entries */
+static struct tlfu policy;
+
+#define entry_of(node)	((struct fd_entry *)((char *)(node) - offsetof(struct fd_entry, lru)))
+
+// FNV-1a over the directory fd and the name
+static uint32_t fdcache_hash(int dirfd, const char *name, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	const unsigned char *p = (const unsigned char *)&dirfd;
+	size_t i;
+
+	for (i = 0; i < sizeof(dirfd); i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+// Function to drop empty and "." segments, so one file gets one entry
+static size_t canonical_name(char *dst, const char *src)
+{
+	const char *start = src;
+	size_t len = 0, seg;
+
+	while (*src) {
+		while (*src == '/')
+			src++;
+		seg = strcspn(src, "/");
+		if (seg && !(seg == 1 && src[0] == '.')) {
+			if (len)
+				dst[len++] = '/';
+			memcpy(dst + len, src, seg);
+			len += seg;
+		}
+		src += seg;
+	}
+	if (!len)
+		dst[len++] = '.';
+	// "file/" must still fail with ENOTDIR
+	if (src > start && src[-1] == '/')
+		dst[len++] = '/';
+	dst[len] = '\0';
+
+	return len;
+}
+
+static int same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// Function to take an entry out of the cache; transfers keep it alive
+static void entry_evict(struct fd_entry *entry)
+{
+	struct fd_entry **pp = &buckets[entry->hash & (nbuckets - 1)];
+
+	while (*pp != entry)
+		pp = &(*pp)->hnext;
+	*pp = entry->hnext;
+	tlfu_remove(&policy, &entry->lru);
+	entry->cached = 0;
+	count--;
+	if (entry->data && !entry->shared)
+		server_stats.fd_cache_bytes -= entry->st.st_size;
+	if (entry->map)
+		server_stats.fd_cache_mapped -= entry->st.st_size;
+	fdcache_put(entry);
+}
+
+/*
+ * Function to make room for size bytes of contents or mappings, evicting
+ * the coldest entries holding some, as long as they are requested less
+ * often than entry
+ */
+static int entry_make_room(struct fd_entry *entry, size_t size, const unsigned long *used,
+			   size_t budget, int mapped)
+{
+	unsigned int freq = tlfu_frequency(&policy, entry->hash);
+	struct tlfu_node *node, *next;
+	struct fd_entry *victim;
+
+	for (node = tlfu_colder(&policy, NULL); node && *used + size > budget; node = next) {
+		next = tlfu_colder(&policy, node);
+		victim = entry_of(node);
+		if (victim == entry || !(mapped ? victim->map != NULL : victim->data && !victim->shared))
+			continue;
+		if (tlfu_frequency(&policy, victim->hash) >= freq)
+			return -1;
+		entry_evict(victim);
+	}
+
+	return *used + size > budget ? -1 : 0;
+}
+
+// Function to read a small file into memory, making room in the budget
+static void entry_load(struct fd_entry *entry)
+{
+	size_t size = entry->st.st_size;
+
+	if (entry->data || !S_ISREG(entry->st.st_mode) || size == 0)
+		return;
+
+	// The other processes may have it already; either way there is one copy
+	if (size <= shmcache_file_max()) {
+		entry->data = (char *)shmcache_acquire(entry->fd, &entry->st, &entry->shm_pin);
+		entry->shared = entry->data != NULL;
+		return;
+	}
+
+	if (size > data_max || size > data_budget)
+		return;
+	if (entry_make_room(entry, size, &server_stats.fd_cache_bytes, data_budget, 0) < 0)
+		return;
+
+	entry->data = malloc(size);
+	if (!entry->data)
+		return;
+	// A file changing under us is served from its fd instead
+	if (pread(entry->fd, entry->data, size, 0) != (ssize_t)size) {
+		free(entry->data);
+		entry->data = NULL;
+		return;
+	}
+	server_stats.fd_cache_bytes += size;
+}
+
+// Function to map a file requested again, making room in the budget
+static void entry_map(struct fd_entry *entry)
+{
+	size_t size = entry->st.st_size;
+	void *map;
+
+	if (entry->map || entry->data || !S_ISREG(entry->st.st_mode) || size == 0 ||
+	    size > map_max || size > map_budget)
+		return;
+	if (entry_make_room(entry, size, &server_stats.fd_cache_mapped, map_budget, 1) < 0)
+		return;
+
+	// Populated up front, so sends never wait for page faults
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_POPULATE, entry->fd, 0);
+	if (map == MAP_FAILED)
+		return;
+	entry->map = map;
+	server_stats.fd_cache_mapped += size;
+}
+
+static struct fd_entry *entry_find(int dirfd, const char *name, uint32_t hash)
+{
+	struct fd_entry *entry;
+
+	for (entry = buckets[hash & (nbuckets - 1)]; entry; entry = entry->hnext)
+		if (entry->hash == hash && entry->dirfd == dirfd && !strcmp(entry->name, name))
+			return entry;
+
+	return NULL;
+}
+
+static void negative_drop(struct fd_negative *neg)
+{
+	free(neg->name);
+	neg->name = NULL;
+}
+
+static struct fd_negative *negative_find(int dirfd, const char *name, uint32_t hash)
+{
+	struct fd_negative *neg = &negative[hash % FDCACHE_NEGATIVE_SIZE];
+
+	if (neg->name && neg->hash == hash && neg->dirfd == dirfd && !strcmp(neg->name, name))
+		return neg;
+
+	return NULL;
+}
+
+// Function to remember a missing name, replacing whatever shared its slot
+static void negative_add(int dirfd, const char *name, uint32_t hash, int err, time_t now)
+{
+	struct fd_negative *neg = &negative[hash % FDCACHE_NEGATIVE_SIZE];
+
+	negative_drop(neg);
+	neg->name = strdup(name);
+	if (!neg->name)
+		return;
+	neg->dirfd = dirfd;
+	neg->hash = hash;
+	neg->err = err;
+	// Without change notification, trust it no longer than an entry
+	neg->expires = now + (revalidate_after < FDCACHE_NEGATIVE_TTL ?
+			      revalidate_after : FDCACHE_NEGATIVE_TTL);
+}
+
+// Function to check if an indexed ETag is of the kind configured
+static int etag_current(const char *etag)
+{
+	if (hash_etags)
+		return response_etag_is_hash(etag);
+
+	return etag[0] == '"';
+}
+
+static struct fd_entry *entry_create(int dirfd, const char *name, uint32_t hash, time_t now)
+{
+	const struct metaindex_record *rec = NULL;
+	struct fd_entry *entry;
+	int err;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return NULL;
+	entry->name = strdup(name);
+	if (!entry->name) {
+		free(entry);
+		return NULL;
+	}
+
+	entry->fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (entry->fd < 0 || fstat(entry->fd, &entry->st) < 0) {
+		err = errno;
+		if (entry->fd >= 0)
+			close(entry->fd);
+		free(entry->name);
+		free(entry);
+		errno = err;
+		return NULL;
+	}
+
+	if (index_map && S_ISREG(entry->st.st_mode)) {
+		rec = metaindex_find(index_map, name, &entry->st);
+		if (rec)
+			server_stats.metaindex_hits++;
+		else
+			server_stats.metaindex_misses++;
+	}
+	if (rec) {
+		entry->content_type = response_content_type_from_id(rec->content_type);
+		memcpy(entry->etag, rec->etag, sizeof(entry->etag));
+		entry->etag[sizeof(entry->etag) - 1] = '\0';
+	} else {
+		entry->content_type = response_content_type(name);
+	}
+	// Another process may have hashed it already
+	if (S_ISREG(entry->st.st_mode) && hash_etags && !etag_current(entry->etag))
+		shmcache_etag(&entry->st, entry->etag);
+	// Until its contents are hashed, a file only gets a weak ETag
+	if (S_ISREG(entry->st.st_mode) && !etag_current(entry->etag))
+		response_stat_etag(entry->etag, entry->st.st_mtime, entry->st.st_size, hash_etags);
+	response_file_headers(&entry->hdr, entry->st.st_mtime, entry->content_type,
+			      entry->etag[0] ? entry->etag : NULL);
+	entry->refs = 1;
+	entry->dirfd = dirfd;
+	entry->hash = hash;
+	entry->checked = now;
+
+	return entry;
+}
+
+int fdcache_init(size_t size, size_t max, size_t budget, size_t mmax, size_t mbudget)
+{
+	capacity = size;
+	data_max = max;
+	data_budget = budget;
+	map_max = mmax;
+	map_budget = mbudget;
+	if (!capacity)
+		return 0;
+
+	// Keep chains short: at least two buckets per entry
+	for (nbuckets = 16; nbuckets < capacity * 2; nbuckets *= 2)
+		;
+	buckets = calloc(nbuckets, sizeof(*buckets));
+	if (!buckets)
+		return -1;
+
+	return tlfu_init(&policy, capacity);
+}
+
+struct fd_entry *fdcache_open(int dirfd, const char *path)
+{
+	char name[PATH_MAX];
+	struct fd_entry *entry = NULL;
+	struct tlfu_node *victim;
+	struct fd_negative *neg;
+	time_t now = time(NULL);
+	struct stat st;
+	uint32_t hash;
+	size_t len;
+	int err;
+
+	if (strlen(path) + 2 > sizeof(name)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	len = canonical_name(name, path);
+	hash = fdcache_hash(dirfd, name, len);
+
+	// Every request counts towards the frequency of the name
+	if (capacity) {
+		tlfu_record(&policy, hash);
+		entry = entry_find(dirfd, name, hash);
+	}
+
+	// Trust the entry for a while, then make sure the name still leads to it
+	if (entry && (entry->stale || now - entry->checked >= revalidate_after)) {
+		if (fstatat(dirfd, name, &st, 0) == 0 && same_file(&st, &entry->st)) {
+			entry->checked = now;
+			entry->stale = 0;
+		} else {
+			entry->changed = 1;
+			entry_evict(entry);
+			entry = NULL;
+		}
+	}
+
+	if (entry) {
+		server_stats.fd_cache_hits++;
+		tlfu_hit(&policy, &entry->lru);
+		// Contents turned down when the file was opened may be wanted now
+		entry_load(entry);
+		entry_map(entry);
+		entry->refs++;
+		return entry;
+	}
+
+	// Known to be missing: answer without walking the path again
+	neg = capacity ? negative_find(dirfd, name, hash) : NULL;
+	if (neg && now < neg->expires) {
+		server_stats.fd_cache_negative_hits++;
+		errno = neg->err;
+		return NULL;
+	}
+	if (neg)
+		negative_drop(neg);
+
+	server_stats.fd_cache_misses++;
+	entry = entry_create(dirfd, name, hash, now);
+	if (!entry) {
+		err = errno;
+		if (capacity && (err == ENOENT || err == ENOTDIR))
+			negative_add(dirfd, name, hash, err, now);
+		errno = err;
+		return NULL;
+	}
+	if (!capacity)
+		return entry;
+
+	entry->hnext = buckets[hash & (nbuckets - 1)];
+	buckets[hash & (nbuckets - 1)] = entry;
+	entry->lru.hash = hash;
+	entry->cached = 1;
+	entry->refs++;
+	count++;
+
+	// Evicted files are closed once their transfers are done
+	victim = tlfu_admit(&policy, &entry->lru);
+	if (victim)
+		entry_evict(entry_of(victim));
+	entry_load(entry);
+
+	// Hashed once per file, the result outlives it in the metadata index
+	if (hash_etags && entry->etag[0] == 'W')
+		etag_submit(entry);
+
+	return entry;
+}
+
+// Function to unpin shared contents, so the segment can reuse their space
+static void entry_unshare(struct fd_entry *entry)
+{
+	shmcache_release(entry->shm_pin);
+	entry->data = NULL;
+	entry->shared = 0;
+}
+
+void fdcache_put(struct fd_entry *entry)
+{
+	if (!entry)
+		return;
+	// Shared contents are only pinned while replies use them
+	if (--entry->refs == 1 && entry->cached && entry->shared)
+		entry_unshare(entry);
+	if (entry->refs > 0)
+		return;
+
+	if (entry->map)
+		munmap(entry->map, entry->st.st_size);
+	if (entry->shared)
+		entry_unshare(entry);
+	close(entry->fd);
+	free(entry->data);
+	free(entry->name);
+	free(entry);
+}
+
+int fdcache_prewarm(int dirfd, const char *name)
+{
+	struct fd_entry *entry;
+
+	// Nothing outlives the request without a cache
+	if (!capacity)
+		return 0;
+
+	entry = fdcache_open(dirfd, name);
+	if (!entry)
+		return -1;
+	entry_map(entry);
+	fdcache_put(entry);
+
+	return 0;
+}
+
+void fdcache_walk(void (*fn)(const struct fd_entry *entry, void *arg), void *arg)
+{
+	struct tlfu_node *node;
+
+	for (node = tlfu_hotter(&policy, NULL); node; node = tlfu_hotter(&policy, node))
+		fn(entry_of(node), arg);
+}
+
+void fdcache_use_index(const struct metaindex *ix)
+{
+	index_map = ix;
+}
+
+void fdcache_hash_etags(int on)
+{
+	hash_etags = on;
+}
+
+void fdcache_set_etag(struct fd_entry *entry, const char *etag)
+{
+	// Replies copy the rendered fields, so they can change under them
+	if (entry->changed)
+		return;
+	snprintf(entry->etag, sizeof(entry->etag), "%s", etag);
+	response_file_headers(&entry->hdr, entry->st.st_mtime, entry->content_type, entry->etag);
+	shmcache_set_etag(&entry->st, entry->etag);
+}
+
+void fdcache_watched(int watched)
+{
+	revalidate_after = watched ? FDCACHE_REVALIDATE_WATCHED : FDCACHE_REVALIDATE;
+}
+
+static void invalidate_name(int dirfd, const char *name, size_t len)
+{
+	uint32_t hash = fdcache_hash(dirfd, name, len);
+	struct fd_negative *neg;
+	struct fd_entry *entry;
+
+	entry = entry_find(dirfd, name, hash);
+	if (entry) {
+		entry->changed = 1;
+		entry_evict(entry);
+	}
+	neg = negative_find(dirfd, name, hash);
+	if (neg)
+		negative_drop(neg);
+}
+
+void fdcache_invalidate(int dirfd, const char *path)
+{
+	char name[PATH_MAX];
+	size_t len;
+
+	if (!capacity || strlen(path) + 2 > sizeof(name))
+		return;
+
+	// A directory may be cached with and without its trailing slash
+	len = canonical_name(name, path);
+	if (name[len - 1] == '/')
+		name[--len] = '\0';
+	invalidate_name(dirfd, name, len);
+
+	name[len++] = '/';
+	name[len] = '\0';
+	invalidate_name(dirfd, name, len);
+}
+
+static int name_in_tree(const char *name, const char *dir, size_t len)
+{
+	if (len == 1 && dir[0] == '.')
+		return 1;
+
+	return !strncmp(name, dir, len) && (name[len] == '\0' || name[len] == '/');
+}
+
+void fdcache_invalidate_tree(int dirfd, const char *path)
+{
+	char dir[PATH_MAX];
+	struct tlfu_node *node, *next;
+	struct fd_entry *entry;
+	size_t len, i;
+
+	if (!capacity || strlen(path) + 2 > sizeof(dir))
+		return;
+
+	len = canonical_name(dir, path);
+	if (dir[len - 1] == '/')
+		dir[--len] = '\0';
+
+	// Whole trees only change on mkdir, rename or rmdir, a full walk is fine
+	for (node = tlfu_colder(&policy, NULL); node; node = next) {
+		next = tlfu_colder(&policy, node);
+		entry = entry_of(node);
+		if (entry->dirfd == dirfd && name_in_tree(entry->name, dir, len)) {
+			entry->changed = 1;
+			entry_evict(entry);
+		}
+	}
+	for (i = 0; i < FDCACHE_NEGATIVE_SIZE; i++)
+		if (negative[i].name && negative[i].dirfd == dirfd &&
+		    name_in_tree(negative[i].name, dir, len))
+			negative_drop(&negative[i]);
+}
+
+void fdcache_revalidate_all(void)
+{
+	struct tlfu_node *node;
+	size_t i;
+
+	for (node = tlfu_colder(&policy, NULL); node; node = tlfu_colder(&policy, node))
+		entry_of(node)->stale = 1;
+	for (i = 0; i < FDCACHE_NEGATIVE_SIZE; i++)
+		negative_drop(&negative[i]);
+}
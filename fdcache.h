@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef FDCACHE_H_
+#define FDCACHE_H_	1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "metaindex.h"
+#include "response.h"
+#include "tinylfu.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Open files kept around unless the configuration sets fdcache */
+#define FDCACHE_DEFAULT_SIZE	256
+
+/* Files up to this size are also kept in memory, within the byte budget */
+#define FDCACHE_DEFAULT_DATA_MAX	8192
+#define FDCACHE_DEFAULT_DATA_BUDGET	(8 << 20)
+
+/* Seconds a cached entry is trusted before it is checked with fstatat() */
+#define FDCACHE_REVALIDATE	1
+
+/*
+ * Same, while change notification invalidates entries; only files reached
+ * through symlinked directories, which are not watched, rely on it
+ */
+#define FDCACHE_REVALIDATE_WATCHED	60
+
+/* Names found missing, direct mapped, and how long they are believed to be */
+#define FDCACHE_NEGATIVE_SIZE	1024
+#define FDCACHE_NEGATIVE_TTL	5
+
+/* An open file with what replies need to know about it */
+struct fd_entry {
+	int fd;
+	struct stat st;
+	const char *content_type;
+	/* regular files only, else empty; weak while the contents are hashed */
+	char etag[RESPONSE_ETAG_MAX];
+	/* Last-Modified, ETag and Content-Type, rendered when the file is opened */
+	struct file_headers hdr;
+	/* contents of a small file, read when it is opened or hit; else NULL */
+	char *data;
+	/* data lies in the shared segment, pinned while replies use it */
+	int shared;
+	uint64_t shm_pin;
+	/* medium file mapped with MAP_POPULATE once it is hit again; else NULL */
+	char *map;
+	/* dropped because the name now leads to other contents */
+	int changed;
+	/* the cache holds one reference while the entry is current */
+	int refs;
+	int cached;
+
+	/* key: canonical name relative to dirfd */
+	int dirfd;
+	char *name;
+	uint32_t hash;
+	/* when the name was last checked to still lead to this file */
+	time_t checked;
+	/* must be checked on the next hit, whatever its age */
+	int stale;
+	struct fd_entry *hnext;
+	/* place in the segments of the eviction policy */
+	struct tlfu_node lru;
+};
+
+/*
+ * Size the cache; 0 opens every file on each request. Regular files of
+ * up to data_max bytes are read into memory while the contents of the
+ * cached files fit in data_budget bytes. Other files of up to map_max
+ * bytes are mapped on their second hit while the mappings fit in
+ * map_budget bytes. Entries, contents and mappings are evicted under
+ * W-TinyLFU: a new file only displaces one requested less often. Call
+ * once.
+ */
+int fdcache_init(size_t capacity, size_t data_max, size_t data_budget,
+		 size_t map_max, size_t map_budget);
+
+/*
+ * Open name relative to dirfd, or reuse the entry a previous request
+ * opened. Entries not checked for FDCACHE_REVALIDATE seconds are compared
+ * with a fresh fstatat() and reopened if the file changed. Names that did
+ * not exist fail again with the same errno, without a lookup, for up to
+ * FDCACHE_NEGATIVE_TTL seconds. Takes a reference; returns NULL and sets
+ * errno on failure.
+ */
+struct fd_entry *fdcache_open(int dirfd, const char *name);
+
+/* Drop a reference taken by fdcache_open(); the last one closes the file */
+void fdcache_put(struct fd_entry *entry);
+
+/*
+ * Open name ahead of the first request for it, loading or mapping its
+ * contents as a repeated hit would. Returns 0, or -1 and sets errno.
+ */
+int fdcache_prewarm(int dirfd, const char *name);
+
+/* Call fn for every cached entry, the ones the policy keeps longest first */
+void fdcache_walk(void (*fn)(const struct fd_entry *entry, void *arg), void *arg);
+
+/*
+ * Take the content type and ETag of files opened from now on from ix
+ * when it has a current record of them; NULL stops using it.
+ */
+void fdcache_use_index(const struct metaindex *ix);
+
+/*
+ * Give files opened from now on a weak ETag, then a strong one from a
+ * hash of their contents once the etag threads computed it. Index
+ * records are only used if they hold such a hash.
+ */
+void fdcache_hash_etags(int on);
+
+/* Replace the ETag of entry and render its header fields again */
+void fdcache_set_etag(struct fd_entry *entry, const char *etag);
+
+/* Trust entries for FDCACHE_REVALIDATE_WATCHED seconds instead while set */
+void fdcache_watched(int watched);
+
+/* Drop the entry of name relative to dirfd, or the record of it missing */
+void fdcache_invalidate(int dirfd, const char *name);
+
+/* Drop the entries of dir relative to dirfd and of everything below it */
+void fdcache_invalidate_tree(int dirfd, const char *dir);
+
+/* Check every entry again on its next hit and forget missing names */
+void fdcache_revalidate_all(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FDCACHE_H_ */
@@ -0,0 +1,352 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aws.h"
+#include "fdcache.h"
+#include "fswatch.h"
+
+/* Whatever can make a cached name lead to other contents or metadata */
+#define FSWATCH_MASK	(IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+			 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static struct watch_dir **bucket(struct fs_watch *w, int wd)
+{
+	return &w->buckets[(unsigned int)wd & (FSWATCH_BUCKETS - 1)];
+}
+
+// Function to hash the first len bytes of a path of a site (FNV-1a)
+static struct watch_dir **path_bucket(struct fs_watch *w, const struct site *site,
+				      const char *path, size_t len)
+{
+	uint32_t h = 2166136261u ^ (uint32_t)(uintptr_t)site;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)path[i];
+		h *= 16777619u;
+	}
+
+	return &w->paths[h & (FSWATCH_BUCKETS - 1)];
+}
+
+// Function to find the live record of the first len bytes of path
+static struct watch_dir *path_find(struct fs_watch *w, const struct site *site,
+				   const char *path, size_t len)
+{
+	struct watch_dir *dir;
+
+	for (dir = *path_bucket(w, site, path, len); dir; dir = dir->path_next)
+		if (dir->site == site && !dir->removed && strlen(dir->path) == len &&
+		    !memcmp(dir->path, path, len))
+			return dir;
+
+	return NULL;
+}
+
+// Function to link dir under the record of its parent directory, if watched
+static void tree_link(struct fs_watch *w, struct watch_dir *dir)
+{
+	size_t len = strlen(dir->path);
+
+	if (!len)
+		return;
+	// "a/b/" is below "a/", the root "" holds the top level
+	for (len--; len && dir->path[len - 1] != '/'; len--)
+		;
+	dir->parent = path_find(w, dir->site, dir->path, len);
+	if (!dir->parent)
+		return;
+	dir->sibling = dir->parent->child;
+	if (dir->sibling)
+		dir->sibling->sibling_prev = dir;
+	dir->parent->child = dir;
+}
+
+static void path_unlink(struct fs_watch *w, struct watch_dir *dir)
+{
+	struct watch_dir **pp = path_bucket(w, dir->site, dir->path, strlen(dir->path));
+
+	for (; *pp; pp = &(*pp)->path_next) {
+		if (*pp == dir) {
+			*pp = dir->path_next;
+			return;
+		}
+	}
+}
+
+static void tree_unlink(struct watch_dir *dir)
+{
+	struct watch_dir *child;
+
+	// Children forgotten later must not reach back to dir
+	for (child = dir->child; child; child = child->sibling)
+		child->parent = NULL;
+
+	if (dir->sibling)
+		dir->sibling->sibling_prev = dir->sibling_prev;
+	if (dir->sibling_prev)
+		dir->sibling_prev->sibling = dir->sibling;
+	else if (dir->parent)
+		dir->parent->child = dir->sibling;
+}
+
+// Function to watch one directory; returns 1 if the site already watches it
+static int watch_add(struct fs_watch *w, const struct site *site, const char *path)
+{
+	struct watch_dir *dir, **head;
+	char full[PATH_MAX];
+	int wd, len;
+
+	len = snprintf(full, sizeof(full), "%s%s", site->document_root, path);
+	if (len < 0 || (size_t)len >= sizeof(full)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	wd = inotify_add_watch(w->fd, full, FSWATCH_MASK);
+	if (wd < 0)
+		return -1;
+
+	// The same directory seen twice, e.g. through a bind mount
+	head = bucket(w, wd);
+	for (dir = *head; dir; dir = dir->next)
+		if (dir->wd == wd && dir->site == site)
+			return 1;
+
+	dir = calloc(1, sizeof(*dir));
+	if (!dir)
+		return -1;
+	dir->path = strdup(path);
+	if (!dir->path) {
+		free(dir);
+		return -1;
+	}
+	dir->wd = wd;
+	dir->site = site;
+	dir->next = *head;
+	*head = dir;
+	tree_link(w, dir);
+	head = path_bucket(w, site, path, strlen(path));
+	dir->path_next = *head;
+	*head = dir;
+	w->ndirs++;
+
+	return 0;
+}
+
+// Function to watch path, relative to the site root, and every directory below it
+static int watch_tree(struct fs_watch *w, const struct site *site, const char *path)
+{
+	char sub[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	int fd, rc, is_dir;
+
+	rc = watch_add(w, site, path);
+	if (rc)
+		return rc < 0 ? -1 : 0;
+
+	// Symlinked directories are not followed, they may lead anywhere
+	fd = openat(site->root_fd, path[0] ? path : ".",
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+	d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return -1;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		if (de->d_type == DT_UNKNOWN)
+			is_dir = fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+				 S_ISDIR(st.st_mode);
+		else
+			is_dir = de->d_type == DT_DIR;
+		if (!is_dir)
+			continue;
+
+		rc = snprintf(sub, sizeof(sub), "%s%s/", path, de->d_name);
+		if (rc < 0 || (size_t)rc >= sizeof(sub) || watch_tree(w, site, sub) < 0) {
+			closedir(d);
+			return -1;
+		}
+	}
+	closedir(d);
+
+	return 0;
+}
+
+// Function to stop watching a tree that was renamed; its records go on IN_IGNORED
+static void watch_remove_tree(struct fs_watch *w, const struct site *site, const char *path)
+{
+	struct watch_dir *top, *dir;
+
+	top = path_find(w, site, path, strlen(path));
+	if (!top)
+		return;
+
+	// Preorder walk of the subtree through the child and sibling links
+	for (dir = top; dir; ) {
+		dir->removed = 1;
+		inotify_rm_watch(w->fd, dir->wd);
+		if (dir->child) {
+			dir = dir->child;
+			continue;
+		}
+		while (dir != top && !dir->sibling)
+			dir = dir->parent;
+		dir = dir == top ? NULL : dir->sibling;
+	}
+}
+
+// Function to free the records of a watch the kernel dropped
+static void watch_forget(struct fs_watch *w, int wd)
+{
+	struct watch_dir **pp = bucket(w, wd), *dir;
+
+	while ((dir = *pp) != NULL) {
+		if (dir->wd == wd) {
+			*pp = dir->next;
+			path_unlink(w, dir);
+			tree_unlink(dir);
+			free(dir->path);
+			free(dir);
+			w->ndirs--;
+		} else {
+			pp = &dir->next;
+		}
+	}
+}
+
+static void handle_event(struct fs_watch *w, const struct inotify_event *ev)
+{
+	struct watch_dir *dir, *next;
+	char name[PATH_MAX];
+	int root_fd, len;
+
+	server_stats.fs_events++;
+
+	// Events were lost, any entry may be stale
+	if (ev->mask & IN_Q_OVERFLOW) {
+		server_stats.fs_overflows++;
+		fdcache_revalidate_all();
+		return;
+	}
+	if (ev->mask & IN_IGNORED) {
+		watch_forget(w, ev->wd);
+		return;
+	}
+
+	for (dir = *bucket(w, ev->wd); dir; dir = next) {
+		next = dir->next;
+		if (dir->wd != ev->wd)
+			continue;
+		root_fd = dir->site->root_fd;
+
+		// Listings and index lookups depend on the entries of the directory
+		fdcache_invalidate(root_fd, dir->path[0] ? dir->path : ".");
+		if (!ev->len)
+			continue;
+
+		len = snprintf(name, sizeof(name), "%s%s/", dir->path, ev->name);
+		if (len < 0 || (size_t)len >= sizeof(name)) {
+			fdcache_revalidate_all();
+			continue;
+		}
+		if (!(ev->mask & IN_ISDIR)) {
+			name[len - 1] = '\0';
+			fdcache_invalidate(root_fd, name);
+			continue;
+		}
+
+		fdcache_invalidate_tree(root_fd, name);
+		if (ev->mask & IN_MOVED_FROM) {
+			watch_remove_tree(w, dir->site, name);
+		} else if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+			   watch_tree(w, dir->site, name) < 0) {
+			// Changes below it would go unnoticed
+			perror("inotify_add_watch");
+			fdcache_watched(0);
+		}
+	}
+}
+
+int fswatch_init(struct fs_watch *w, const struct site *sites)
+{
+	const struct site *site;
+
+	memset(w, 0, sizeof(*w));
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->fd < 0)
+		return -1;
+
+	for (site = sites; site; site = site->next) {
+		if (watch_tree(w, site, "") < 0) {
+			fswatch_close(w);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void fswatch_handle_input(struct fs_watch *w)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	for (;;) {
+		len = read(w->fd, buf, sizeof(buf));
+		if (len <= 0) {
+			if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				perror("read");
+			break;
+		}
+
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			handle_event(w, ev);
+		}
+	}
+}
+
+void fswatch_close(struct fs_watch *w)
+{
+	struct watch_dir *dir, *next;
+	size_t i;
+
+	for (i = 0; i < FSWATCH_BUCKETS; i++) {
+		for (dir = w->buckets[i]; dir; dir = next) {
+			next = dir->next;
+			free(dir->path);
+			free(dir);
+		}
+		w->buckets[i] = NULL;
+		w->paths[i] = NULL;
+	}
+	w->ndirs = 0;
+
+	if (w->fd >= 0)
+		close(w->fd);
+	w->fd = -1;
+}
@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef FSWATCH_H_
+#define FSWATCH_H_	1
+
+#include <stddef.h>
+
+#include "vhost.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Buckets of the watch descriptor and path tables, a power of two */
+#define FSWATCH_BUCKETS		1024
+
+/* A directory watched on behalf of one site */
+struct watch_dir {
+	int wd;
+	const struct site *site;
+	/* relative to the site root, "" or ending with '/' */
+	char *path;
+	/* inotify_rm_watch() called, the record goes with IN_IGNORED */
+	int removed;
+	/* chains of the watch descriptor and the (site, path) tables */
+	struct watch_dir *next;
+	struct watch_dir *path_next;
+	/* directories of the site below this one, so a moved tree is found whole */
+	struct watch_dir *parent;
+	struct watch_dir *child;
+	struct watch_dir *sibling;
+	struct watch_dir *sibling_prev;
+};
+
+/* inotify watches over the document root trees of the sites */
+struct fs_watch {
+	int fd;
+	struct watch_dir *buckets[FSWATCH_BUCKETS];
+	struct watch_dir *paths[FSWATCH_BUCKETS];
+	size_t ndirs;
+};
+
+/*
+ * Watch every directory below the roots of sites, symlinks excepted.
+ * Returns 0, or -1 if change notification is not available; the caller
+ * then keeps revalidating the caches periodically.
+ */
+int fswatch_init(struct fs_watch *w, const struct site *sites);
+
+/*
+ * Read the pending events and drop the cache entries they affect. When
+ * the event queue overflowed every entry is checked again on its next
+ * hit; if a new directory cannot be watched, periodic revalidation is
+ * turned back on.
+ */
+void fswatch_handle_input(struct fs_watch *w);
+
+void fswatch_close(struct fs_watch *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FSWATCH_H_ */
@@ -0,0 +1,558 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+
+#define HUFFMAN_EOS		256
+#define HUFFMAN_MAX_BITS	30
+
+struct static_entry {
+	const char *name;
+	size_t name_len;
+	const char *value;
+	size_t value_len;
+};
+
+#define ENTRY(n, v)	{ n, sizeof(n) - 1, v, sizeof(v) - 1 }
+
+/* RFC 7541, Appendix A; index 0 is unused */
+static const struct static_entry static_table[] = {
+	ENTRY("", ""),
+	ENTRY(":authority", ""),
+	ENTRY(":method", "GET"),
+	ENTRY(":method", "POST"),
+	ENTRY(":path", "/"),
+	ENTRY(":path", "/index.html"),
+	ENTRY(":scheme", "http"),
+	ENTRY(":scheme", "https"),
+	ENTRY(":status", "200"),
+	ENTRY(":status", "204"),
+	ENTRY(":status", "206"),
+	ENTRY(":status", "304"),
+	ENTRY(":status", "400"),
+	ENTRY(":status", "404"),
+	ENTRY(":status", "500"),
+	ENTRY("accept-charset", ""),
+	ENTRY("accept-encoding", "gzip, deflate"),
+	ENTRY("accept-language", ""),
+	ENTRY("accept-ranges", ""),
+	ENTRY("accept", ""),
+	ENTRY("access-control-allow-origin", ""),
+	ENTRY("age", ""),
+	ENTRY("allow", ""),
+	ENTRY("authorization", ""),
+	ENTRY("cache-control", ""),
+	ENTRY("content-disposition", ""),
+	ENTRY("content-encoding", ""),
+	ENTRY("content-language", ""),
+	ENTRY("content-length", ""),
+	ENTRY("content-location", ""),
+	ENTRY("content-range", ""),
+	ENTRY("content-type", ""),
+	ENTRY("cookie", ""),
+	ENTRY("date", ""),
+	ENTRY("etag", ""),
+	ENTRY("expect", ""),
+	ENTRY("expires", ""),
+	ENTRY("from", ""),
+	ENTRY("host", ""),
+	ENTRY("if-match", ""),
+	ENTRY("if-modified-since", ""),
+	ENTRY("if-none-match", ""),
+	ENTRY("if-range", ""),
+	ENTRY("if-unmodified-since", ""),
+	ENTRY("last-modified", ""),
+	ENTRY("link", ""),
+	ENTRY("location", ""),
+	ENTRY("max-forwards", ""),
+	ENTRY("proxy-authenticate", ""),
+	ENTRY("proxy-authorization", ""),
+	ENTRY("range", ""),
+	ENTRY("referer", ""),
+	ENTRY("refresh", ""),
+	ENTRY("retry-after", ""),
+	ENTRY("server", ""),
+	ENTRY("set-cookie", ""),
+	ENTRY("strict-transport-security", ""),
+	ENTRY("transfer-encoding", ""),
+	ENTRY("user-agent", ""),
+	ENTRY("vary", ""),
+	ENTRY("via", ""),
+	ENTRY("www-authenticate", ""),
+};
+
+#define STATIC_TABLE_LEN	(sizeof(static_table) / sizeof(static_table[0]) - 1)
+
+/* RFC 7541, Appendix B: code (right aligned) and length in bits, by symbol */
+static const struct {
+	uint32_t code;
+	uint8_t bits;
+} huffman_table[HUFFMAN_EOS + 1] = {
+	{0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+	{0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+	{0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+	{0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+	{0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+	{0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+	{0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+	{0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+	{0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+	{0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+	{0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+	{0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+	{0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+	{0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+	{0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+	{0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+	{0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+	{0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+	{0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+	{0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+	{0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+	{0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+	{0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+	{0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+	{0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+	{0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+	{0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+	{0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+	{0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+	{0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+	{0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+	{0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+	{0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+	{0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+	{0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+	{0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+	{0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+	{0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+	{0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+	{0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+	{0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+	{0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+	{0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+	{0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+	{0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+	{0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+	{0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+	{0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+	{0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+	{0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+	{0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+	{0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+	{0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+	{0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+	{0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+	{0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+	{0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+	{0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+	{0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+	{0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+	{0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+	{0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+	{0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+	{0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+	{0x3fffffff, 30},
+};
+
+/*
+ * The HPACK code is canonical, so it can be decoded bit by bit knowing only
+ * how many codes exist of each length and the symbols sorted by code.
+ */
+static uint16_t huffman_count[HUFFMAN_MAX_BITS + 1];
+static uint16_t huffman_symbol[HUFFMAN_EOS + 1];
+static int huffman_ready;
+
+static void huffman_init(void)
+{
+	int bits, sym, n = 0;
+
+	if (huffman_ready)
+		return;
+
+	for (bits = 1; bits <= HUFFMAN_MAX_BITS; bits++) {
+		int first = n;
+
+		for (sym = 0; sym <= HUFFMAN_EOS; sym++) {
+			if (huffman_table[sym].bits != bits)
+				continue;
+
+			// Insertion sort by code within the same length
+			int i = n++;
+
+			while (i > first &&
+			       huffman_table[huffman_symbol[i - 1]].code > huffman_table[sym].code) {
+				huffman_symbol[i] = huffman_symbol[i - 1];
+				i--;
+			}
+			huffman_symbol[i] = sym;
+			huffman_count[bits]++;
+		}
+	}
+	huffman_ready = 1;
+}
+
+ssize_t hpack_huffman_decode(const uint8_t *src, size_t len,
+			     char *dst, size_t size)
+{
+	uint32_t code = 0, first = 0;
+	size_t index = 0, out = 0, i;
+	int bits = 0, b;
+
+	huffman_init();
+
+	for (i = 0; i < len; i++) {
+		for (b = 7; b >= 0; b--) {
+			uint32_t count;
+
+			code |= (src[i] >> b) & 1;
+			bits++;
+			count = huffman_count[bits];
+			// Found a complete code of this length
+			if (code - first < count) {
+				int sym = huffman_symbol[index + code - first];
+
+				if (sym == HUFFMAN_EOS || out >= size)
+					return -1;
+				dst[out++] = (char)sym;
+				code = first = 0;
+				index = 0;
+				bits = 0;
+				continue;
+			}
+			if (bits == HUFFMAN_MAX_BITS)
+				return -1;
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+	}
+
+	// Padding must be a prefix of EOS (all ones) shorter than a byte
+	if (bits > 7 || (code >> 1) != (1u << bits) - 1)
+		return -1;
+
+	return out;
+}
+
+void hpack_table_init(struct hpack_table *table, size_t max_size)
+{
+	memset(table, 0, sizeof(*table));
+	table->max_size = max_size;
+	table->settings_max = max_size;
+}
+
+// Function to get the entry at position i (0 is the newest)
+static struct hpack_entry *table_entry(struct hpack_table *table, size_t i)
+{
+	return &table->entries[(table->head + i) % table->cap];
+}
+
+// Function to drop the oldest entry of the dynamic table
+static void table_evict(struct hpack_table *table)
+{
+	struct hpack_entry *e = table_entry(table, table->count - 1);
+
+	table->size -= e->name_len + e->value_len + 32;
+	free(e->name);
+	memset(e, 0, sizeof(*e));
+	table->count--;
+}
+
+static void table_resize(struct hpack_table *table, size_t max_size)
+{
+	table->max_size = max_size;
+	while (table->count && table->size > table->max_size)
+		table_evict(table);
+}
+
+static int table_insert(struct hpack_table *table, const char *name, size_t name_len,
+			const char *value, size_t value_len)
+{
+	size_t esize = name_len + value_len + 32;
+	struct hpack_entry *e;
+
+	while (table->count && table->size + esize > table->max_size)
+		table_evict(table);
+
+	// An entry larger than the table just empties it (RFC 7541, 4.4)
+	if (esize > table->max_size)
+		return 0;
+
+	if (table->count == table->cap) {
+		size_t cap = table->cap ? table->cap * 2 : 16;
+		struct hpack_entry *entries = calloc(cap, sizeof(*entries));
+		size_t i;
+
+		if (!entries)
+			return -1;
+		for (i = 0; i < table->count; i++)
+			entries[i] = *table_entry(table, i);
+		free(table->entries);
+		table->entries = entries;
+		table->cap = cap;
+		table->head = 0;
+	}
+
+	table->head = (table->head + table->cap - 1) % table->cap;
+	e = &table->entries[table->head];
+	e->name = malloc(name_len + value_len + 1);
+	if (!e->name)
+		return -1;
+	memcpy(e->name, name, name_len);
+	memcpy(e->name + name_len, value, value_len);
+	e->name_len = name_len;
+	e->value = e->name + name_len;
+	e->value_len = value_len;
+	table->size += esize;
+	table->count++;
+
+	return 0;
+}
+
+void hpack_table_free(struct hpack_table *table)
+{
+	while (table->count)
+		table_evict(table);
+	free(table->entries);
+	table->entries = NULL;
+	table->cap = 0;
+}
+
+// Function to resolve a static or dynamic table index
+static int table_lookup(struct hpack_table *table, uint32_t index,
+			const char **name, size_t *name_len,
+			const char **value, size_t *value_len)
+{
+	if (index == 0)
+		return -1;
+
+	if (index <= STATIC_TABLE_LEN) {
+		*name = static_table[index].name;
+		*name_len = static_table[index].name_len;
+		*value = static_table[index].value;
+		*value_len = static_table[index].value_len;
+		return 0;
+	}
+
+	index -= STATIC_TABLE_LEN + 1;
+	if (index >= table->count)
+		return -1;
+
+	struct hpack_entry *e = table_entry(table, index);
+
+	*name = e->name;
+	*name_len = e->name_len;
+	*value = e->value;
+	*value_len = e->value_len;
+
+	return 0;
+}
+
+// Function to decode an integer with an N-bit prefix (RFC 7541, 5.1)
+static int decode_int(const uint8_t **p, const uint8_t *end, int prefix, uint32_t *out)
+{
+	uint32_t mask = (1u << prefix) - 1;
+	uint32_t value;
+	int shift = 0;
+
+	if (*p >= end)
+		return -1;
+
+	value = **p & mask;
+	(*p)++;
+	if (value < mask) {
+		*out = value;
+		return 0;
+	}
+
+	while (*p < end) {
+		uint8_t b = **p;
+
+		(*p)++;
+		// Anything above 2^28 is far beyond every limit we accept
+		if (shift > 21)
+			return -1;
+		value += (uint32_t)(b & 0x7f) << shift;
+		shift += 7;
+		if (!(b & 0x80)) {
+			*out = value;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+// Function to decode a string literal (RFC 7541, 5.2)
+static ssize_t decode_string(const uint8_t **p, const uint8_t *end, char *dst, size_t size)
+{
+	uint32_t len;
+	ssize_t n;
+	int huffman;
+
+	if (*p >= end)
+		return -1;
+
+	huffman = **p & 0x80;
+	if (decode_int(p, end, 7, &len) < 0 || len > (size_t)(end - *p))
+		return -1;
+
+	if (huffman) {
+		n = hpack_huffman_decode(*p, len, dst, size);
+	} else {
+		if (len > size)
+			return -1;
+		memcpy(dst, *p, len);
+		n = len;
+	}
+	*p += len;
+
+	return n;
+}
+
+int hpack_decode(struct hpack_table *table, const uint8_t *buf, size_t len,
+		 hpack_header_cb cb, void *arg)
+{
+	const uint8_t *p = buf, *end = buf + len;
+	char name_buf[HPACK_MAX_STRING];
+	char value_buf[HPACK_MAX_STRING];
+
+	while (p < end) {
+		const char *name, *value;
+		size_t name_len, value_len;
+		uint32_t index;
+		uint8_t b = *p;
+
+		// Indexed header field
+		if (b & 0x80) {
+			if (decode_int(&p, end, 7, &index) < 0 ||
+			    table_lookup(table, index, &name, &name_len, &value, &value_len) < 0)
+				return -1;
+			if (cb(arg, name, name_len, value, value_len))
+				return -1;
+			continue;
+		}
+
+		// Dynamic table size update
+		if ((b & 0xe0) == 0x20) {
+			if (decode_int(&p, end, 5, &index) < 0 || index > table->settings_max)
+				return -1;
+			table_resize(table, index);
+			continue;
+		}
+
+		// Literal header field, with or without indexing
+		int incremental = (b & 0xc0) == 0x40;
+		ssize_t n;
+
+		if (decode_int(&p, end, incremental ? 6 : 4, &index) < 0)
+			return -1;
+
+		if (index) {
+			// Copy the name, inserting may evict the entry it points to
+			if (table_lookup(table, index, &name, &name_len, &value, &value_len) < 0)
+				return -1;
+			memcpy(name_buf, name, name_len);
+		} else {
+			n = decode_string(&p, end, name_buf, sizeof(name_buf));
+			if (n < 0)
+				return -1;
+			name_len = n;
+		}
+
+		n = decode_string(&p, end, value_buf, sizeof(value_buf));
+		if (n < 0)
+			return -1;
+		value_len = n;
+
+		if (incremental &&
+		    table_insert(table, name_buf, name_len, value_buf, value_len) < 0)
+			return -1;
+
+		if (cb(arg, name_buf, name_len, value_buf, value_len))
+			return -1;
+	}
+
+	return 0;
+}
+
+// Function to encode an integer with an N-bit prefix
+static size_t encode_int(uint8_t *out, size_t size, uint8_t first, int prefix, uint32_t value)
+{
+	uint32_t mask = (1u << prefix) - 1;
+	size_t n = 0;
+
+	if (!size)
+		return 0;
+
+	if (value < mask) {
+		out[0] = first | value;
+		return 1;
+	}
+
+	out[n++] = first | mask;
+	value -= mask;
+	while (value >= 0x80) {
+		if (n >= size)
+			return 0;
+		out[n++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	if (n >= size)
+		return 0;
+	out[n++] = value;
+
+	return n;
+}
+
+size_t hpack_encode_literal(uint8_t *out, size_t size,
+			    enum hpack_static_name name,
+			    const char *value, size_t value_len)
+{
+	size_t n, m;
+
+	// Literal header field without indexing, indexed name
+	n = encode_int(out, size, 0x00, 4, name);
+	if (!n)
+		return 0;
+	m = encode_int(out + n, size - n, 0x00, 7, value_len);
+	if (!m || value_len > size - n - m)
+		return 0;
+	memcpy(out + n + m, value, value_len);
+
+	return n + m + value_len;
+}
+
+size_t hpack_encode_status(uint8_t *out, size_t size, int status)
+{
+	char value[4];
+	int index;
+
+	switch (status) {
+	case 200: index = 8; break;
+	case 204: index = 9; break;
+	case 206: index = 10; break;
+	case 304: index = 11; break;
+	case 400: index = 12; break;
+	case 404: index = 13; break;
+	case 500: index = 14; break;
+	default: index = 0; break;
+	}
+
+	if (index) {
+		if (!size)
+			return 0;
+		out[0] = 0x80 | index;
+		return 1;
+	}
+
+	value[0] = '0' + (status / 100) % 10;
+	value[1] = '0' + (status / 10) % 10;
+	value[2] = '0' + status % 10;
+	value[3] = '\0';
+
+	return hpack_encode_literal(out, size, HPACK_STATUS, value, 3);
+}
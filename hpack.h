@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef HPACK_H_
+#define HPACK_H_	1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Default SETTINGS_HEADER_TABLE_SIZE (RFC 7541, Section 4.2) */
+#define HPACK_DEFAULT_TABLE_SIZE	4096
+
+/* Longest header name or value accepted by the decoder */
+#define HPACK_MAX_STRING		8192
+
+/* Static table indexes of the names used when encoding responses */
+enum hpack_static_name {
+	HPACK_STATUS		= 8,
+	HPACK_ALLOW		= 22,
+	HPACK_CACHE_CONTROL	= 24,
+	HPACK_CONTENT_LENGTH	= 28,
+	HPACK_CONTENT_TYPE	= 31,
+	HPACK_DATE		= 33,
+	HPACK_ETAG		= 34,
+	HPACK_EXPIRES		= 36,
+	HPACK_LAST_MODIFIED	= 44,
+	HPACK_SERVER		= 54
+};
+
+struct hpack_entry {
+	char *name;
+	size_t name_len;
+	char *value;
+	size_t value_len;
+};
+
+/* Decoder dynamic table, kept as a ring with the newest entry at head */
+struct hpack_table {
+	struct hpack_entry *entries;
+	size_t cap;
+	size_t head;
+	size_t count;
+	/* size as defined by RFC 7541: name + value + 32 per entry */
+	size_t size;
+	size_t max_size;
+	/* upper bound we advertised through SETTINGS_HEADER_TABLE_SIZE */
+	size_t settings_max;
+};
+
+/* Called once per decoded header field; non-zero return aborts decoding */
+typedef int (*hpack_header_cb)(void *arg, const char *name, size_t name_len,
+			       const char *value, size_t value_len);
+
+void hpack_table_init(struct hpack_table *table, size_t max_size);
+void hpack_table_free(struct hpack_table *table);
+
+/* Decode a complete header block. Returns 0 or -1 on COMPRESSION_ERROR. */
+int hpack_decode(struct hpack_table *table, const uint8_t *buf, size_t len,
+		 hpack_header_cb cb, void *arg);
+
+/*
+ * The encoder never touches the peer's dynamic table: statuses use the
+ * static table when possible and other fields are emitted as literals
+ * without indexing, with an indexed name and a raw (non-Huffman) value.
+ * Both return the number of bytes written or 0 if out is too small.
+ */
+size_t hpack_encode_status(uint8_t *out, size_t size, int status);
+size_t hpack_encode_literal(uint8_t *out, size_t size,
+			    enum hpack_static_name name,
+			    const char *value, size_t value_len);
+
+/* Huffman-decode len bytes of src into dst. Returns length or -1. */
+ssize_t hpack_huffman_decode(const uint8_t *src, size_t len,
+			     char *dst, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HPACK_H_ */
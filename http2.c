@@ -0,0 +1,1272 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libaio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aws.h"
+#include "hpack.h"
+#include "http2.h"
+#include "response.h"
+#include "utils/debug.h"
+#include "utils/util.h"
+#include "utils/w_epoll.h"
+
+#define HTTP2_MAX_WINDOW	0x7fffffff
+
+enum frame_type {
+	FRAME_DATA		= 0x0,
+	FRAME_HEADERS		= 0x1,
+	FRAME_PRIORITY		= 0x2,
+	FRAME_RST_STREAM	= 0x3,
+	FRAME_SETTINGS		= 0x4,
+	FRAME_PUSH_PROMISE	= 0x5,
+	FRAME_PING		= 0x6,
+	FRAME_GOAWAY		= 0x7,
+	FRAME_WINDOW_UPDATE	= 0x8,
+	FRAME_CONTINUATION	= 0x9,
+	FRAME_PRIORITY_UPDATE	= 0x10
+};
+
+#define FLAG_END_STREAM		0x01
+#define FLAG_ACK		0x01
+#define FLAG_END_HEADERS	0x04
+#define FLAG_PADDED		0x08
+#define FLAG_PRIORITY		0x20
+
+enum http2_error {
+	ERR_NO_ERROR		= 0x0,
+	ERR_PROTOCOL		= 0x1,
+	ERR_INTERNAL		= 0x2,
+	ERR_FLOW_CONTROL	= 0x3,
+	ERR_STREAM_CLOSED	= 0x5,
+	ERR_FRAME_SIZE		= 0x6,
+	ERR_REFUSED_STREAM	= 0x7,
+	ERR_CANCEL		= 0x8,
+	ERR_COMPRESSION		= 0x9,
+	ERR_ENHANCE_YOUR_CALM	= 0xb
+};
+
+enum settings_id {
+	SETTINGS_HEADER_TABLE_SIZE	= 0x1,
+	SETTINGS_ENABLE_PUSH		= 0x2,
+	SETTINGS_MAX_CONCURRENT_STREAMS	= 0x3,
+	SETTINGS_INITIAL_WINDOW_SIZE	= 0x4,
+	SETTINGS_MAX_FRAME_SIZE		= 0x5,
+	SETTINGS_MAX_HEADER_LIST_SIZE	= 0x6,
+	SETTINGS_NO_RFC7540_PRIORITIES	= 0x9
+};
+
+struct http2_stream {
+	uint32_t id;
+	/* session list, kept in ascending stream id order */
+	struct http2_stream *next;
+
+	enum resource_type res_type;
+	/* file entry shared through the descriptor cache, and its fd */
+	struct fd_entry *file;
+	int fd;
+	size_t file_size;
+	/* bytes already framed into DATA frames */
+	size_t sent;
+	int64_t send_window;
+
+	/* RFC 9218 priority */
+	uint8_t urgency;
+	uint8_t incremental;
+
+	/* RST_STREAM received while a frame or a read was still in flight */
+	int reset;
+
+	/* directory listing, sent from its shared buffer through buf */
+	struct autoindex *listing;
+
+	/* dynamic resources: one AIO read at a time into buf */
+	struct iocb iocb;
+	int aio_pending;
+	char *buf;
+	size_t buf_len;
+	size_t buf_pos;
+	size_t read_pos;
+};
+
+/* Fields of the request header block currently being decoded */
+struct http2_request {
+	char method[16];
+	char path[BUFSIZ];
+	int have_method;
+	int have_path;
+	/* picked by :authority, or by host when there is no :authority */
+	const struct site *site;
+	int have_authority;
+	int malformed;
+	uint8_t urgency;
+	uint8_t incremental;
+};
+
+struct http2_session {
+	struct connection *conn;
+	int sockfd;
+	int epollfd;
+	int epoll_in;
+	int epoll_out;
+
+	/* frame input, large enough for one frame of the size we advertise */
+	uint8_t in_buf[HTTP2_FRAME_HEADER_LEN + HTTP2_MAX_FRAME_SIZE];
+	size_t in_len;
+
+	/* HEADERS split across CONTINUATION frames */
+	uint8_t *hdr_block;
+	size_t hdr_len;
+	uint32_t hdr_stream;
+	int hdr_pending;
+
+	/* control and HEADERS frames, written between DATA frames */
+	uint8_t *out;
+	size_t out_len;
+	size_t out_pos;
+	size_t out_cap;
+
+	/* DATA frame on the wire: header, then payload via sendfile or send */
+	struct http2_stream *cur;
+	uint8_t cur_hdr[HTTP2_FRAME_HEADER_LEN];
+	size_t cur_hdr_sent;
+	size_t cur_left;
+
+	struct hpack_table decoder;
+	struct http2_request req;
+
+	/* peer SETTINGS and connection flow control */
+	uint32_t peer_max_frame;
+	int64_t peer_initial_window;
+	int64_t send_window;
+
+	struct http2_stream *streams;
+	uint32_t nstreams;
+	uint32_t last_stream_id;
+	/* round-robin cursor among incremental streams */
+	uint32_t rr_last;
+
+	int goaway_sent;
+	int goaway_recv;
+
+	/* control frames received in the current second */
+	time_t ctrl_window;
+	unsigned int ctrl_frames;
+
+	/* AIO context shared by all dynamic streams */
+	io_context_t aio_ctx;
+	int eventfd;
+};
+
+int http2_check_preface(const char *buf, size_t len)
+{
+	if (len < HTTP2_PREFACE_LEN)
+		return memcmp(buf, HTTP2_PREFACE, len) ? 0 : -1;
+
+	return memcmp(buf, HTTP2_PREFACE, HTTP2_PREFACE_LEN) ? 0 : 1;
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	       ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void frame_header(uint8_t *p, size_t len, uint8_t type, uint8_t flags, uint32_t stream_id)
+{
+	p[0] = len >> 16;
+	p[1] = len >> 8;
+	p[2] = len;
+	p[3] = type;
+	p[4] = flags;
+	put_u32(p + 5, stream_id & HTTP2_MAX_WINDOW);
+}
+
+// Function to append a frame to the output queue
+static int queue_frame(struct http2_session *s, uint8_t type, uint8_t flags,
+		       uint32_t stream_id, const void *payload, size_t len)
+{
+	size_t need = HTTP2_FRAME_HEADER_LEN + len;
+
+	// Reclaim the space of what was already written
+	if (s->out_pos == s->out_len)
+		s->out_pos = s->out_len = 0;
+
+	// A peer that does not read its replies gets no more of them
+	if (s->out_len - s->out_pos + need > HTTP2_OUT_MAX)
+		return -1;
+
+	if (s->out_len + need > s->out_cap) {
+		size_t cap = s->out_cap ? s->out_cap : 4096;
+		uint8_t *out;
+
+		while (cap < s->out_len + need)
+			cap *= 2;
+		out = realloc(s->out, cap);
+		if (!out)
+			return -1;
+		s->out = out;
+		s->out_cap = cap;
+	}
+
+	frame_header(s->out + s->out_len, len, type, flags, stream_id);
+	if (len)
+		memcpy(s->out + s->out_len + HTTP2_FRAME_HEADER_LEN, payload, len);
+	s->out_len += need;
+
+	return 0;
+}
+
+static int queue_rst_stream(struct http2_session *s, uint32_t stream_id, uint32_t code)
+{
+	uint8_t payload[4];
+
+	put_u32(payload, code);
+	return queue_frame(s, FRAME_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static int queue_window_update(struct http2_session *s, uint32_t stream_id, uint32_t inc)
+{
+	uint8_t payload[4];
+
+	put_u32(payload, inc);
+	return queue_frame(s, FRAME_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+// Function to fail the whole connection with GOAWAY
+static int session_error(struct http2_session *s, uint32_t code)
+{
+	uint8_t payload[8];
+
+	dlog(LOG_INFO, "h2 connection error %u\n", code);
+	if (!s->goaway_sent) {
+		put_u32(payload, s->last_stream_id);
+		put_u32(payload + 4, code);
+		queue_frame(s, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+		s->goaway_sent = 1;
+	}
+
+	return -1;
+}
+
+static struct http2_stream *stream_find(struct http2_session *s, uint32_t id)
+{
+	struct http2_stream *st;
+
+	for (st = s->streams; st; st = st->next)
+		if (st->id == id)
+			return st;
+
+	return NULL;
+}
+
+// Function to tell whether buf points into a listing or cached contents
+static int stream_buf_shared(const struct http2_stream *st)
+{
+	return st->listing || (st->file && st->file->data);
+}
+
+static void stream_free(struct http2_stream *st)
+{
+	// Listings and cached contents are shared, read buffers are our own
+	if (!stream_buf_shared(st))
+		free(st->buf);
+	autoindex_put(st->listing);
+	fdcache_put(st->file);
+	free(st);
+}
+
+// Function to drop a stream once nothing in flight references it
+static void stream_release(struct http2_session *s, struct http2_stream *st)
+{
+	struct http2_stream **pp;
+
+	st->reset = 1;
+	if (st->aio_pending || s->cur == st)
+		return;
+
+	for (pp = &s->streams; *pp; pp = &(*pp)->next) {
+		if (*pp == st) {
+			*pp = st->next;
+			break;
+		}
+	}
+	s->nstreams--;
+	stream_free(st);
+}
+
+static int session_aio_setup(struct http2_session *s)
+{
+	if (s->eventfd >= 0)
+		return 0;
+
+	if (io_setup(HTTP2_MAX_CONCURRENT_STREAMS, &s->aio_ctx) != 0) {
+		s->aio_ctx = NULL;
+		return -1;
+	}
+
+	s->eventfd = eventfd(0, EFD_NONBLOCK);
+	if (s->eventfd < 0)
+		return -1;
+
+	// Completions are reported to the connection like socket events
+	return w_epoll_add_ptr_in(s->epollfd, s->eventfd, s->conn);
+}
+
+// Function to read the next chunk of a dynamic stream
+static int stream_start_read(struct http2_session *s, struct http2_stream *st)
+{
+	struct iocb *piocb[1] = { &st->iocb };
+	size_t len = st->file_size - st->read_pos;
+
+	if (len > HTTP2_MAX_FRAME_SIZE)
+		len = HTTP2_MAX_FRAME_SIZE;
+
+	if (!st->buf) {
+		st->buf = malloc(HTTP2_MAX_FRAME_SIZE);
+		if (!st->buf)
+			return -1;
+	}
+
+	if (session_aio_setup(s) < 0)
+		return -1;
+
+	io_prep_pread(&st->iocb, st->fd, st->buf, len, st->read_pos);
+	io_set_eventfd(&st->iocb, s->eventfd);
+	st->iocb.data = st;
+	if (io_submit(s->aio_ctx, 1, piocb) != 1)
+		return -1;
+
+	st->aio_pending = 1;
+	st->buf_len = 0;
+	st->buf_pos = 0;
+
+	return 0;
+}
+
+// Function to collect the finished reads of dynamic streams
+static void session_reap_aio(struct http2_session *s)
+{
+	struct timespec zero = { 0, 0 };
+	struct io_event events[16];
+	uint64_t count;
+	int n, i;
+
+	if (read(s->eventfd, &count, sizeof(count)) < 0)
+		return;
+
+	do {
+		n = io_getevents(s->aio_ctx, 0, 16, events, &zero);
+		for (i = 0; i < n; i++) {
+			struct http2_stream *st = events[i].data;
+			long res = (long)events[i].res;
+
+			st->aio_pending = 0;
+			if (st->reset) {
+				stream_release(s, st);
+			} else if (res <= 0) {
+				queue_rst_stream(s, st->id, ERR_INTERNAL);
+				stream_release(s, st);
+			} else {
+				st->buf_len = res;
+				st->read_pos += res;
+			}
+		}
+	} while (n == 16);
+}
+
+/*
+ * Function to encode and queue the response HEADERS of a stream. Only
+ * successful responses carry Last-Modified (when file_stat is given),
+ * ETag (when etag is), Content-Length and the caching fields of their
+ * route.
+ */
+static int queue_response_headers(struct http2_session *s, uint32_t stream_id, int status,
+				  const char *content_type, const struct stat *file_stat,
+				  const char *etag, const struct cache_policy *cache,
+				  size_t content_length, int end_stream)
+{
+	uint8_t block[512];
+	char value[64];
+	const char *expires;
+	size_t n = 0, len;
+
+	server_stats_response(status);
+
+	n += hpack_encode_status(block + n, sizeof(block) - n, status);
+
+	n += hpack_encode_literal(block + n, sizeof(block) - n, HPACK_DATE,
+				  response_date(), RESPONSE_DATE_LEN);
+	n += hpack_encode_literal(block + n, sizeof(block) - n, HPACK_SERVER,
+				  "Apache/2.2.9", strlen("Apache/2.2.9"));
+
+	if (file_stat) {
+		format_date(file_stat->st_mtime, value, sizeof(value));
+		n += hpack_encode_literal(block + n, sizeof(block) - n, HPACK_LAST_MODIFIED,
+					  value, strlen(value));
+	}
+	if (etag)
+		n += hpack_encode_literal(block + n, sizeof(block) - n, HPACK_ETAG,
+					  etag, strlen(etag));
+	if (status == 200) {
+		len = response_format_uint(value, content_length);
+		n += hpack_encode_literal(block + n, sizeof(block) - n, HPACK_CONTENT_LENGTH,
+					  value, len);
+	}
+	n += hpack_encode_literal(block + n, sizeof(block) - n, HPACK_CONTENT_TYPE,
+				  content_type, strlen(content_type));
+	// Same methods the HTTP/1.1 405 lists
+	if (status == 405)
+		n += hpack_encode_literal(block + n, sizeof(block) - n, HPACK_ALLOW,
+					  "GET, HEAD", strlen("GET, HEAD"));
+	if (!file_stat && status == 200)
+		n += hpack_encode_literal(block + n, sizeof(block) - n, HPACK_CACHE_CONTROL,
+					  "no-cache", strlen("no-cache"));
+	if (cache && cache->value_len) {
+		n += hpack_encode_literal(block + n, sizeof(block) - n, HPACK_CACHE_CONTROL,
+					  cache->value, cache->value_len);
+		expires = response_expires(cache);
+		n += hpack_encode_literal(block + n, sizeof(block) - n, HPACK_EXPIRES,
+					  expires, RESPONSE_DATE_LEN);
+	}
+
+	return queue_frame(s, FRAME_HEADERS, FLAG_END_HEADERS | (end_stream ? FLAG_END_STREAM : 0),
+			   stream_id, block, n);
+}
+
+// Function to parse an RFC 9218 priority field value ("u=N, i")
+static void parse_priority(const char *value, size_t len, uint8_t *urgency, uint8_t *incremental)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		size_t start, end;
+
+		while (i < len && (value[i] == ' ' || value[i] == ','))
+			i++;
+		start = i;
+		while (i < len && value[i] != ',')
+			i++;
+		end = i;
+		while (end > start && value[end - 1] == ' ')
+			end--;
+
+		if (end - start == 3 && value[start] == 'u' && value[start + 1] == '=' &&
+		    value[start + 2] >= '0' && value[start + 2] <= '7')
+			*urgency = value[start + 2] - '0';
+		else if ((end - start == 1 && value[start] == 'i') ||
+			 (end - start == 4 && !memcmp(value + start, "i=?1", 4)))
+			*incremental = 1;
+		else if (end - start == 4 && !memcmp(value + start, "i=?0", 4))
+			*incremental = 0;
+	}
+}
+
+static int request_header_cb(void *arg, const char *name, size_t name_len,
+			     const char *value, size_t value_len)
+{
+	struct http2_request *req = arg;
+
+	if (name_len == 7 && !memcmp(name, ":method", 7)) {
+		if (value_len >= sizeof(req->method)) {
+			req->malformed = 1;
+			return 0;
+		}
+		memcpy(req->method, value, value_len);
+		req->method[value_len] = '\0';
+		req->have_method = 1;
+	} else if (name_len == 5 && !memcmp(name, ":path", 5)) {
+		if (value_len == 0 || value_len >= sizeof(req->path)) {
+			req->malformed = 1;
+			return 0;
+		}
+		memcpy(req->path, value, value_len);
+		req->path[value_len] = '\0';
+		req->have_path = 1;
+	} else if (name_len == 10 && !memcmp(name, ":authority", 10)) {
+		req->site = resolve_site(value, value_len);
+		req->have_authority = 1;
+	} else if (name_len == 4 && !memcmp(name, "host", 4) && !req->have_authority) {
+		req->site = resolve_site(value, value_len);
+	} else if (name_len == 8 && !memcmp(name, "priority", 8)) {
+		parse_priority(value, value_len, &req->urgency, &req->incremental);
+	}
+
+	return 0;
+}
+
+static int discard_header_cb(void *arg, const char *name, size_t name_len,
+			     const char *value, size_t value_len)
+{
+	(void)arg;
+	(void)name;
+	(void)name_len;
+	(void)value;
+	(void)value_len;
+
+	return 0;
+}
+
+// Function to open the resource of a new stream and queue its response
+static int stream_open(struct http2_session *s, uint32_t stream_id)
+{
+	struct http2_request *req = &s->req;
+	enum resource_type res_type = RESOURCE_TYPE_NONE;
+	const struct route *route;
+	char filename[BUFSIZ];
+	struct http2_stream *st, **pp;
+	struct autoindex *listing = NULL;
+	struct fd_entry *file = NULL;
+	const struct stat *file_stat;
+	const char *content_type = "text/html";
+	const char *etag = NULL;
+	struct stat dir_stat;
+	int head_only, status = 0;
+	char *query;
+
+	server_stats.requests++;
+
+	// The file name is built from the path only
+	query = strpbrk(req->path, "?#");
+	if (query)
+		*query = '\0';
+
+	// Same classification as the HTTP/1.1 path
+	head_only = !strcmp(req->method, "HEAD");
+	if (!head_only && strcmp(req->method, "GET")) {
+		status = 405;
+	} else {
+		route = resolve_route(req->site, req->path, filename, sizeof(filename));
+		res_type = route ? route->type : RESOURCE_TYPE_NONE;
+		// Event streams are only served over HTTP/1.1 for now
+		if (res_type == RESOURCE_TYPE_NONE || res_type == RESOURCE_TYPE_EVENTS)
+			status = 404;
+		else if (res_type != RESOURCE_TYPE_STATUS)
+			status = resource_open(req->site, route, filename, req->path, &file,
+					       &listing);
+	}
+
+	if (status)
+		return queue_response_headers(s, stream_id, status, "text/html", NULL, NULL, NULL,
+					      0, 1);
+
+	st = calloc(1, sizeof(*st));
+	if (!st) {
+		fdcache_put(file);
+		autoindex_put(listing);
+		return queue_rst_stream(s, stream_id, ERR_INTERNAL);
+	}
+	st->id = stream_id;
+	st->file = file;
+	st->fd = file ? file->fd : -1;
+	st->listing = listing;
+	st->res_type = res_type;
+	st->urgency = req->urgency;
+	st->incremental = req->incremental;
+	st->send_window = s->peer_initial_window;
+
+	// Stream ids only grow, so appending keeps the list sorted
+	for (pp = &s->streams; *pp; pp = &(*pp)->next)
+		;
+	*pp = st;
+	s->nstreams++;
+
+	if (res_type == RESOURCE_TYPE_STATUS) {
+		// The body is rendered up front and sent from memory
+		st->buf = malloc(BUFSIZ);
+		if (!st->buf) {
+			stream_release(s, st);
+			return queue_rst_stream(s, stream_id, ERR_INTERNAL);
+		}
+		st->buf_len = server_stats_render(st->buf, BUFSIZ);
+		st->file_size = st->buf_len;
+		st->read_pos = st->buf_len;
+
+		if (queue_response_headers(s, stream_id, 200, "text/plain", NULL, NULL, NULL,
+					   st->file_size, head_only || st->file_size == 0) < 0)
+			return -1;
+	} else {
+		if (listing) {
+			// Listings are sent from memory, whatever the route type
+			st->buf = listing->html;
+			st->buf_len = listing->len;
+			st->read_pos = listing->len;
+			st->file_size = listing->len;
+			memset(&dir_stat, 0, sizeof(dir_stat));
+			dir_stat.st_mtime = listing->mtime.tv_sec;
+			file_stat = &dir_stat;
+		} else {
+			// Small files are sent from the cached contents
+			if (file->data) {
+				st->buf = file->data;
+				st->buf_len = file->st.st_size;
+				st->read_pos = file->st.st_size;
+			}
+			st->file_size = file->st.st_size;
+			file_stat = &file->st;
+			content_type = file->content_type;
+			etag = file->etag;
+		}
+
+		if (queue_response_headers(s, stream_id, 200, content_type, file_stat, etag,
+					   &route->cache, st->file_size, head_only || st->file_size == 0) < 0)
+			return -1;
+	}
+
+	if (head_only || st->file_size == 0) {
+		stream_release(s, st);
+		return 0;
+	}
+
+	if (st->res_type == RESOURCE_TYPE_DYNAMIC && !stream_buf_shared(st) &&
+	    stream_start_read(s, st) < 0) {
+		stream_release(s, st);
+		return queue_rst_stream(s, stream_id, ERR_INTERNAL);
+	}
+
+	return 0;
+}
+
+// Function to handle a complete header block
+static int process_headers(struct http2_session *s, uint32_t stream_id,
+			   const uint8_t *block, size_t len)
+{
+	struct http2_request *req = &s->req;
+
+	// Trailers, or HEADERS on a stream we are done with: keep HPACK in sync
+	if (stream_id <= s->last_stream_id) {
+		if (hpack_decode(&s->decoder, block, len, discard_header_cb, NULL) < 0)
+			return session_error(s, ERR_COMPRESSION);
+		return 0;
+	}
+
+	s->last_stream_id = stream_id;
+	memset(req, 0, sizeof(*req));
+	req->urgency = HTTP2_DEFAULT_URGENCY;
+	req->site = s->conn->site;
+
+	if (hpack_decode(&s->decoder, block, len, request_header_cb, req) < 0)
+		return session_error(s, ERR_COMPRESSION);
+
+	if (s->goaway_sent)
+		return 0;
+
+	if (!req->have_method || !req->have_path || req->malformed)
+		return queue_rst_stream(s, stream_id, ERR_PROTOCOL);
+
+	if (s->nstreams >= HTTP2_MAX_CONCURRENT_STREAMS)
+		return queue_rst_stream(s, stream_id, ERR_REFUSED_STREAM);
+
+	return stream_open(s, stream_id);
+}
+
+static int header_block_append(struct http2_session *s, const uint8_t *p, size_t len)
+{
+	uint8_t *block;
+
+	if (s->hdr_len + len > HTTP2_MAX_HEADER_BLOCK)
+		return session_error(s, ERR_ENHANCE_YOUR_CALM);
+
+	block = realloc(s->hdr_block, s->hdr_len + len);
+	if (!block && s->hdr_len + len)
+		return session_error(s, ERR_INTERNAL);
+	s->hdr_block = block;
+	memcpy(s->hdr_block + s->hdr_len, p, len);
+	s->hdr_len += len;
+
+	return 0;
+}
+
+static int handle_settings(struct http2_session *s, uint8_t flags, uint32_t stream_id,
+			   const uint8_t *p, size_t len)
+{
+	size_t i;
+
+	if (stream_id)
+		return session_error(s, ERR_PROTOCOL);
+
+	if (flags & FLAG_ACK)
+		return len ? session_error(s, ERR_FRAME_SIZE) : 0;
+
+	if (len % 6)
+		return session_error(s, ERR_FRAME_SIZE);
+
+	for (i = 0; i < len; i += 6) {
+		uint16_t id = (p[i] << 8) | p[i + 1];
+		uint32_t value = get_u32(p + i + 2);
+		struct http2_stream *st;
+		int64_t delta;
+
+		switch (id) {
+		case SETTINGS_ENABLE_PUSH:
+			if (value > 1)
+				return session_error(s, ERR_PROTOCOL);
+			break;
+		case SETTINGS_INITIAL_WINDOW_SIZE:
+			if (value > HTTP2_MAX_WINDOW)
+				return session_error(s, ERR_FLOW_CONTROL);
+			// The change applies to every open stream (RFC 9113, 6.9.2)
+			delta = (int64_t)value - s->peer_initial_window;
+			s->peer_initial_window = value;
+			for (st = s->streams; st; st = st->next) {
+				st->send_window += delta;
+				if (st->send_window > HTTP2_MAX_WINDOW)
+					return session_error(s, ERR_FLOW_CONTROL);
+			}
+			break;
+		case SETTINGS_MAX_FRAME_SIZE:
+			if (value < 16384 || value > 16777215)
+				return session_error(s, ERR_PROTOCOL);
+			s->peer_max_frame = value;
+			break;
+		default:
+			// We never index into the peer's table, so its size is moot
+			break;
+		}
+	}
+
+	return queue_frame(s, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+static int handle_window_update(struct http2_session *s, uint32_t stream_id,
+				const uint8_t *p, size_t len)
+{
+	struct http2_stream *st;
+	uint32_t inc;
+
+	if (len != 4)
+		return session_error(s, ERR_FRAME_SIZE);
+
+	inc = get_u32(p) & HTTP2_MAX_WINDOW;
+	if (!stream_id) {
+		if (!inc)
+			return session_error(s, ERR_PROTOCOL);
+		s->send_window += inc;
+		if (s->send_window > HTTP2_MAX_WINDOW)
+			return session_error(s, ERR_FLOW_CONTROL);
+		return 0;
+	}
+
+	st = stream_find(s, stream_id);
+	if (!st || st->reset)
+		return 0;
+
+	if (!inc) {
+		stream_release(s, st);
+		return queue_rst_stream(s, stream_id, ERR_PROTOCOL);
+	}
+
+	st->send_window += inc;
+	if (st->send_window > HTTP2_MAX_WINDOW) {
+		stream_release(s, st);
+		return queue_rst_stream(s, stream_id, ERR_FLOW_CONTROL);
+	}
+
+	return 0;
+}
+
+// Function to refuse more control frames per second than a client needs
+static int session_count_control(struct http2_session *s)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if (now.tv_sec != s->ctrl_window) {
+		s->ctrl_window = now.tv_sec;
+		s->ctrl_frames = 0;
+	}
+	if (++s->ctrl_frames > HTTP2_MAX_CONTROL_FRAMES)
+		return session_error(s, ERR_ENHANCE_YOUR_CALM);
+
+	return 0;
+}
+
+// Function to dispatch one received frame
+static int handle_frame(struct http2_session *s, uint8_t type, uint8_t flags,
+			uint32_t stream_id, const uint8_t *p, size_t len)
+{
+	struct http2_stream *st;
+	size_t pad;
+
+	// Nothing may interleave with a header block (RFC 9113, 6.10)
+	if (s->hdr_pending && (type != FRAME_CONTINUATION || stream_id != s->hdr_stream))
+		return session_error(s, ERR_PROTOCOL);
+
+	// Frames that cost a reply or a stream teardown but request nothing
+	if ((type == FRAME_RST_STREAM || type == FRAME_PRIORITY ||
+	     ((type == FRAME_PING || type == FRAME_SETTINGS) && !(flags & FLAG_ACK))) &&
+	    session_count_control(s) < 0)
+		return -1;
+
+	switch (type) {
+	case FRAME_DATA:
+		if (!stream_id || stream_id > s->last_stream_id)
+			return session_error(s, ERR_PROTOCOL);
+		if ((flags & FLAG_PADDED) && (len < 1 || p[0] >= len))
+			return session_error(s, ERR_PROTOCOL);
+		// Request bodies are discarded, so give the credit straight back
+		if (len) {
+			if (queue_window_update(s, 0, len) < 0)
+				return -1;
+			st = stream_find(s, stream_id);
+			if (st && !st->reset && !(flags & FLAG_END_STREAM) &&
+			    queue_window_update(s, stream_id, len) < 0)
+				return -1;
+		}
+		return 0;
+
+	case FRAME_HEADERS:
+		if (!stream_id || !(stream_id & 1))
+			return session_error(s, ERR_PROTOCOL);
+		if (flags & FLAG_PADDED) {
+			if (len < 1)
+				return session_error(s, ERR_FRAME_SIZE);
+			pad = p[0];
+			p++;
+			len--;
+			if (pad > len)
+				return session_error(s, ERR_PROTOCOL);
+			len -= pad;
+		}
+		// RFC 7540 dependency and weight are parsed past and ignored
+		if (flags & FLAG_PRIORITY) {
+			if (len < 5)
+				return session_error(s, ERR_FRAME_SIZE);
+			p += 5;
+			len -= 5;
+		}
+		if (flags & FLAG_END_HEADERS)
+			return process_headers(s, stream_id, p, len);
+		s->hdr_pending = 1;
+		s->hdr_stream = stream_id;
+		s->hdr_len = 0;
+		return header_block_append(s, p, len);
+
+	case FRAME_CONTINUATION:
+		if (!s->hdr_pending)
+			return session_error(s, ERR_PROTOCOL);
+		if (header_block_append(s, p, len) < 0)
+			return -1;
+		if (!(flags & FLAG_END_HEADERS))
+			return 0;
+		s->hdr_pending = 0;
+		return process_headers(s, stream_id, s->hdr_block, s->hdr_len);
+
+	case FRAME_PRIORITY:
+		if (!stream_id)
+			return session_error(s, ERR_PROTOCOL);
+		if (len != 5)
+			return session_error(s, ERR_FRAME_SIZE);
+		return 0;
+
+	case FRAME_PRIORITY_UPDATE:
+		if (stream_id || len < 4)
+			return session_error(s, ERR_PROTOCOL);
+		st = stream_find(s, get_u32(p) & HTTP2_MAX_WINDOW);
+		if (st)
+			parse_priority((const char *)p + 4, len - 4, &st->urgency, &st->incremental);
+		return 0;
+
+	case FRAME_RST_STREAM:
+		if (!stream_id || stream_id > s->last_stream_id)
+			return session_error(s, ERR_PROTOCOL);
+		if (len != 4)
+			return session_error(s, ERR_FRAME_SIZE);
+		st = stream_find(s, stream_id);
+		if (st)
+			stream_release(s, st);
+		return 0;
+
+	case FRAME_SETTINGS:
+		return handle_settings(s, flags, stream_id, p, len);
+
+	case FRAME_PUSH_PROMISE:
+		return session_error(s, ERR_PROTOCOL);
+
+	case FRAME_PING:
+		if (stream_id)
+			return session_error(s, ERR_PROTOCOL);
+		if (len != 8)
+			return session_error(s, ERR_FRAME_SIZE);
+		if (flags & FLAG_ACK)
+			return 0;
+		return queue_frame(s, FRAME_PING, FLAG_ACK, 0, p, len);
+
+	case FRAME_GOAWAY:
+		if (stream_id)
+			return session_error(s, ERR_PROTOCOL);
+		s->goaway_recv = 1;
+		return 0;
+
+	case FRAME_WINDOW_UPDATE:
+		return handle_window_update(s, stream_id, p, len);
+
+	default:
+		// Unknown frame types must be ignored
+		return 0;
+	}
+}
+
+// Function to parse every complete frame in the input buffer
+static int session_process_input(struct http2_session *s)
+{
+	size_t pos = 0;
+
+	while (s->in_len - pos >= HTTP2_FRAME_HEADER_LEN) {
+		const uint8_t *h = s->in_buf + pos;
+		size_t len = ((size_t)h[0] << 16) | (h[1] << 8) | h[2];
+
+		if (len > HTTP2_MAX_FRAME_SIZE)
+			return session_error(s, ERR_FRAME_SIZE);
+		if (s->in_len - pos < HTTP2_FRAME_HEADER_LEN + len)
+			break;
+
+		if (handle_frame(s, h[3], h[4], get_u32(h + 5) & HTTP2_MAX_WINDOW,
+				 h + HTTP2_FRAME_HEADER_LEN, len) < 0)
+			return -1;
+		pos += HTTP2_FRAME_HEADER_LEN + len;
+	}
+
+	memmove(s->in_buf, s->in_buf + pos, s->in_len - pos);
+	s->in_len -= pos;
+
+	return 0;
+}
+
+static int session_recv(struct http2_session *s)
+{
+	for (;;) {
+		ssize_t n;
+
+		// Leave the rest in the socket until the peer reads what we queued
+		if (s->out_len - s->out_pos > HTTP2_OUT_HIGH)
+			return 0;
+
+		n = recv(s->sockfd, s->in_buf + s->in_len, sizeof(s->in_buf) - s->in_len, 0);
+		if (n < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		if (n == 0)
+			return -1;
+
+		s->in_len += n;
+		if (session_process_input(s) < 0)
+			return -1;
+	}
+}
+
+// Everything but static files read from their fd is sent from the stream buffer
+static int stream_in_memory(const struct http2_stream *st)
+{
+	return st->res_type != RESOURCE_TYPE_STATIC || stream_buf_shared(st);
+}
+
+static int stream_sendable(struct http2_stream *st)
+{
+	if (st->reset || st->sent >= st->file_size || st->send_window <= 0)
+		return 0;
+
+	if (stream_in_memory(st))
+		return st->buf_pos < st->buf_len;
+
+	return 1;
+}
+
+/*
+ * Pick the stream that gets the next DATA frame: lowest urgency first;
+ * within an urgency, non-incremental streams go one after the other in id
+ * order and incremental streams share the connection round-robin.
+ */
+static struct http2_stream *schedule_stream(struct http2_session *s)
+{
+	struct http2_stream *st, *first = NULL, *next = NULL;
+	int urgency = 8;
+
+	if (s->send_window <= 0)
+		return NULL;
+
+	for (st = s->streams; st; st = st->next)
+		if (st->urgency < urgency && stream_sendable(st))
+			urgency = st->urgency;
+
+	for (st = s->streams; st; st = st->next) {
+		if (st->urgency != urgency || !stream_sendable(st))
+			continue;
+		if (!st->incremental)
+			return st;
+		if (!first)
+			first = st;
+		if (!next && st->id > s->rr_last)
+			next = st;
+	}
+
+	st = next ? next : first;
+	if (st)
+		s->rr_last = st->id;
+
+	return st;
+}
+
+// Function to set up the next DATA frame as the current frame
+static int schedule_data_frame(struct http2_session *s)
+{
+	struct http2_stream *st = schedule_stream(s);
+	size_t len;
+	int end;
+
+	if (!st)
+		return 0;
+
+	if (stream_in_memory(st))
+		len = st->buf_len - st->buf_pos;
+	else
+		len = st->file_size - st->sent;
+
+	if ((int64_t)len > st->send_window)
+		len = st->send_window;
+	if ((int64_t)len > s->send_window)
+		len = s->send_window;
+	if (len > s->peer_max_frame)
+		len = s->peer_max_frame;
+
+	end = st->sent + len == st->file_size;
+	frame_header(s->cur_hdr, len, FRAME_DATA, end ? FLAG_END_STREAM : 0, st->id);
+	s->cur = st;
+	s->cur_hdr_sent = 0;
+	s->cur_left = len;
+	st->send_window -= len;
+	s->send_window -= len;
+
+	return 1;
+}
+
+/*
+ * Write the current DATA frame. Returns 1 when the frame is complete,
+ * 0 when the socket is full and -1 on error.
+ */
+static int send_data_frame(struct http2_session *s)
+{
+	struct http2_stream *st = s->cur;
+	ssize_t n;
+
+	while (s->cur_hdr_sent < HTTP2_FRAME_HEADER_LEN) {
+		n = send(s->sockfd, s->cur_hdr + s->cur_hdr_sent,
+			 HTTP2_FRAME_HEADER_LEN - s->cur_hdr_sent,
+			 MSG_NOSIGNAL | (s->cur_left ? MSG_MORE : 0));
+		if (n < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		s->cur_hdr_sent += n;
+	}
+
+	while (s->cur_left) {
+		if (!stream_in_memory(st)) {
+			off_t offset = st->sent;
+
+			n = sendfile(s->sockfd, st->fd, &offset, s->cur_left);
+			// A truncated file cannot complete the frame we announced
+			if (n == 0)
+				return -1;
+		} else {
+			n = send(s->sockfd, st->buf + st->buf_pos, s->cur_left, MSG_NOSIGNAL);
+			if (n > 0)
+				st->buf_pos += n;
+		}
+		if (n < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		st->sent += n;
+		s->cur_left -= n;
+	}
+
+	s->cur = NULL;
+	if (st->reset || st->sent == st->file_size) {
+		stream_release(s, st);
+	} else if (st->res_type == RESOURCE_TYPE_DYNAMIC && !stream_buf_shared(st) &&
+		   st->buf_pos == st->buf_len && !st->aio_pending && stream_start_read(s, st) < 0) {
+		uint32_t stream_id = st->id;
+
+		stream_release(s, st);
+		if (queue_rst_stream(s, stream_id, ERR_INTERNAL) < 0)
+			return -1;
+	}
+
+	return 1;
+}
+
+/*
+ * Write queued frames until the socket is full. Returns 1 if output is
+ * still pending, 0 if everything was written and -1 on error.
+ */
+static int session_send(struct http2_session *s)
+{
+	for (;;) {
+		int rc;
+
+		if (s->cur) {
+			rc = send_data_frame(s);
+			if (rc <= 0)
+				return rc < 0 ? -1 : 1;
+			continue;
+		}
+
+		if (s->out_pos < s->out_len) {
+			ssize_t n = send(s->sockfd, s->out + s->out_pos, s->out_len - s->out_pos,
+					 MSG_NOSIGNAL);
+
+			if (n < 0)
+				return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+			s->out_pos += n;
+			continue;
+		}
+
+		if (s->goaway_sent || !schedule_data_frame(s))
+			return 0;
+	}
+}
+
+static int session_update_epoll(struct http2_session *s, int want_out)
+{
+	int want_in = s->out_len - s->out_pos <= HTTP2_OUT_HIGH;
+	int rc;
+
+	if (want_in == s->epoll_in && want_out == s->epoll_out)
+		return 0;
+
+	// Not reading a peer with a backlog, EPOLLIN would only spin
+	if (!want_in)
+		rc = w_epoll_update_ptr_out(s->epollfd, s->sockfd, s->conn);
+	else if (want_out)
+		rc = w_epoll_update_ptr_inout(s->epollfd, s->sockfd, s->conn);
+	else
+		rc = w_epoll_update_ptr_in(s->epollfd, s->sockfd, s->conn);
+	if (rc < 0) {
+		perror("w_epoll_update_ptr");
+		return -1;
+	}
+	s->epoll_in = want_in;
+	s->epoll_out = want_out;
+
+	return 0;
+}
+
+int http2_handle_event(struct http2_session *s, uint32_t event)
+{
+	int rc;
+
+	if (event & EPOLLIN) {
+		if (s->eventfd >= 0)
+			session_reap_aio(s);
+		if (session_recv(s) < 0) {
+			// Best effort to get a GOAWAY out before closing
+			session_send(s);
+			return -1;
+		}
+	}
+
+	rc = session_send(s);
+	if (rc < 0 || (s->goaway_sent && rc == 0))
+		return -1;
+
+	// The peer is going away and every stream has been answered
+	if (s->goaway_recv && !s->nstreams && rc == 0)
+		return -1;
+
+	return session_update_epoll(s, rc);
+}
+
+int http2_session_start(struct connection *conn, int epollfd)
+{
+	struct http2_session *s;
+	uint8_t settings[12];
+	size_t extra;
+	int one = 1;
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		perror("calloc");
+		return -1;
+	}
+
+	server_stats.h2_sessions++;
+	s->conn = conn;
+	s->sockfd = conn->sockfd;
+	s->epollfd = epollfd;
+	s->epoll_in = -1;
+	s->epoll_out = -1;
+	s->eventfd = -1;
+	s->peer_max_frame = 16384;
+	s->peer_initial_window = 65535;
+	s->send_window = 65535;
+	hpack_table_init(&s->decoder, HPACK_DEFAULT_TABLE_SIZE);
+	conn->h2 = s;
+
+	// Our SETTINGS must be the first frame we send (RFC 9113, 3.4)
+	settings[0] = 0;
+	settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+	put_u32(settings + 2, HTTP2_MAX_CONCURRENT_STREAMS);
+	settings[6] = 0;
+	settings[7] = SETTINGS_NO_RFC7540_PRIORITIES;
+	put_u32(settings + 8, 1);
+	if (queue_frame(s, FRAME_SETTINGS, 0, 0, settings, sizeof(settings)) < 0)
+		return -1;
+
+	// Frames are coalesced with MSG_MORE, so Nagle would only add delay
+	setsockopt(s->sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	dlog(LOG_DEBUG, "h2c session on socket %d\n", conn->sockfd);
+
+	// Frames that arrived together with the preface
+	extra = conn->recv_len - HTTP2_PREFACE_LEN;
+	memcpy(s->in_buf, conn->recv_buffer + HTTP2_PREFACE_LEN, extra);
+	s->in_len = extra;
+	if (session_process_input(s) < 0) {
+		session_send(s);
+		return -1;
+	}
+
+	return http2_handle_event(s, EPOLLOUT);
+}
+
+void http2_session_destroy(struct http2_session *s)
+{
+	struct http2_stream *st;
+
+	if (!s)
+		return;
+
+	// Waits for the reads in flight, so their buffers can be freed
+	if (s->aio_ctx)
+		io_destroy(s->aio_ctx);
+	if (s->eventfd >= 0)
+		close(s->eventfd);
+
+	while (s->streams) {
+		st = s->streams;
+		s->streams = st->next;
+		stream_free(st);
+	}
+
+	hpack_table_free(&s->decoder);
+	free(s->hdr_block);
+	free(s->out);
+	free(s);
+}
@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef HTTP2_H_
+#define HTTP2_H_	1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Client connection preface for HTTP/2 with prior knowledge (RFC 9113, 3.4) */
+#define HTTP2_PREFACE			"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN		24
+
+#define HTTP2_FRAME_HEADER_LEN		9
+
+/* Local SETTINGS advertised to every h2c peer */
+#define HTTP2_MAX_CONCURRENT_STREAMS	128
+#define HTTP2_INITIAL_WINDOW_SIZE	65535
+#define HTTP2_MAX_FRAME_SIZE		16384
+
+/* Largest header block (HEADERS + CONTINUATION) we are willing to decode */
+#define HTTP2_MAX_HEADER_BLOCK		65536
+
+/*
+ * Unsent control and HEADERS bytes above which the peer is no longer
+ * read, and the backlog at which its session is dropped
+ */
+#define HTTP2_OUT_HIGH			(64 << 10)
+#define HTTP2_OUT_MAX			(1 << 20)
+
+/* PING, SETTINGS, PRIORITY and RST_STREAM frames a peer may send per second */
+#define HTTP2_MAX_CONTROL_FRAMES	1000
+
+/* Default RFC 9218 urgency for streams without a priority signal */
+#define HTTP2_DEFAULT_URGENCY		3
+
+struct connection;
+struct http2_session;
+
+/*
+ * Check whether buf starts with the h2c preface: returns 1 if it does,
+ * -1 if buf is a strict prefix of it (more data needed) and 0 otherwise.
+ */
+int http2_check_preface(const char *buf, size_t len);
+
+/*
+ * Switch conn to HTTP/2. The bytes following the preface in
+ * conn->recv_buffer are processed as the first frames of the session.
+ */
+int http2_session_start(struct connection *conn, int epollfd);
+
+/* Handle an epoll event on the socket or the AIO eventfd of the session. */
+int http2_handle_event(struct http2_session *session, uint32_t event);
+
+void http2_session_destroy(struct http2_session *session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HTTP2_H_ */
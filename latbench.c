@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Measure the latency of small requests while other clients download a
+ * large file from the same server, and print its percentiles:
+ *
+ *   latbench [-s] [-c <port>] <port> <bulk path> <small path> [bulk clients] [seconds]
+ *
+ * Each bulk client fetches the large file over and over, reading it at
+ * most BULK_RATE bytes per second when -s is given, as slow peers do.
+ * A single prober fetches the small path on a new connection every
+ * millisecond and times it from connect() to the last byte. Run it
+ * against the server with different notsent_lowat settings, or give a
+ * second server serving the same tree with -c, e.g. one with mmapcache
+ * and one without, to run the same test against both in turn.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Read rate of a slow bulk client, and what it reads at once */
+#define BULK_RATE	(4 << 20)
+#define BULK_READ	(64 << 10)
+
+#define MAX_BULK	256
+
+static struct sockaddr_in server;
+static const char *bulk_path, *small_path;
+static volatile int running;
+static int slow;
+
+static unsigned long bulk_bytes[MAX_BULK];
+
+/* Latencies of the small requests, in microseconds */
+static double *samples;
+static size_t nsamples, samples_size;
+static unsigned long probe_errors;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Function to fetch path on a new connection, returning the bytes read or -1
+static long fetch(const char *path, char *buf, size_t size, int paced)
+{
+	char req[1024];
+	double start = now_us();
+	long total = 0;
+	ssize_t n;
+	int fd, len;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+	if (send(fd, req, len, MSG_NOSIGNAL) != len) {
+		close(fd);
+		return -1;
+	}
+
+	while (running && (n = recv(fd, buf, size, 0)) > 0) {
+		total += n;
+		// Sleep until the rate allows what was read so far
+		if (paced) {
+			double due = start + total * 1e6 / BULK_RATE, t = now_us();
+
+			if (due > t)
+				usleep((useconds_t)(due - t));
+		}
+	}
+	close(fd);
+
+	return total;
+}
+
+static void *bulk_client(void *arg)
+{
+	unsigned long *bytes = arg;
+	char *buf = malloc(BULK_READ);
+	long n;
+
+	if (!buf)
+		die("malloc");
+	while (running) {
+		n = fetch(bulk_path, buf, BULK_READ, slow);
+		if (n > 0)
+			*bytes += n;
+	}
+	free(buf);
+
+	return NULL;
+}
+
+static void *prober(void *arg)
+{
+	char buf[16 << 10];
+	double start;
+
+	(void)arg;
+	while (running) {
+		start = now_us();
+		if (fetch(small_path, buf, sizeof(buf), 0) <= 0) {
+			probe_errors++;
+		} else {
+			if (nsamples == samples_size) {
+				samples_size = samples_size ? samples_size * 2 : 4096;
+				samples = realloc(samples, samples_size * sizeof(*samples));
+				if (!samples)
+					die("realloc");
+			}
+			samples[nsamples++] = now_us() - start;
+		}
+		usleep(1000);
+	}
+
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(double p)
+{
+	size_t i = (size_t)(p * (nsamples - 1));
+
+	return samples[i];
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-s] [-c <port>] <port> <bulk path> <small path> "
+		"[bulk clients] [seconds]\n", argv0);
+	fprintf(stderr, "  -s  bulk clients read at most %d bytes per second\n", BULK_RATE);
+	fprintf(stderr, "  -c  run the same test against the server on this port too\n");
+	exit(EXIT_FAILURE);
+}
+
+// Function to run the test against the server on port and print its results
+static int run(int port, int nbulk, int seconds)
+{
+	pthread_t bulk[MAX_BULK], probe;
+	unsigned long total = 0;
+	int i;
+
+	server.sin_port = htons(port);
+	memset(bulk_bytes, 0, sizeof(bulk_bytes));
+	nsamples = 0;
+	probe_errors = 0;
+	running = 1;
+
+	for (i = 0; i < nbulk; i++)
+		if (pthread_create(&bulk[i], NULL, bulk_client, &bulk_bytes[i]))
+			die("pthread_create");
+	if (pthread_create(&probe, NULL, prober, NULL))
+		die("pthread_create");
+
+	sleep(seconds);
+	running = 0;
+	pthread_join(probe, NULL);
+	for (i = 0; i < nbulk; i++) {
+		pthread_join(bulk[i], NULL);
+		total += bulk_bytes[i];
+	}
+
+	printf("port %d\n", port);
+	if (!nsamples) {
+		fprintf(stderr, "no small request completed (%lu errors)\n", probe_errors);
+		return -1;
+	}
+	qsort(samples, nsamples, sizeof(*samples), cmp_double);
+	printf("small requests %zu, errors %lu\n", nsamples, probe_errors);
+	printf("latency us: p50 %.0f p90 %.0f p99 %.0f p99.9 %.0f max %.0f\n",
+	       percentile(0.50), percentile(0.90), percentile(0.99), percentile(0.999),
+	       samples[nsamples - 1]);
+	printf("bulk MB/s: %.1f\n", total / 1e6 / seconds);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int nbulk = 4, seconds = 10, other = 0;
+	int opt, rc;
+
+	while ((opt = getopt(argc, argv, "sc:")) != -1) {
+		if (opt == 's')
+			slow = 1;
+		else if (opt == 'c')
+			other = atoi(optarg);
+		else
+			usage(argv[0]);
+	}
+	if (argc - optind < 3 || argc - optind > 5)
+		usage(argv[0]);
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bulk_path = argv[optind + 1];
+	small_path = argv[optind + 2];
+	if (argc - optind > 3)
+		nbulk = atoi(argv[optind + 3]);
+	if (argc - optind > 4)
+		seconds = atoi(argv[optind + 4]);
+	if (nbulk < 0 || nbulk > MAX_BULK || seconds <= 0)
+		usage(argv[0]);
+
+	rc = run(atoi(argv[optind]), nbulk, seconds);
+	if (other)
+		rc |= run(other, nbulk, seconds);
+	free(samples);
+
+	return rc ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,360 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "aws.h"
+#include "etag.h"
+#include "fdcache.h"
+#include "metaindex.h"
+#include "treewalk.h"
+
+/* Records being collected for a write */
+struct record_set {
+	struct metaindex_record *records;
+	size_t count;
+	size_t size;
+	int err;
+};
+
+/* Records collected by the walk threads for metaindex_build() */
+struct build_ctx {
+	pthread_mutex_t lock;
+	struct record_set set;
+	int hash_contents;
+	/* index the ETags of unchanged files are taken from, or NULL */
+	const struct metaindex *prev;
+	/* chunk buffers of the threads that are not hashing right now */
+	void *hash_bufs[TREEWALK_MAX_THREADS];
+	int nbufs;
+};
+
+uint64_t metaindex_hash(const char *name)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (; *name; name++) {
+		h ^= (unsigned char)*name;
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+int metaindex_open(struct metaindex *ix, const char *path)
+{
+	const struct metaindex_header *hdr;
+	struct stat st;
+	void *map;
+	int fd;
+
+	memset(ix, 0, sizeof(*ix));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Pages are only read in as lookups touch them
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = map;
+	if (memcmp(hdr->magic, METAINDEX_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != METAINDEX_VERSION ||
+	    hdr->record_size != sizeof(struct metaindex_record) ||
+	    hdr->count != (st.st_size - sizeof(*hdr)) / sizeof(struct metaindex_record) ||
+	    (st.st_size - sizeof(*hdr)) % sizeof(struct metaindex_record)) {
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	ix->map = map;
+	ix->map_len = st.st_size;
+	ix->records = (const struct metaindex_record *)(hdr + 1);
+	ix->count = hdr->count;
+
+	return 0;
+}
+
+void metaindex_close(struct metaindex *ix)
+{
+	if (ix->map)
+		munmap(ix->map, ix->map_len);
+	memset(ix, 0, sizeof(*ix));
+}
+
+const struct metaindex_record *metaindex_find(const struct metaindex *ix, const char *name,
+					      const struct stat *st)
+{
+	uint64_t hash = metaindex_hash(name);
+	const struct metaindex_record *rec;
+	size_t lo = 0, hi = ix->count, mid;
+
+	// First record of the hash
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ix->records[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < ix->count && ix->records[lo].hash == hash; lo++) {
+		rec = &ix->records[lo];
+		if (rec->dev != (uint64_t)st->st_dev || rec->ino != (uint64_t)st->st_ino)
+			continue;
+		if (rec->size != (uint64_t)st->st_size || rec->mtime_sec != st->st_mtim.tv_sec ||
+		    rec->mtime_nsec != (uint32_t)st->st_mtim.tv_nsec)
+			return NULL;
+		return rec;
+	}
+
+	return NULL;
+}
+
+static struct metaindex_record *record_add(struct record_set *set)
+{
+	struct metaindex_record *records;
+	size_t size;
+
+	if (set->count == set->size) {
+		size = set->size ? set->size * 2 : 1024;
+		records = realloc(set->records, size * sizeof(*records));
+		if (!records) {
+			set->err = ENOMEM;
+			return NULL;
+		}
+		set->records = records;
+		set->size = size;
+	}
+
+	return memset(&set->records[set->count++], 0, sizeof(*set->records));
+}
+
+static void record_fill(struct metaindex_record *rec, const char *name, const struct stat *st)
+{
+	rec->hash = metaindex_hash(name);
+	rec->dev = st->st_dev;
+	rec->ino = st->st_ino;
+	rec->size = st->st_size;
+	rec->mtime_sec = st->st_mtim.tv_sec;
+	rec->mtime_nsec = st->st_mtim.tv_nsec;
+	rec->mode = st->st_mode;
+	rec->content_type = response_content_type_id(name);
+}
+
+// Sorted by hash, then file
+static int record_cmp(const void *a, const void *b)
+{
+	const struct metaindex_record *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	if (x->dev != y->dev)
+		return x->dev < y->dev ? -1 : 1;
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+
+	return 0;
+}
+
+// Function to sort the records and drop repeated files
+static void records_sort(struct record_set *set)
+{
+	size_t i, n = 0;
+
+	qsort(set->records, set->count, sizeof(*set->records), record_cmp);
+	for (i = 0; i < set->count; i++)
+		if (!n || record_cmp(&set->records[n - 1], &set->records[i]))
+			set->records[n++] = set->records[i];
+	set->count = n;
+}
+
+// Function to write sorted records, replacing path
+static int records_write(const struct record_set *set, const char *path)
+{
+	struct metaindex_header hdr;
+	char tmp[PATH_MAX];
+	FILE *f;
+	int len, err;
+
+	len = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (len < 0 || (size_t)len >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	f = fopen(tmp, "we");
+	if (!f)
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, METAINDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = METAINDEX_VERSION;
+	hdr.record_size = sizeof(struct metaindex_record);
+	hdr.count = set->count;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	fwrite(set->records, sizeof(*set->records), set->count, f);
+
+	// Running servers keep their mapping of the file being replaced
+	err = ferror(f);
+	if (fclose(f) != 0 || err || rename(tmp, path) < 0) {
+		err = errno;
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void save_entry(const struct fd_entry *entry, void *arg)
+{
+	struct record_set *set = arg;
+	struct metaindex_record *rec;
+
+	if (!S_ISREG(entry->st.st_mode))
+		return;
+	rec = record_add(set);
+	if (!rec)
+		return;
+	record_fill(rec, entry->name, &entry->st);
+	memcpy(rec->etag, entry->etag, sizeof(rec->etag));
+}
+
+int metaindex_save(const struct metaindex *ix, const char *path)
+{
+	struct record_set set = { 0 };
+	struct metaindex_record *rec;
+	size_t i, fresh;
+	int rc;
+
+	// Entries are current, old records of the same files are replaced
+	fdcache_walk(save_entry, &set);
+	records_sort(&set);
+	fresh = set.count;
+	for (i = 0; i < ix->count && !set.err; i++) {
+		if (bsearch(&ix->records[i], set.records, fresh, sizeof(*set.records), record_cmp))
+			continue;
+		rec = record_add(&set);
+		if (rec)
+			*rec = ix->records[i];
+	}
+
+	if (set.err) {
+		free(set.records);
+		errno = set.err;
+		return -1;
+	}
+	records_sort(&set);
+	rc = records_write(&set, path);
+	free(set.records);
+
+	return rc;
+}
+
+// Function to hash the contents of a file into its record's ETag
+static int record_hash(struct build_ctx *ctx, struct metaindex_record *rec,
+		       int dirfd, const char *name, const struct stat *st)
+{
+	uint64_t hash;
+	void *buf;
+	int fd, rc = -1;
+
+	pthread_mutex_lock(&ctx->lock);
+	buf = ctx->nbufs ? ctx->hash_bufs[--ctx->nbufs] : NULL;
+	pthread_mutex_unlock(&ctx->lock);
+	if (!buf)
+		buf = malloc(ETAG_CHUNK);
+	if (!buf)
+		return -1;
+
+	fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd >= 0 && etag_hash_fd(fd, st->st_size, buf, &hash) == 0) {
+		response_hash_etag(rec->etag, hash);
+		rc = 0;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->nbufs < TREEWALK_MAX_THREADS)
+		ctx->hash_bufs[ctx->nbufs++] = buf;
+	else
+		free(buf);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return rc;
+}
+
+static void build_entry(int dirfd, const char *entry, const char *name,
+			const struct stat *st, void *arg)
+{
+	struct build_ctx *ctx = arg;
+	const struct metaindex_record *old = NULL;
+	struct metaindex_record rec, *slot;
+
+	if (!S_ISREG(st->st_mode))
+		return;
+
+	// The ETag the server would give it, hashed outside the lock
+	memset(&rec, 0, sizeof(rec));
+	record_fill(&rec, name, st);
+	if (ctx->prev)
+		old = metaindex_find(ctx->prev, name, st);
+	if (old && (!ctx->hash_contents || response_etag_is_hash(old->etag)))
+		memcpy(rec.etag, old->etag, sizeof(rec.etag));
+	else if (!ctx->hash_contents || record_hash(ctx, &rec, dirfd, entry, st) < 0)
+		response_stat_etag(rec.etag, st->st_mtime, st->st_size, 0);
+
+	pthread_mutex_lock(&ctx->lock);
+	slot = record_add(&ctx->set);
+	if (slot)
+		*slot = rec;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+long metaindex_build(const struct site *sites, const char *path, int hash_contents,
+		     const struct metaindex *prev, struct treewalk_stats *stats)
+{
+	struct build_ctx ctx;
+	long count = -1;
+	int i;
+
+	memset(&ctx, 0, sizeof(ctx));
+	pthread_mutex_init(&ctx.lock, NULL);
+	ctx.hash_contents = hash_contents;
+	ctx.prev = prev;
+
+	if (treewalk(sites, build_entry, &ctx, stats) < 0) {
+		ctx.set.err = errno;
+	} else if (!ctx.set.err) {
+		records_sort(&ctx.set);
+		if (records_write(&ctx.set, path) == 0)
+			count = (long)ctx.set.count;
+	}
+	if (count < 0 && ctx.set.err)
+		errno = ctx.set.err;
+
+	for (i = 0; i < ctx.nbufs; i++)
+		free(ctx.hash_bufs[i]);
+	free(ctx.set.records);
+	pthread_mutex_destroy(&ctx.lock);
+
+	return count;
+}
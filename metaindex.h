@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef METAINDEX_H_
+#define METAINDEX_H_	1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "response.h"
+#include "vhost.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define METAINDEX_MAGIC		"AWSMIDX1"
+#define METAINDEX_VERSION	1
+
+/*
+ * On-disk metadata index: this header, then count records sorted by
+ * hash, in host byte order. Loading it is a single mmap().
+ */
+struct metaindex_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t count;
+};
+
+/* What the descriptor cache derives from a file, keyed by its name */
+struct metaindex_record {
+	/* metaindex_hash() of the name relative to the site root */
+	uint64_t hash;
+	/* the file the record was taken from, checked against fstat() */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+	uint32_t mode;
+	/* response_content_type_id() */
+	uint32_t content_type;
+	char etag[RESPONSE_ETAG_MAX];
+};
+
+struct treewalk_stats;
+
+struct metaindex {
+	void *map;
+	size_t map_len;
+	const struct metaindex_record *records;
+	size_t count;
+};
+
+/* 64-bit FNV-1a of a canonical name, as the descriptor cache stores it */
+uint64_t metaindex_hash(const char *name);
+
+/*
+ * Map the index at path. Returns 0, or -1 if it is missing or not an
+ * index of this version and host; ix is then an empty index.
+ */
+int metaindex_open(struct metaindex *ix, const char *path);
+void metaindex_close(struct metaindex *ix);
+
+/*
+ * Record of name that still describes st: same device, inode, size and
+ * mtime. Names shared by several sites have one record per file. Returns
+ * NULL if there is none or it is out of date.
+ */
+const struct metaindex_record *metaindex_find(const struct metaindex *ix, const char *name,
+					      const struct stat *st);
+
+/*
+ * Replace path with the files of the descriptor cache, merged with the
+ * records of ix they do not supersede. Returns 0, or -1 on error.
+ */
+int metaindex_save(const struct metaindex *ix, const char *path);
+
+/*
+ * Walk the tree below every site root with treewalk() and write a record
+ * for each regular file to path. Files prev still describes keep their
+ * ETag from it; with hash_contents set, the others are hashed from the
+ * contents as the etag threads would. prev may be NULL or the index at
+ * path. Subtrees that cannot be read are left out and counted in stats.
+ * Returns the number of records written, or -1 on error.
+ */
+long metaindex_build(const struct site *sites, const char *path, int hash_contents,
+		     const struct metaindex *prev, struct treewalk_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* METAINDEX_H_ */
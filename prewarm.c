@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aws.h"
+#include "fdcache.h"
+#include "prewarm.h"
+#include "treewalk.h"
+#include "utils/debug.h"
+
+long prewarm_scan(const struct site *sites, struct metaindex *ix, const char *index_path)
+{
+	struct treewalk_stats stats;
+	long records = -1;
+
+	if (!index_path) {
+		if (treewalk(sites, NULL, NULL, &stats) < 0)
+			return -1;
+	} else {
+		// The walk rewrites the index, and the server maps the new one
+		records = metaindex_build(sites, index_path, 0, ix, &stats);
+		if (records < 0 && !stats.dirs)
+			return -1;
+		// The old index stays mapped if the new one cannot be written
+		if (records >= 0)
+			metaindex_close(ix);
+		if (records < 0 || metaindex_open(ix, index_path) < 0)
+			perror(index_path);
+	}
+
+	dlog(LOG_INFO, "prewarm: %lu directories, %lu files, %llu bytes in %ld ms, %lu errors, "
+	     "%ld indexed\n", stats.dirs, stats.files, stats.bytes, stats.ms, stats.errors, records);
+
+	return (long)stats.files;
+}
+
+long prewarm_load(const struct site *sites, const char *path, size_t max)
+{
+	char **names = NULL, *line = NULL;
+	size_t n = 0, size = 0, cap = 0, i, root_len, best_len;
+	const struct site *site, *best;
+	long opened = 0;
+	ssize_t len;
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (!f)
+		return -1;
+
+	while (n < max && (len = getline(&line, &cap, f)) >= 0) {
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!len || line[0] == '#')
+			continue;
+		if (n == size) {
+			char **grown = realloc(names, (size ? size * 2 : 64) * sizeof(*names));
+
+			if (!grown)
+				break;
+			names = grown;
+			size = size ? size * 2 : 64;
+		}
+		names[n] = strdup(line);
+		if (!names[n])
+			break;
+		n++;
+	}
+	free(line);
+	fclose(f);
+
+	// Opened coldest first, so the list order ends up as the LRU order
+	for (i = n; i-- > 0; ) {
+		// Nested roots: the file belongs to the innermost one only
+		best = NULL;
+		best_len = 0;
+		for (site = sites; site; site = site->next) {
+			root_len = strlen(site->document_root);
+			if (root_len > best_len && !strncmp(names[i], site->document_root, root_len)) {
+				best = site;
+				best_len = root_len;
+			}
+		}
+		if (best && fdcache_prewarm(best->root_fd, names[i] + best_len) == 0)
+			opened++;
+		free(names[i]);
+	}
+	free(names);
+
+	return opened;
+}
+
+struct save_ctx {
+	const struct site *sites;
+	FILE *f;
+};
+
+static void save_entry(const struct fd_entry *entry, void *arg)
+{
+	struct save_ctx *ctx = arg;
+	const struct site *site;
+
+	// Directories come back on their own with the index files in them
+	if (!S_ISREG(entry->st.st_mode) || strchr(entry->name, '\n'))
+		return;
+
+	for (site = ctx->sites; site; site = site->next) {
+		if (site->root_fd == entry->dirfd) {
+			fprintf(ctx->f, "%s%s\n", site->document_root, entry->name);
+			return;
+		}
+	}
+}
+
+int prewarm_save(const struct site *sites, const char *path)
+{
+	char tmp[PATH_MAX];
+	struct save_ctx ctx = { .sites = sites };
+	int len, err;
+
+	len = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (len < 0 || (size_t)len >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	ctx.f = fopen(tmp, "we");
+	if (!ctx.f)
+		return -1;
+	fprintf(ctx.f, "# files in use when the server last stopped, most recent first\n");
+	fdcache_walk(save_entry, &ctx);
+
+	// Readers never see a partial list
+	err = ferror(ctx.f);
+	if (fclose(ctx.f) != 0 || err || rename(tmp, path) < 0) {
+		err = errno;
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef PREWARM_H_
+#define PREWARM_H_	1
+
+#include <stddef.h>
+
+#include "vhost.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct metaindex;
+
+/*
+ * Walk the tree below every site root with treewalk(), so the first
+ * requests find the kernel dentry and inode caches warm. With index_path
+ * set, the walk also rewrites the metadata index there from the stat
+ * data, keeping the ETags ix still has for unchanged files, and maps it
+ * in ix. Returns the number of files seen, or -1 if the walk could not
+ * start.
+ */
+long prewarm_scan(const struct site *sites, struct metaindex *ix, const char *index_path);
+
+/*
+ * Open the files listed in path, one absolute file name per line, the
+ * most wanted first, through the descriptor cache of the site with the
+ * longest root that contains them. At most max lines are read, so the list does not
+ * evict itself. Returns the number of files opened, or -1 if path
+ * cannot be read.
+ */
+long prewarm_load(const struct site *sites, const char *path, size_t max);
+
+/*
+ * Replace path with the files of the descriptor cache, most recently used
+ * first, in the format prewarm_load() reads. Returns 0, or -1 on error.
+ */
+int prewarm_save(const struct site *sites, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PREWARM_H_ */
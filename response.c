@@ -0,0 +1,481 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "response.h"
+
+#define STR_LEN(s)	(sizeof(s) - 1)
+
+// Status line and the headers that are the same for every reply
+static const char reply_200_head[] =
+	"HTTP/1.1 200 OK\r\n"
+	"Server: Apache/2.2.9\r\n"
+	"Accept-Ranges: bytes\r\n"
+	"Vary: Accept-Encoding\r\n"
+	"Connection: close\r\n"
+	"Date: ";
+
+static const char crlf[] = "\r\n";
+
+/* Alt-Svc field of 200 replies, empty unless an HTTP/3 endpoint is set */
+static char alt_svc[64];
+static size_t alt_svc_len;
+
+/* Expires of no-cache routes: a date in the past */
+static const char expires_past[] = "Thu, 01 Jan 1970 00:00:00 GMT";
+
+/* Error replies, rendered once by response_init() and never formatted again */
+static struct error_response {
+	int status;
+	const char *reason;
+	/* header lines specific to this status */
+	const char *headers;
+	/* "HTTP/1.1 <status> <reason>\r\nDate: " */
+	char head[64];
+	size_t head_len;
+	/* "\r\n" + remaining headers + empty line */
+	char tail[256];
+	size_t tail_len;
+	char body[192];
+	size_t body_len;
+} error_responses[] = {
+	{ .status = 400, .reason = "Bad Request", .headers = "" },
+	{ .status = 404, .reason = "Not Found", .headers = "" },
+	{ .status = 405, .reason = "Method Not Allowed", .headers = "Allow: GET, HEAD\r\n" },
+	{ .status = 413, .reason = "Content Too Large", .headers = "" },
+	{ .status = 414, .reason = "URI Too Long", .headers = "" },
+	{ .status = 431, .reason = "Request Header Fields Too Large", .headers = "" },
+	{ .status = 500, .reason = "Internal Server Error", .headers = "" },
+	{ .status = 503, .reason = "Service Unavailable", .headers = "Retry-After: 1\r\n" },
+};
+
+#define ERROR_RESPONSES	(sizeof(error_responses) / sizeof(error_responses[0]))
+
+static const char digit_pairs[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/* Date header value, one per reactor thread, refreshed by its loop */
+static __thread char cached_date[RESPONSE_DATE_LEN + 1];
+static __thread time_t cached_date_sec = -1;
+
+/* Expires values, direct mapped by max-age and refreshed with the Date */
+#define EXPIRES_CACHE_SIZE	8
+
+static __thread struct {
+	time_t sec;
+	long max_age;
+	char value[RESPONSE_DATE_LEN + 1];
+} cached_expires[EXPIRES_CACHE_SIZE];
+
+// Function to format the date
+void format_date(time_t time, char *buf, size_t size)
+{
+	struct tm tm;
+
+	strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&time, &tm));
+}
+
+void response_date_update(void)
+{
+	struct timespec now;
+
+	// The coarse clock is read from the vDSO, without a system call
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+	if (now.tv_sec == cached_date_sec)
+		return;
+
+	format_date(now.tv_sec, cached_date, sizeof(cached_date));
+	cached_date_sec = now.tv_sec;
+}
+
+const char *response_date(void)
+{
+	if (cached_date_sec < 0)
+		response_date_update();
+
+	return cached_date;
+}
+
+size_t response_format_uint(char *buf, uint64_t value)
+{
+	char tmp[20];
+	char *p = tmp + sizeof(tmp);
+	unsigned int i;
+	size_t n;
+
+	// Two digits per division, written backwards from the end of tmp
+	while (value >= 100) {
+		i = (value % 100) * 2;
+		value /= 100;
+		*--p = digit_pairs[i + 1];
+		*--p = digit_pairs[i];
+	}
+	if (value >= 10) {
+		i = value * 2;
+		*--p = digit_pairs[i + 1];
+		*--p = digit_pairs[i];
+	} else {
+		*--p = '0' + value;
+	}
+
+	n = tmp + sizeof(tmp) - p;
+	memcpy(buf, p, n);
+
+	return n;
+}
+
+/* Content types by file name extension, anything else is sent as octets */
+static const struct {
+	const char *ext;
+	const char *type;
+} content_types[] = {
+	{ "html", "text/html" },
+	{ "htm", "text/html" },
+	{ "css", "text/css" },
+	{ "js", "text/javascript" },
+	{ "json", "application/json" },
+	{ "txt", "text/plain" },
+	{ "xml", "application/xml" },
+	{ "svg", "image/svg+xml" },
+	{ "png", "image/png" },
+	{ "jpg", "image/jpeg" },
+	{ "jpeg", "image/jpeg" },
+	{ "gif", "image/gif" },
+	{ "webp", "image/webp" },
+	{ "ico", "image/x-icon" },
+	{ "woff", "font/woff" },
+	{ "woff2", "font/woff2" },
+	{ "wasm", "application/wasm" },
+	{ "pdf", "application/pdf" },
+};
+
+unsigned int response_content_type_id(const char *name)
+{
+	const char *dot = strrchr(name, '.');
+	size_t i;
+
+	// Dots in directory names or leading a hidden file are no extension
+	if (!dot || dot == name || dot[-1] == '/' || strchr(dot, '/'))
+		return 0;
+
+	for (i = 0; i < sizeof(content_types) / sizeof(content_types[0]); i++)
+		if (!strcasecmp(dot + 1, content_types[i].ext))
+			return i + 1;
+
+	return 0;
+}
+
+const char *response_content_type_from_id(unsigned int id)
+{
+	if (!id || id > sizeof(content_types) / sizeof(content_types[0]))
+		return "application/octet-stream";
+
+	return content_types[id - 1].type;
+}
+
+const char *response_content_type(const char *name)
+{
+	return response_content_type_from_id(response_content_type_id(name));
+}
+
+void response_stat_etag(char *buf, time_t mtime, off_t size, int weak)
+{
+	snprintf(buf, RESPONSE_ETAG_MAX, "%s\"%llx-%llx\"", weak ? "W/" : "",
+		 (unsigned long long)mtime, (unsigned long long)size);
+}
+
+void response_hash_etag(char *buf, uint64_t hash)
+{
+	snprintf(buf, RESPONSE_ETAG_MAX, "\"%016llx\"", (unsigned long long)hash);
+}
+
+int response_etag_is_hash(const char *etag)
+{
+	size_t i;
+
+	if (etag[0] != '"' || strlen(etag) != 18 || etag[17] != '"')
+		return 0;
+	for (i = 1; i < 17; i++)
+		if (!isxdigit((unsigned char)etag[i]))
+			return 0;
+
+	return 1;
+}
+
+void response_file_headers(struct file_headers *fh, time_t mtime, const char *content_type,
+			   const char *etag)
+{
+	char *p = fh->buf;
+	size_t len = strlen(content_type);
+
+	memcpy(p, "Last-Modified: ", STR_LEN("Last-Modified: "));
+	p += STR_LEN("Last-Modified: ");
+	format_date(mtime, p, RESPONSE_DATE_LEN + 1);
+	p += RESPONSE_DATE_LEN;
+	if (etag) {
+		memcpy(p, "\r\nETag: ", STR_LEN("\r\nETag: "));
+		p += STR_LEN("\r\nETag: ");
+		memcpy(p, etag, strlen(etag));
+		p += strlen(etag);
+	}
+	memcpy(p, "\r\nContent-Type: ", STR_LEN("\r\nContent-Type: "));
+	p += STR_LEN("\r\nContent-Type: ");
+	memcpy(p, content_type, len);
+	p += len;
+	memcpy(p, crlf, STR_LEN(crlf));
+	p += STR_LEN(crlf);
+
+	fh->len = p - fh->buf;
+}
+
+void response_generated_headers(struct file_headers *fh, const char *content_type)
+{
+	fh->len = snprintf(fh->buf, sizeof(fh->buf),
+			   "Content-Type: %s\r\nCache-Control: no-cache\r\n",
+			   content_type);
+}
+
+int response_cache_policy(struct cache_policy *cp)
+{
+	int n;
+
+	cp->value_len = 0;
+	cp->fields_len = 0;
+
+	if (cp->no_cache && (cp->max_age >= 0 || cp->immutable))
+		return -1;
+	if (cp->immutable && cp->max_age < 0)
+		cp->max_age = RESPONSE_IMMUTABLE_MAX_AGE;
+
+	if (cp->no_cache)
+		n = snprintf(cp->value, sizeof(cp->value), "no-cache");
+	else if (cp->max_age >= 0)
+		n = snprintf(cp->value, sizeof(cp->value), "max-age=%ld%s",
+			     cp->max_age, cp->immutable ? ", immutable" : "");
+	else
+		return 0;
+	cp->value_len = n;
+
+	// Expires only depends on the clock for max-age, splice it in per reply
+	if (cp->no_cache)
+		n = snprintf(cp->fields, sizeof(cp->fields),
+			     "Cache-Control: %s\r\nExpires: %s\r\n", cp->value, expires_past);
+	else
+		n = snprintf(cp->fields, sizeof(cp->fields),
+			     "Cache-Control: %s\r\nExpires: ", cp->value);
+	cp->fields_len = n;
+
+	return 0;
+}
+
+const char *response_expires(const struct cache_policy *cp)
+{
+	unsigned int slot;
+
+	if (cp->no_cache)
+		return expires_past;
+	if (cp->max_age < 0)
+		return NULL;
+
+	response_date();
+	slot = cp->max_age % EXPIRES_CACHE_SIZE;
+	if (cached_expires[slot].sec != cached_date_sec ||
+	    cached_expires[slot].max_age != cp->max_age) {
+		format_date(cached_date_sec + cp->max_age, cached_expires[slot].value,
+			    sizeof(cached_expires[slot].value));
+		cached_expires[slot].sec = cached_date_sec;
+		cached_expires[slot].max_age = cp->max_age;
+	}
+
+	return cached_expires[slot].value;
+}
+
+void response_header_build(struct response_header *rh, const struct file_headers *fh,
+			   const struct cache_policy *cp, size_t content_length)
+{
+	char *p = rh->length;
+	int n;
+
+	memcpy(rh->date, response_date(), RESPONSE_DATE_LEN);
+
+	if (content_length != RESPONSE_NO_LENGTH) {
+		memcpy(p, "Content-Length: ", STR_LEN("Content-Length: "));
+		p += STR_LEN("Content-Length: ");
+		p += response_format_uint(p, content_length);
+		memcpy(p, "\r\n", 2);
+		p += 2;
+	}
+	memcpy(p, "\r\n", 2);
+	p += 2;
+
+	rh->iov[0].iov_base = (void *)reply_200_head;
+	rh->iov[0].iov_len = STR_LEN(reply_200_head);
+	rh->iov[1].iov_base = rh->date;
+	rh->iov[1].iov_len = RESPONSE_DATE_LEN;
+	rh->iov[2].iov_base = (void *)crlf;
+	rh->iov[2].iov_len = STR_LEN(crlf);
+	rh->iov[3].iov_base = (void *)fh->buf;
+	rh->iov[3].iov_len = fh->len;
+	n = 4;
+
+	// Route caching fields are pre-rendered, only max-age needs Expires
+	if (cp && cp->fields_len) {
+		rh->iov[n].iov_base = (void *)cp->fields;
+		rh->iov[n++].iov_len = cp->fields_len;
+		if (!cp->no_cache) {
+			memcpy(rh->expires, response_expires(cp), RESPONSE_DATE_LEN);
+			rh->iov[n].iov_base = rh->expires;
+			rh->iov[n++].iov_len = RESPONSE_DATE_LEN;
+			rh->iov[n].iov_base = (void *)crlf;
+			rh->iov[n++].iov_len = STR_LEN(crlf);
+		}
+	}
+
+	if (alt_svc_len) {
+		rh->iov[n].iov_base = alt_svc;
+		rh->iov[n++].iov_len = alt_svc_len;
+	}
+
+	rh->iov[n].iov_base = rh->length;
+	rh->iov[n++].iov_len = p - rh->length;
+	rh->iovcnt = n;
+	rh->iov_pos = 0;
+}
+
+void response_header_body(struct response_header *rh, const void *body, size_t len)
+{
+	rh->iov[rh->iovcnt].iov_base = (void *)body;
+	rh->iov[rh->iovcnt++].iov_len = len;
+}
+
+size_t response_header_pending(const struct response_header *rh)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = rh->iov_pos; i < rh->iovcnt; i++)
+		len += rh->iov[i].iov_len;
+
+	return len;
+}
+
+ssize_t response_header_send(int sockfd, struct response_header *rh, int flags)
+{
+	struct msghdr msg = { 0 };
+	ssize_t n, left;
+
+	if (rh->iov_pos == rh->iovcnt)
+		return 0;
+
+	msg.msg_iov = rh->iov + rh->iov_pos;
+	msg.msg_iovlen = rh->iovcnt - rh->iov_pos;
+	n = sendmsg(sockfd, &msg, flags);
+	if (n < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+	// Skip the fragments that went out and trim the partial one
+	left = n;
+	while (rh->iov_pos < rh->iovcnt && left >= (ssize_t)rh->iov[rh->iov_pos].iov_len) {
+		left -= rh->iov[rh->iov_pos].iov_len;
+		rh->iov_pos++;
+	}
+	if (left) {
+		rh->iov[rh->iov_pos].iov_base = (char *)rh->iov[rh->iov_pos].iov_base + left;
+		rh->iov[rh->iov_pos].iov_len -= left;
+	}
+
+	return n;
+}
+
+void response_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < ERROR_RESPONSES; i++) {
+		struct error_response *e = &error_responses[i];
+
+		e->body_len = snprintf(e->body, sizeof(e->body),
+				       "<html><head><title>%d %s</title></head>"
+				       "<body><h1>%s</h1></body></html>\n",
+				       e->status, e->reason, e->reason);
+		e->head_len = snprintf(e->head, sizeof(e->head),
+				       "HTTP/1.1 %d %s\r\nDate: ", e->status, e->reason);
+		e->tail_len = snprintf(e->tail, sizeof(e->tail),
+				       "\r\nServer: Apache/2.2.9\r\n"
+				       "%s"
+				       "Connection: close\r\n"
+				       "Content-Type: text/html\r\n"
+				       "Content-Length: %zu\r\n\r\n",
+				       e->headers, e->body_len);
+	}
+}
+
+void response_alt_svc(unsigned short port, int max_age)
+{
+	int len = 0;
+
+	if (port)
+		len = snprintf(alt_svc, sizeof(alt_svc), "Alt-Svc: h3=\":%u\"; ma=%d\r\n",
+			       port, max_age);
+	alt_svc_len = len > 0 && (size_t)len < sizeof(alt_svc) ? len : 0;
+}
+
+void response_error_build(struct response_header *rh, int status, int head_only)
+{
+	const struct error_response *e = NULL;
+	size_t i;
+
+	for (i = 0; i < ERROR_RESPONSES; i++) {
+		e = &error_responses[i];
+		if (e->status == status)
+			break;
+	}
+	// Anything without an entry of its own is an internal error
+	if (i == ERROR_RESPONSES) {
+		response_error_build(rh, 500, head_only);
+		return;
+	}
+
+	memcpy(rh->date, response_date(), RESPONSE_DATE_LEN);
+
+	rh->iov[0].iov_base = (void *)e->head;
+	rh->iov[0].iov_len = e->head_len;
+	rh->iov[1].iov_base = rh->date;
+	rh->iov[1].iov_len = RESPONSE_DATE_LEN;
+	rh->iov[2].iov_base = (void *)e->tail;
+	rh->iov[2].iov_len = e->tail_len;
+	rh->iov[3].iov_base = (void *)e->body;
+	rh->iov[3].iov_len = e->body_len;
+	rh->iovcnt = head_only ? 3 : 4;
+	rh->iov_pos = 0;
+}
+
+int response_status_from_errno(int err)
+{
+	switch (err) {
+	case ENOENT:
+	case ENOTDIR:
+	case ENAMETOOLONG:
+	case ELOOP:
+	case EACCES:
+	case EISDIR:
+		return 404;
+	case EMFILE:
+	case ENFILE:
+	case ENOMEM:
+	case EAGAIN:
+		return 503;
+	default:
+		return 500;
+	}
+}
@@ -0,0 +1,163 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef RESPONSE_H_
+#define RESPONSE_H_	1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Length of an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define RESPONSE_DATE_LEN	29
+
+/*
+ * Fragments of a reply header: status + static, Date, per-file, route
+ * cache fields, Expires, Alt-Svc, length, and the body of a file sent
+ * from memory
+ */
+#define RESPONSE_HEADER_IOV	10
+
+/* Default lifetime of an Alt-Svc advertisement, one day */
+#define RESPONSE_ALT_SVC_MAX_AGE	86400
+
+/* Content length of bodies that last until the connection closes */
+#define RESPONSE_NO_LENGTH	((size_t)-1)
+
+/* Default max-age of immutable routes that set none, one year */
+#define RESPONSE_IMMUTABLE_MAX_AGE	31536000
+
+/* Longest ETag value, quotes and weakness prefix included, plus NUL */
+#define RESPONSE_ETAG_MAX	44
+
+/* Per-file header fragment, rendered once when the file is opened */
+struct file_headers {
+	char buf[192];
+	size_t len;
+};
+
+/* Caching policy of a route, rendered once by response_cache_policy() */
+struct cache_policy {
+	/* seconds, -1 when the route sets none */
+	long max_age;
+	int immutable;
+	int no_cache;
+	/* Cache-Control value, empty when the route has no policy */
+	char value[64];
+	size_t value_len;
+	/* HTTP/1.1 fields; for max-age routes they end with "Expires: " */
+	char fields[128];
+	size_t fields_len;
+};
+
+/* Reply header being written, as an iovec list over immutable fragments */
+struct response_header {
+	struct iovec iov[RESPONSE_HEADER_IOV];
+	int iovcnt;
+	/* first fragment not completely written yet */
+	int iov_pos;
+	/* variable fields spliced in for this reply */
+	char date[RESPONSE_DATE_LEN];
+	char expires[RESPONSE_DATE_LEN];
+	char length[48];
+};
+
+/* Format time as an IMF-fixdate into buf */
+void format_date(time_t time, char *buf, size_t size);
+
+/*
+ * Refresh the cached Date value if the second changed. Called by the event
+ * loop on every wakeup, so replies only copy RESPONSE_DATE_LEN bytes.
+ */
+void response_date_update(void);
+
+/* Cached Date value of the calling reactor */
+const char *response_date(void);
+
+/* Write the decimal representation of value, returns the number of digits */
+size_t response_format_uint(char *buf, uint64_t value);
+
+/* Content-Type of a file, picked by the extension of its name */
+const char *response_content_type(const char *name);
+
+/* Same as a small number for storage, 0 standing for octets */
+unsigned int response_content_type_id(const char *name);
+const char *response_content_type_from_id(unsigned int id);
+
+/*
+ * ETag of a file derived from its mtime and size, as "<mtime>-<size>" in
+ * hex; W/ prefixed when weak
+ */
+void response_stat_etag(char *buf, time_t mtime, off_t size, int weak);
+
+/* Strong ETag of a file from a hash of its contents, 16 hex digits */
+void response_hash_etag(char *buf, uint64_t hash);
+
+/* Whether etag is one response_hash_etag() renders */
+int response_etag_is_hash(const char *etag);
+
+/* Render Last-Modified, ETag (unless NULL) and Content-Type for a file */
+void response_file_headers(struct file_headers *fh, time_t mtime, const char *content_type,
+			   const char *etag);
+
+/* Entity fields of a generated body: Content-Type and Cache-Control: no-cache */
+void response_generated_headers(struct file_headers *fh, const char *content_type);
+
+/* Render the header fragments of a cache policy. Returns -1 if inconsistent. */
+int response_cache_policy(struct cache_policy *cp);
+
+/*
+ * Expires value of a policy for replies sent now, or NULL if it has none.
+ * Values are cached per reactor and max-age like the Date header.
+ */
+const char *response_expires(const struct cache_policy *cp);
+
+/*
+ * Assemble a 200 reply header for a file of the given length, or without
+ * Content-Length for RESPONSE_NO_LENGTH; cp may be NULL
+ */
+void response_header_build(struct response_header *rh, const struct file_headers *fh,
+			   const struct cache_policy *cp, size_t content_length);
+
+/* Append a body held in memory, so it goes out with the header */
+void response_header_body(struct response_header *rh, const void *body, size_t len);
+
+/* Render the static error replies; call once before serving requests */
+void response_init(void);
+
+/*
+ * Advertise an HTTP/3 endpoint on UDP port in the 200 replies from now
+ * on, valid for max_age seconds; port 0 stops the advertisement
+ */
+void response_alt_svc(unsigned short port, int max_age);
+
+/*
+ * Point rh at the pre-rendered reply for an error status (400, 404, 405,
+ * 413, 414, 431, 500 or 503; anything else becomes 500). Only the Date
+ * value is copied. With head_only set the body is left out.
+ */
+void response_error_build(struct response_header *rh, int status, int head_only);
+
+/* Map the errno of a failed open() to the status of the reply */
+int response_status_from_errno(int err);
+
+/* Total number of bytes still to be written */
+size_t response_header_pending(const struct response_header *rh);
+
+/*
+ * Write what is left of the header with sendmsg() and flags, MSG_MORE
+ * when the body follows in a separate call. Returns the number of bytes
+ * written, 0 if the socket is full and -1 on error.
+ */
+ssize_t response_header_send(int sockfd, struct response_header *rh, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RESPONSE_H_ */
@@ -0,0 +1,236 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "router.h"
+
+static const char * const type_names[] = {
+	[RESOURCE_TYPE_NONE]	= "none",
+	[RESOURCE_TYPE_STATIC]	= "static",
+	[RESOURCE_TYPE_DYNAMIC]	= "dynamic",
+	[RESOURCE_TYPE_STATUS]	= "status",
+	[RESOURCE_TYPE_EVENTS]	= "events",
+};
+
+const char *router_type_name(enum resource_type type)
+{
+	return type_names[type];
+}
+
+int router_type_parse(const char *name, enum resource_type *type)
+{
+	size_t i;
+
+	for (i = RESOURCE_TYPE_NONE + 1; i < sizeof(type_names) / sizeof(type_names[0]); i++) {
+		if (!strcmp(name, type_names[i])) {
+			*type = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+void router_init(struct router *router)
+{
+	memset(router, 0, sizeof(*router));
+}
+
+static void node_free(struct router_node *node)
+{
+	size_t i;
+
+	for (i = 0; i < node->nchildren; i++) {
+		node_free(node->children[i]);
+		free(node->children[i]);
+	}
+	free(node->children);
+	free(node->label);
+	if (node->route) {
+		free(node->route->prefix);
+		free(node->route->dir);
+		free(node->route->hub);
+		free(node->route);
+	}
+}
+
+void router_free(struct router *router)
+{
+	node_free(&router->root);
+	router_init(router);
+}
+
+// Function to find the child whose label starts with c (binary search)
+static struct router_node *node_child(const struct router_node *node, unsigned char c,
+				      size_t *pos)
+{
+	size_t lo = 0, hi = node->nchildren;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		unsigned char first = node->children[mid]->label[0];
+
+		if (first == c) {
+			if (pos)
+				*pos = mid;
+			return node->children[mid];
+		}
+		if (first < c)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (pos)
+		*pos = lo;
+
+	return NULL;
+}
+
+static struct router_node *node_new(const char *label, size_t len)
+{
+	struct router_node *node = calloc(1, sizeof(*node));
+
+	if (!node)
+		return NULL;
+
+	node->label = malloc(len + 1);
+	if (!node->label) {
+		free(node);
+		return NULL;
+	}
+	memcpy(node->label, label, len);
+	node->label[len] = '\0';
+	node->label_len = len;
+
+	return node;
+}
+
+static int node_insert_child(struct router_node *node, struct router_node *child, size_t pos)
+{
+	struct router_node **children;
+
+	children = realloc(node->children, (node->nchildren + 1) * sizeof(*children));
+	if (!children)
+		return -1;
+
+	memmove(children + pos + 1, children + pos, (node->nchildren - pos) * sizeof(*children));
+	children[pos] = child;
+	node->children = children;
+	node->nchildren++;
+
+	return 0;
+}
+
+// Function to split child after its first len label bytes
+static struct router_node *node_split(struct router_node *node, size_t pos, size_t len)
+{
+	struct router_node *child = node->children[pos];
+	struct router_node *mid = node_new(child->label, len);
+	char *rest;
+
+	if (!mid)
+		return NULL;
+
+	rest = strdup(child->label + len);
+	if (!rest || node_insert_child(mid, child, 0) < 0) {
+		free(rest);
+		node_free(mid);
+		free(mid);
+		return NULL;
+	}
+	free(child->label);
+	child->label = rest;
+	child->label_len -= len;
+	node->children[pos] = mid;
+
+	return mid;
+}
+
+struct route *router_add(struct router *router, const char *prefix,
+			 enum resource_type type)
+{
+	struct router_node *node = &router->root, *child;
+	const char *p = prefix;
+	struct route *route;
+	size_t pos, common;
+
+	// Walk down, splitting the edge where prefix leaves it
+	while (*p) {
+		child = node_child(node, *p, &pos);
+		if (!child) {
+			child = node_new(p, strlen(p));
+			if (!child || node_insert_child(node, child, pos) < 0) {
+				if (child)
+					node_free(child);
+				free(child);
+				return NULL;
+			}
+			node = child;
+			break;
+		}
+
+		for (common = 0; common < child->label_len && p[common] == child->label[common]; common++)
+			;
+		if (common < child->label_len) {
+			child = node_split(node, pos, common);
+			if (!child)
+				return NULL;
+		}
+		node = child;
+		p += common;
+	}
+
+	if (node->route)
+		return NULL;
+
+	route = calloc(1, sizeof(*route));
+	if (!route)
+		return NULL;
+	route->prefix = strdup(prefix);
+	if (!route->prefix) {
+		free(route);
+		return NULL;
+	}
+	route->prefix_len = strlen(prefix);
+	route->type = type;
+	route->cache.max_age = -1;
+	node->route = route;
+	router->nroutes++;
+
+	return route;
+}
+
+// Function to check that a mount point ends on a path segment boundary
+static int route_boundary(const struct route *route, const char *path)
+{
+	char next = path[route->prefix_len];
+
+	return route->prefix_len && (route->prefix[route->prefix_len - 1] == '/' ||
+				     next == '\0' || next == '/');
+}
+
+const struct route *router_match(const struct router *router, const char *path,
+				 size_t *matched)
+{
+	const struct router_node *node = &router->root;
+	const struct route *best = NULL;
+	const char *p = path;
+
+	for (;;) {
+		if (node->route && route_boundary(node->route, path))
+			best = node->route;
+		if (!*p)
+			break;
+
+		node = node_child(node, *p, NULL);
+		if (!node || strncmp(p, node->label, node->label_len))
+			break;
+		p += node->label_len;
+	}
+
+	if (best && matched)
+		*matched = best->prefix_len;
+
+	return best;
+}
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef ROUTER_H_
+#define ROUTER_H_	1
+
+#include <stddef.h>
+
+#include "response.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Resource type a mount point is served as */
+enum resource_type {
+	RESOURCE_TYPE_NONE,
+	RESOURCE_TYPE_STATIC,
+	RESOURCE_TYPE_DYNAMIC,
+	RESOURCE_TYPE_STATUS,
+	RESOURCE_TYPE_EVENTS
+};
+
+struct sse_hub;
+
+/* A mount point and its per-route settings */
+struct route {
+	char *prefix;
+	size_t prefix_len;
+	enum resource_type type;
+	/* directory under the document root, for file handlers */
+	char *dir;
+	/* Cache-Control and Expires of successful replies */
+	struct cache_policy cache;
+	/* list directories that have no index file */
+	int autoindex;
+	/* events routes: subscribers, and whether POST publishes to them */
+	struct sse_hub *hub;
+	int publish;
+	/* TCP_NOTSENT_LOWAT of HTTP/1.1 replies, 0 for the server one */
+	unsigned int notsent_lowat;
+};
+
+/* Compressed prefix trie node; children are sorted by first label byte */
+struct router_node {
+	char *label;
+	size_t label_len;
+	struct route *route;
+	struct router_node **children;
+	size_t nchildren;
+};
+
+struct router {
+	struct router_node root;
+	size_t nroutes;
+};
+
+void router_init(struct router *router);
+void router_free(struct router *router);
+
+/*
+ * Mount a resource type at prefix. Returns the new route so the caller can fill
+ * in its settings, or NULL if prefix is already mounted or on ENOMEM.
+ */
+struct route *router_add(struct router *router, const char *prefix,
+			 enum resource_type type);
+
+/*
+ * Longest mount point matching path, in O(strlen(path)). A mount point
+ * not ending in '/' only matches whole path segments. On success matched
+ * is set to the length of the mount point.
+ */
+const struct route *router_match(const struct router *router, const char *path,
+				 size_t *matched);
+
+/* Name of a resource type as used in the configuration file */
+const char *router_type_name(enum resource_type type);
+int router_type_parse(const char *name, enum resource_type *type);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ROUTER_H_ */
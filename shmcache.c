@@ -0,0 +1,654 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aws.h"
+#include "response.h"
+#include "shmcache.h"
+
+#define ALIGN64(x)	(((x) + 63) & ~(uint64_t)63)
+
+/* Block of the arena without a slot: padding, or a fill that lost */
+#define NO_SLOT		UINT32_MAX
+
+enum slot_state {
+	SLOT_EMPTY,
+	/* removed, lookups probe past it and claims reuse it */
+	SLOT_TOMB,
+	SLOT_FILLING,
+	SLOT_READY,
+};
+
+/* A process reading the segment, and the oldest epoch it may still use */
+struct shm_proc {
+	_Atomic int pid;
+	/* 0 while it holds nothing */
+	_Atomic uint64_t epoch;
+};
+
+/* Index entry; its fields are only read between two equal even seq values */
+struct shm_slot {
+	_Atomic uint64_t seq;
+	uint32_t state;
+	uint32_t has_data;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	/* arena offset of the block holding the contents */
+	uint64_t block;
+	/* when the fill started, to take over those of dead processes */
+	int64_t started;
+	char etag[RESPONSE_ETAG_MAX];
+};
+
+/* Header of an arena block, the contents follow it */
+struct shm_block {
+	/* header included, a multiple of 64 */
+	uint64_t len;
+	uint32_t slot;
+	uint32_t pad;
+	/* epoch in which the block was taken out of the index */
+	uint64_t retired;
+};
+
+struct shm_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nslots;
+	uint64_t size;
+	uint64_t slots_off;
+	uint64_t arena_off;
+	uint64_t arena_size;
+	uint64_t file_max;
+	_Atomic uint64_t epoch;
+	/* the arena ring, written with the lock held; positions only grow */
+	pthread_mutex_t lock;
+	uint64_t head;
+	/* blocks before it are out of the index */
+	uint64_t retire_tail;
+	/* blocks before it may be overwritten */
+	uint64_t free_tail;
+	struct shm_proc procs[SHMCACHE_MAX_PROCS];
+};
+
+static struct shm_header *shm;
+static struct shm_slot *slots;
+static char *arena;
+static struct shm_proc *self;
+
+/*
+ * Pins of this process in two generations: a new epoch opens a new one
+ * once the older drained, so long transfers do not hold back the epoch
+ * the process announces forever.
+ */
+static struct {
+	uint64_t epoch;
+	unsigned long pins;
+} gens[2];
+static int cur_gen;
+
+// Mix the identity of a file into the start of its probe sequence
+static uint64_t file_key(const struct stat *st)
+{
+	uint64_t h = (uint64_t)st->st_ino * 0x9e3779b97f4a7c15ULL;
+
+	h ^= (uint64_t)st->st_dev + (h << 6) + (h >> 2);
+	h ^= (uint64_t)st->st_size * 0xc2b2ae3d27d4eb4fULL;
+	h ^= (uint64_t)st->st_mtim.tv_sec + ((uint64_t)st->st_mtim.tv_nsec << 32);
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+
+	return h ^ (h >> 32);
+}
+
+static int slot_is(const struct shm_slot *slot, const struct stat *st)
+{
+	return slot->dev == (uint64_t)st->st_dev && slot->ino == (uint64_t)st->st_ino &&
+	       slot->size == (uint64_t)st->st_size && slot->mtime_sec == st->st_mtim.tv_sec &&
+	       slot->mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+// Function to copy a slot consistently; returns its seq, odd if it was busy
+static uint64_t slot_read(struct shm_slot *slot, struct shm_slot *copy)
+{
+	uint64_t seq;
+	int tries;
+
+	for (tries = 0; tries < 16; tries++) {
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq & 1)
+			continue;
+		memcpy((char *)copy + sizeof(copy->seq), (char *)slot + sizeof(slot->seq),
+		       sizeof(*slot) - sizeof(slot->seq));
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq)
+			return seq;
+	}
+
+	return 1;
+}
+
+// Function to start changing a slot last read at seq; fails if it moved
+static int slot_lock(struct shm_slot *slot, uint64_t seq)
+{
+	return atomic_compare_exchange_strong(&slot->seq, &seq, seq + 1);
+}
+
+static void slot_unlock(struct shm_slot *slot, uint64_t seq)
+{
+	atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+// Function to find the slot of a file; returns its index, or -1
+static long slot_find(const struct stat *st, struct shm_slot *copy, uint64_t *seq)
+{
+	uint32_t mask = shm->nslots - 1, i, n;
+
+	i = file_key(st) & mask;
+	for (n = 0; n < SHMCACHE_PROBE_MAX; n++, i = (i + 1) & mask) {
+		*seq = slot_read(&slots[i], copy);
+		// Being written: a claim or an update, possibly of this file
+		if (*seq & 1)
+			continue;
+		if (copy->state == SLOT_EMPTY)
+			break;
+		if (copy->state != SLOT_TOMB && slot_is(copy, st))
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Function to claim a slot for a file, pointing it at block; returns the
+ * index, or -1 if the file is there or being filled by a live fill
+ */
+static long slot_claim(const struct stat *st, uint64_t block, int has_data, uint64_t *seq)
+{
+	uint32_t mask = shm->nslots - 1, i, n;
+	time_t now = time(NULL);
+	struct shm_slot copy, *slot;
+	long found = -1;
+
+	i = file_key(st) & mask;
+	for (n = 0; n < SHMCACHE_PROBE_MAX; n++, i = (i + 1) & mask) {
+		*seq = slot_read(&slots[i], &copy);
+		if (*seq & 1)
+			continue;
+		if (copy.state == SLOT_EMPTY || copy.state == SLOT_TOMB) {
+			if (found < 0)
+				found = i;
+			if (copy.state == SLOT_EMPTY)
+				break;
+		} else if (slot_is(&copy, st)) {
+			if (copy.state == SLOT_READY || now - copy.started < SHMCACHE_FILL_TIMEOUT)
+				return -1;
+			found = i;
+			break;
+		}
+	}
+	if (found < 0)
+		return -1;
+
+	// Reread: the slot may have changed since it was seen free
+	slot = &slots[found];
+	*seq = slot_read(slot, &copy);
+	if ((*seq & 1) || !slot_lock(slot, *seq))
+		return -1;
+	slot->state = SLOT_FILLING;
+	slot->has_data = has_data;
+	slot->dev = st->st_dev;
+	slot->ino = st->st_ino;
+	slot->size = st->st_size;
+	slot->mtime_sec = st->st_mtim.tv_sec;
+	slot->mtime_nsec = st->st_mtim.tv_nsec;
+	slot->block = block;
+	slot->started = now;
+	slot->etag[0] = '\0';
+	slot_unlock(slot, *seq);
+	*seq += 2;
+
+	return found;
+}
+
+// Function to take the slot pointing at block out of the index
+static void slot_retire(uint32_t index, uint64_t block)
+{
+	struct shm_slot *slot = &slots[index], copy;
+	uint64_t seq;
+	int tries;
+
+	// Writers only hold a slot for a few stores
+	for (tries = 0; tries < 1000; tries++) {
+		seq = slot_read(slot, &copy);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		if (copy.block != block || copy.state < SLOT_FILLING)
+			return;
+		if (slot_lock(slot, seq)) {
+			slot->state = SLOT_TOMB;
+			slot_unlock(slot, seq);
+			return;
+		}
+	}
+}
+
+static void announce(void)
+{
+	uint64_t epoch = 0;
+
+	if (gens[cur_gen ^ 1].pins)
+		epoch = gens[cur_gen ^ 1].epoch;
+	else if (gens[cur_gen].pins)
+		epoch = gens[cur_gen].epoch;
+	atomic_store(&self->epoch, epoch);
+}
+
+// Function to enter the epoch before looking anything up; returns the pin
+static uint64_t pin(void)
+{
+	uint64_t epoch = atomic_load(&shm->epoch);
+
+	if (gens[cur_gen].epoch != epoch) {
+		if (!gens[cur_gen].pins) {
+			gens[cur_gen].epoch = epoch;
+		} else if (!gens[cur_gen ^ 1].pins) {
+			cur_gen ^= 1;
+			gens[cur_gen].epoch = epoch;
+		}
+	}
+	gens[cur_gen].pins++;
+	announce();
+
+	return gens[cur_gen].epoch;
+}
+
+void shmcache_release(uint64_t epoch)
+{
+	int gen = gens[cur_gen].epoch == epoch && gens[cur_gen].pins ? cur_gen : cur_gen ^ 1;
+
+	gens[gen].pins--;
+	announce();
+}
+
+// Function to find the oldest epoch still announced, clearing dead processes
+static uint64_t oldest_epoch(uint64_t below)
+{
+	uint64_t oldest = UINT64_MAX, epoch;
+	int i, pid;
+
+	for (i = 0; i < SHMCACHE_MAX_PROCS; i++) {
+		epoch = atomic_load(&shm->procs[i].epoch);
+		pid = atomic_load(&shm->procs[i].pid);
+		if (!epoch || !pid)
+			continue;
+		// Only worth a system call when it holds something back
+		if (epoch <= below && kill(pid, 0) < 0 && errno == ESRCH) {
+			atomic_store(&shm->procs[i].epoch, 0);
+			atomic_store(&shm->procs[i].pid, 0);
+			continue;
+		}
+		if (epoch < oldest)
+			oldest = epoch;
+	}
+
+	return oldest;
+}
+
+static struct shm_block *block_at(uint64_t pos)
+{
+	return (struct shm_block *)(arena + pos % shm->arena_size);
+}
+
+// Function to make room for len bytes at the head, called with the lock held
+static uint64_t arena_alloc_locked(size_t len)
+{
+	uint64_t need = ALIGN64(sizeof(struct shm_block) + len), pos = shm->head, end, oldest;
+	uint64_t pad = 0, epoch;
+	struct shm_block *b;
+	int retired = 0;
+
+	if (pos % shm->arena_size + need > shm->arena_size)
+		pad = shm->arena_size - pos % shm->arena_size;
+	end = pos + pad + need;
+
+	// Blocks about to be overwritten leave the index first
+	epoch = atomic_load(&shm->epoch);
+	while (end - shm->retire_tail > shm->arena_size) {
+		b = block_at(shm->retire_tail);
+		if (b->slot != NO_SLOT)
+			slot_retire(b->slot, shm->retire_tail % shm->arena_size);
+		b->retired = epoch;
+		shm->retire_tail += b->len;
+		retired = 1;
+	}
+	if (retired)
+		atomic_fetch_add(&shm->epoch, 1);
+
+	// Then wait until nobody who could have found them is reading
+	oldest = UINT64_MAX;
+	while (end - shm->free_tail > shm->arena_size) {
+		b = block_at(shm->free_tail);
+		if (oldest == UINT64_MAX)
+			oldest = oldest_epoch(b->retired);
+		if (b->retired >= oldest)
+			return UINT64_MAX;
+		shm->free_tail += b->len;
+	}
+
+	if (pad) {
+		b = block_at(pos);
+		b->len = pad;
+		b->slot = NO_SLOT;
+		pos += pad;
+	}
+	b = block_at(pos);
+	b->len = need;
+	b->slot = NO_SLOT;
+	b->retired = 0;
+	shm->head = end;
+
+	return pos % shm->arena_size;
+}
+
+/*
+ * Function to add a file to the index with a block of len bytes, pinned;
+ * returns the slot, or -1 with nothing pinned
+ */
+static long slot_add(const struct stat *st, size_t len, int has_data, uint64_t *block,
+		     uint64_t *seq, uint64_t *epoch)
+{
+	struct shm_slot copy;
+	long index = -1;
+	int rc;
+
+	// A process that died holding the lock only left the ring positions
+	rc = pthread_mutex_trylock(&shm->lock);
+	if (rc == EOWNERDEAD)
+		pthread_mutex_consistent(&shm->lock);
+	else if (rc)
+		return -1;
+	*block = arena_alloc_locked(len);
+	if (*block != UINT64_MAX)
+		index = slot_claim(st, *block, has_data, seq);
+	// Linked while the ring cannot move, so retiring the block finds the slot
+	if (index >= 0)
+		((struct shm_block *)(arena + *block))->slot = index;
+	pthread_mutex_unlock(&shm->lock);
+	if (index < 0)
+		return -1;
+
+	// Retiring the block from now on waits for this pin
+	*epoch = pin();
+	if (slot_read(&slots[index], &copy) != *seq) {
+		shmcache_release(*epoch);
+		return -1;
+	}
+
+	return index;
+}
+
+// Function to make a filled slot visible; fails if it was retired meanwhile
+static int slot_publish(long index, uint64_t seq)
+{
+	struct shm_slot *slot = &slots[index];
+
+	if (!slot_lock(slot, seq))
+		return -1;
+	slot->state = SLOT_READY;
+	slot_unlock(slot, seq);
+
+	return 0;
+}
+
+const char *shmcache_acquire(int fd, const struct stat *st, uint64_t *pinp)
+{
+	struct shm_slot copy;
+	uint64_t seq, block, epoch;
+	const char *data;
+	long index;
+
+	if (!shm || (uint64_t)st->st_size > shm->file_max)
+		return NULL;
+
+	epoch = pin();
+	index = slot_find(st, &copy, &seq);
+	if (index >= 0 && copy.state == SLOT_READY && copy.has_data) {
+		server_stats.shmcache_hits++;
+		*pinp = epoch;
+		return arena + copy.block + sizeof(struct shm_block);
+	}
+	shmcache_release(epoch);
+
+	// Being filled by another process, unless it died doing so
+	if (index >= 0 && copy.state == SLOT_FILLING &&
+	    time(NULL) - copy.started < SHMCACHE_FILL_TIMEOUT) {
+		server_stats.shmcache_busy++;
+		return NULL;
+	}
+
+	index = slot_add(st, st->st_size, 1, &block, &seq, &epoch);
+	if (index < 0) {
+		server_stats.shmcache_busy++;
+		return NULL;
+	}
+	data = arena + block + sizeof(struct shm_block);
+	if (pread(fd, (char *)data, st->st_size, 0) != st->st_size || slot_publish(index, seq) < 0) {
+		slot_retire(index, block);
+		shmcache_release(epoch);
+		return NULL;
+	}
+
+	server_stats.shmcache_fills++;
+	*pinp = epoch;
+	return data;
+}
+
+int shmcache_etag(const struct stat *st, char *etag)
+{
+	struct shm_slot copy;
+	uint64_t seq;
+
+	if (!shm || slot_find(st, &copy, &seq) < 0 || copy.state != SLOT_READY || !copy.etag[0])
+		return -1;
+	memcpy(etag, copy.etag, RESPONSE_ETAG_MAX);
+	etag[RESPONSE_ETAG_MAX - 1] = '\0';
+
+	return 0;
+}
+
+void shmcache_set_etag(const struct stat *st, const char *etag)
+{
+	struct shm_slot copy;
+	uint64_t seq, block, epoch;
+	long index;
+
+	if (!shm)
+		return;
+
+	index = slot_find(st, &copy, &seq);
+	if (index >= 0 && copy.state != SLOT_READY)
+		return;
+	// Files too large for the arena still share their metadata; smaller
+	// ones only with their contents
+	if (index < 0 && (uint64_t)st->st_size <= shm->file_max)
+		return;
+	if (index < 0) {
+		index = slot_add(st, 0, 0, &block, &seq, &epoch);
+		if (index < 0)
+			return;
+		shmcache_release(epoch);
+	}
+
+	if (!slot_lock(&slots[index], seq))
+		return;
+	snprintf(slots[index].etag, RESPONSE_ETAG_MAX, "%s", etag);
+	slots[index].state = SLOT_READY;
+	slot_unlock(&slots[index], seq);
+}
+
+// Function to set up a segment this process just created
+static int segment_format(int fd, size_t size, size_t file_max)
+{
+	uint64_t nslots = 256, slots_off, arena_off;
+	pthread_mutexattr_t attr;
+	struct shm_header *hdr;
+	void *map;
+
+	slots_off = ALIGN64(sizeof(struct shm_header));
+	while (nslots * SHMCACHE_BYTES_PER_SLOT < size)
+		nslots *= 2;
+	arena_off = ALIGN64(slots_off + nslots * sizeof(struct shm_slot));
+	// Whole files must fit several times over, or the ring thrashes
+	if (arena_off + 8 * ALIGN64(sizeof(struct shm_block) + file_max) > size) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ftruncate(fd, size) < 0)
+		return -1;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = map;
+	hdr->version = SHMCACHE_VERSION;
+	hdr->nslots = nslots;
+	hdr->size = size;
+	hdr->slots_off = slots_off;
+	hdr->arena_off = arena_off;
+	hdr->arena_size = (size - arena_off) & ~(uint64_t)63;
+	hdr->file_max = file_max;
+	atomic_store(&hdr->epoch, 1);
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&hdr->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	// The magic goes last, the other processes wait for it
+	atomic_thread_fence(memory_order_release);
+	memcpy(hdr->magic, SHMCACHE_MAGIC, sizeof(hdr->magic));
+	munmap(map, size);
+
+	return 0;
+}
+
+// Function to map a segment, waiting a little for its creator to format it
+static struct shm_header *segment_map(int fd)
+{
+	struct shm_header *hdr;
+	struct stat st;
+	int tries;
+
+	for (tries = 0; tries < 100; tries++) {
+		if (fstat(fd, &st) < 0)
+			return NULL;
+		if ((size_t)st.st_size >= sizeof(*hdr)) {
+			hdr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (hdr == MAP_FAILED)
+				return NULL;
+			if (!memcmp(hdr->magic, SHMCACHE_MAGIC, sizeof(hdr->magic))) {
+				atomic_thread_fence(memory_order_acquire);
+				if (hdr->version == SHMCACHE_VERSION && hdr->size == (uint64_t)st.st_size)
+					return hdr;
+				munmap(hdr, st.st_size);
+				errno = EINVAL;
+				return NULL;
+			}
+			munmap(hdr, st.st_size);
+		}
+		usleep(10000);
+	}
+	errno = ETIMEDOUT;
+
+	return NULL;
+}
+
+int shmcache_init(const char *name, size_t size, size_t file_max)
+{
+	struct shm_header *hdr;
+	int fd, err, i, expected;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0) {
+		if (segment_format(fd, size, file_max) < 0) {
+			err = errno;
+			close(fd);
+			shm_unlink(name);
+			errno = err;
+			return -1;
+		}
+	} else if (errno == EEXIST) {
+		fd = shm_open(name, O_RDWR, 0);
+	}
+	if (fd < 0)
+		return -1;
+
+	hdr = segment_map(fd);
+	err = errno;
+	close(fd);
+	if (!hdr) {
+		errno = err;
+		return -1;
+	}
+
+	for (i = 0; i < SHMCACHE_MAX_PROCS; i++) {
+		expected = 0;
+		if (atomic_compare_exchange_strong(&hdr->procs[i].pid, &expected, getpid()))
+			break;
+		// Taken by a process that is gone
+		if (kill(expected, 0) < 0 && errno == ESRCH &&
+		    atomic_compare_exchange_strong(&hdr->procs[i].pid, &expected, getpid()))
+			break;
+	}
+	if (i == SHMCACHE_MAX_PROCS) {
+		munmap(hdr, hdr->size);
+		errno = EUSERS;
+		return -1;
+	}
+
+	shm = hdr;
+	self = &hdr->procs[i];
+	atomic_store(&self->epoch, 0);
+	slots = (struct shm_slot *)((char *)hdr + hdr->slots_off);
+	arena = (char *)hdr + hdr->arena_off;
+
+	return 0;
+}
+
+void shmcache_close(void)
+{
+	if (!shm)
+		return;
+
+	atomic_store(&self->epoch, 0);
+	atomic_store(&self->pid, 0);
+	munmap(shm, shm->size);
+	shm = NULL;
+	slots = NULL;
+	arena = NULL;
+	self = NULL;
+}
+
+size_t shmcache_file_max(void)
+{
+	return shm ? shm->file_max : 0;
+}
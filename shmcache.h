@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef SHMCACHE_H_
+#define SHMCACHE_H_	1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHMCACHE_MAGIC		"AWSSHMC1"
+#define SHMCACHE_VERSION	1
+
+/* Server processes attached to one segment at the same time */
+#define SHMCACHE_MAX_PROCS	64
+
+/* Largest file kept in the segment unless the configuration sets one */
+#define SHMCACHE_DEFAULT_FILE_MAX	(64 << 10)
+
+/* Index slots per this many bytes of contents, and the probes per lookup */
+#define SHMCACHE_BYTES_PER_SLOT	2048
+#define SHMCACHE_PROBE_MAX	64
+
+/* Seconds after which a fill left by a dead process may be taken over */
+#define SHMCACHE_FILL_TIMEOUT	10
+
+/*
+ * Contents and metadata of files shared by every server process of the
+ * host through a POSIX shared memory segment:
+ *
+ *   header | process table | index slots | arena
+ *
+ * The index is open addressed and keyed by the identity of the file
+ * (device, inode, size, mtime), so processes serving the same tree from
+ * different configurations share it. Readers never lock: each slot is a
+ * seqlock and is claimed with a compare-and-swap, so a miss is filled by
+ * the first process that sees it while the others keep serving from
+ * their descriptor. The arena is a ring of blocks written under a robust
+ * process-shared mutex; blocks are overwritten oldest first, once no
+ * process still reading in the epoch they were retired can reach them.
+ */
+
+/*
+ * Attach to the segment called name, creating it with size bytes and a
+ * file_max limit if it does not exist; an existing segment keeps its own
+ * geometry. Returns 0, or -1 and sets errno.
+ */
+int shmcache_init(const char *name, size_t size, size_t file_max);
+
+/* Detach; the segment stays for the other processes */
+void shmcache_close(void);
+
+/* Largest file the segment takes, 0 when there is no segment */
+size_t shmcache_file_max(void);
+
+/*
+ * Contents of the file open as fd and described by st, filled from fd if
+ * no process did it yet. The bytes stay valid until shmcache_release()
+ * of *pin. Returns NULL if the file is being filled by another process
+ * or there is no room now.
+ */
+const char *shmcache_acquire(int fd, const struct stat *st, uint64_t *pin);
+void shmcache_release(uint64_t pin);
+
+/* Copy the ETag stored for the file into etag. Returns 0, or -1 if none. */
+int shmcache_etag(const struct stat *st, char *etag);
+
+/* Store the ETag of the file for the other processes */
+void shmcache_set_etag(const struct stat *st, const char *etag);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHMCACHE_H_ */
@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "sockprofile.h"
+
+int sock_somaxconn(void)
+{
+	FILE *f = fopen("/proc/sys/net/core/somaxconn", "re");
+	int n = 0;
+
+	if (f) {
+		if (fscanf(f, "%d", &n) != 1)
+			n = 0;
+		fclose(f);
+	}
+
+	return n > 0 ? n : SOCKPROFILE_SOMAXCONN;
+}
+
+int sock_profile_backlog(const struct sock_profile *profile)
+{
+	int max = sock_somaxconn();
+
+	if (!profile->backlog || profile->backlog > max)
+		return max;
+
+	return profile->backlog;
+}
+
+static int set_int(int fd, int level, int name, int value)
+{
+	return setsockopt(fd, level, name, &value, sizeof(value));
+}
+
+static int get_int(int fd, int level, int name)
+{
+	socklen_t len;
+	int value;
+
+	len = sizeof(value);
+	if (getsockopt(fd, level, name, &value, &len) < 0)
+		return -1;
+
+	return value;
+}
+
+// Function to set the options of the profile in mask on fd
+static int apply(int fd, const struct sock_profile *p, unsigned int mask)
+{
+	mask &= p->set;
+
+	if ((mask & SOCKOPT_DEFER_ACCEPT) &&
+	    set_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, p->defer_accept) < 0)
+		return -1;
+	if ((mask & SOCKOPT_NODELAY) && set_int(fd, IPPROTO_TCP, TCP_NODELAY, 1) < 0)
+		return -1;
+	if ((mask & SOCKOPT_SNDBUF) && set_int(fd, SOL_SOCKET, SO_SNDBUF, p->sndbuf) < 0)
+		return -1;
+	if ((mask & SOCKOPT_RCVBUF) && set_int(fd, SOL_SOCKET, SO_RCVBUF, p->rcvbuf) < 0)
+		return -1;
+	if (mask & SOCKOPT_KEEPALIVE) {
+		if (set_int(fd, SOL_SOCKET, SO_KEEPALIVE, 1) < 0 ||
+		    set_int(fd, IPPROTO_TCP, TCP_KEEPIDLE, p->keep_idle) < 0 ||
+		    set_int(fd, IPPROTO_TCP, TCP_KEEPINTVL, p->keep_intvl) < 0 ||
+		    set_int(fd, IPPROTO_TCP, TCP_KEEPCNT, p->keep_cnt) < 0)
+			return -1;
+	}
+	if ((mask & SOCKOPT_QUICKACK) && set_int(fd, IPPROTO_TCP, TCP_QUICKACK, 1) < 0)
+		return -1;
+	if ((mask & SOCKOPT_FASTOPEN) && set_int(fd, IPPROTO_TCP, TCP_FASTOPEN, p->fastopen) < 0)
+		return -1;
+
+	return 0;
+}
+
+int sock_profile_listener(int fd, struct sock_profile *profile)
+{
+	// Quick ACK mode is not kept by the socket, let alone passed on
+	if (apply(fd, profile, ~(unsigned int)SOCKOPT_QUICKACK) < 0)
+		return -1;
+	profile->listen_sndbuf = get_int(fd, SOL_SOCKET, SO_SNDBUF);
+	profile->listen_rcvbuf = get_int(fd, SOL_SOCKET, SO_RCVBUF);
+
+	return 0;
+}
+
+// Function to find the options of the profile the accepted socket lacks
+static unsigned int not_inherited(int fd, const struct sock_profile *p)
+{
+	unsigned int missing = SOCKOPT_QUICKACK;
+
+	if (get_int(fd, IPPROTO_TCP, TCP_NODELAY) <= 0)
+		missing |= SOCKOPT_NODELAY;
+	// The kernel doubles and caps the sizes asked for: compare what it kept
+	if (get_int(fd, SOL_SOCKET, SO_SNDBUF) != p->listen_sndbuf)
+		missing |= SOCKOPT_SNDBUF;
+	if (get_int(fd, SOL_SOCKET, SO_RCVBUF) != p->listen_rcvbuf)
+		missing |= SOCKOPT_RCVBUF;
+	if (get_int(fd, SOL_SOCKET, SO_KEEPALIVE) <= 0 ||
+	    get_int(fd, IPPROTO_TCP, TCP_KEEPIDLE) != p->keep_idle ||
+	    get_int(fd, IPPROTO_TCP, TCP_KEEPINTVL) != p->keep_intvl ||
+	    get_int(fd, IPPROTO_TCP, TCP_KEEPCNT) != p->keep_cnt)
+		missing |= SOCKOPT_KEEPALIVE;
+
+	return missing & p->set;
+}
+
+void sock_profile_accepted(int fd, struct sock_profile *profile)
+{
+	if (!profile->checked) {
+		profile->per_accept = not_inherited(fd, profile);
+		profile->checked = 1;
+	}
+	if (profile->per_accept)
+		apply(fd, profile, profile->per_accept);
+}
+
+int sock_syn_data(int fd)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+		return 0;
+
+	return !!(info.tcpi_options & TCPI_OPT_SYN_DATA);
+}
+
+size_t sock_profile_report(int listenfd, const struct sock_profile *profile,
+			   char *buf, size_t size)
+{
+	static const struct {
+		unsigned int bit;
+		const char *name;
+	} options[] = {
+		{ SOCKOPT_NODELAY, "nodelay" },
+		{ SOCKOPT_SNDBUF, "sndbuf" },
+		{ SOCKOPT_RCVBUF, "rcvbuf" },
+		{ SOCKOPT_KEEPALIVE, "keepalive" },
+		{ SOCKOPT_QUICKACK, "quickack" },
+	};
+	char per_accept[64] = "";
+	size_t i;
+	int len;
+
+	for (i = 0; i < sizeof(options) / sizeof(options[0]); i++)
+		if (profile->per_accept & options[i].bit)
+			snprintf(per_accept + strlen(per_accept), sizeof(per_accept) - strlen(per_accept),
+				 "%s%s", per_accept[0] ? "," : "", options[i].name);
+
+	len = snprintf(buf, size,
+		       "sock_profile %s\n"
+		       "listen_backlog %d\n"
+		       "somaxconn %d\n"
+		       "tcp_defer_accept %d\n"
+		       "tcp_nodelay %d\n"
+		       "so_sndbuf %d\n"
+		       "so_rcvbuf %d\n"
+		       "so_keepalive %d\n"
+		       "tcp_keepidle %d\n"
+		       "tcp_keepintvl %d\n"
+		       "tcp_keepcnt %d\n"
+		       "tcp_fastopen %d\n"
+		       "sock_per_accept %s\n",
+		       profile->name,
+		       sock_profile_backlog(profile),
+		       sock_somaxconn(),
+		       get_int(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT),
+		       get_int(listenfd, IPPROTO_TCP, TCP_NODELAY),
+		       get_int(listenfd, SOL_SOCKET, SO_SNDBUF),
+		       get_int(listenfd, SOL_SOCKET, SO_RCVBUF),
+		       get_int(listenfd, SOL_SOCKET, SO_KEEPALIVE),
+		       get_int(listenfd, IPPROTO_TCP, TCP_KEEPIDLE),
+		       get_int(listenfd, IPPROTO_TCP, TCP_KEEPINTVL),
+		       get_int(listenfd, IPPROTO_TCP, TCP_KEEPCNT),
+		       get_int(listenfd, IPPROTO_TCP, TCP_FASTOPEN),
+		       !profile->checked ? "unknown" : per_accept[0] ? per_accept : "none");
+	if (len < 0)
+		return 0;
+
+	return (size_t)len < size ? (size_t)len : size - 1;
+}
@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef SOCKPROFILE_H_
+#define SOCKPROFILE_H_	1
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Backlog used when net.core.somaxconn cannot be read */
+#define SOCKPROFILE_SOMAXCONN	4096
+
+/* Options a profile sets, anything else keeps the kernel default */
+enum sock_option {
+	SOCKOPT_DEFER_ACCEPT	= 1 << 0,
+	SOCKOPT_NODELAY		= 1 << 1,
+	SOCKOPT_SNDBUF		= 1 << 2,
+	SOCKOPT_RCVBUF		= 1 << 3,
+	SOCKOPT_KEEPALIVE	= 1 << 4,
+	SOCKOPT_QUICKACK	= 1 << 5,
+	SOCKOPT_FASTOPEN	= 1 << 6,
+};
+
+/*
+ * A named set of socket options. They are set once on the listener,
+ * before listen() so that the buffer sizes shape the window scale, and
+ * accepted sockets inherit them from it. The first accepted socket is
+ * checked for each option, and those the kernel did not carry over are
+ * set again on every accept, as TCP_QUICKACK always is.
+ */
+struct sock_profile {
+	char *name;
+	/* listen() backlog, capped at somaxconn; 0 for somaxconn itself */
+	int backlog;
+	/* SOCKOPT_* the profile sets */
+	unsigned int set;
+	/* seconds TCP_DEFER_ACCEPT waits for data */
+	int defer_accept;
+	int sndbuf;
+	int rcvbuf;
+	/* keepalive probes: idle time and interval in seconds, and count */
+	int keep_idle;
+	int keep_intvl;
+	int keep_cnt;
+	/* TCP Fast Open: connections with SYN data waiting for accept() at most */
+	int fastopen;
+	/* buffer sizes the listener ended up with, for comparison */
+	int listen_sndbuf;
+	int listen_rcvbuf;
+	/* SOCKOPT_* set on each accepted socket, known after the first one */
+	unsigned int per_accept;
+	int checked;
+	struct sock_profile *next;
+};
+
+/* net.core.somaxconn, or SOCKPROFILE_SOMAXCONN if it cannot be read */
+int sock_somaxconn(void);
+
+/* Backlog the kernel gives a listener of the profile */
+int sock_profile_backlog(const struct sock_profile *profile);
+
+/*
+ * Set the listener options of the profile on fd, a bound socket that
+ * listen() was not called on yet. Returns 0, or -1 and sets errno.
+ */
+int sock_profile_listener(int fd, struct sock_profile *profile);
+
+/* Set what the accepted socket fd did not inherit from the listener */
+void sock_profile_accepted(int fd, struct sock_profile *profile);
+
+/* Whether the data in the SYN of the accepted socket fd was taken */
+int sock_syn_data(int fd);
+
+/*
+ * Render the values the kernel reports for the listener, one "name
+ * value" line each. Returns the length written, truncated to size.
+ */
+size_t sock_profile_report(int listenfd, const struct sock_profile *profile,
+			   char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SOCKPROFILE_H_ */
@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "aws.h"
+#include "sse.h"
+#include "utils/w_epoll.h"
+
+static void event_put(struct sse_event *ev)
+{
+	if (--ev->refs == 0)
+		free(ev);
+}
+
+// Function to encode an event: an id, then one data field per line
+static struct sse_event *event_encode(uint64_t id, const char *data, size_t len)
+{
+	struct sse_event *ev;
+	size_t lines = 1, i, start, end;
+	char *p;
+
+	for (i = 0; i < len; i++)
+		if (data[i] == '\n')
+			lines++;
+
+	ev = malloc(sizeof(*ev) + 32 + len + lines * 7);
+	if (!ev)
+		return NULL;
+
+	p = ev->data;
+	p += sprintf(p, "id: %llu\n", (unsigned long long)id);
+	for (start = 0, i = 0; i <= len; i++) {
+		if (i < len && data[i] != '\n')
+			continue;
+		// A trailing newline does not start one more line
+		if (i == len && start == len && len)
+			break;
+
+		// CRLF line ends lose their CR
+		end = i > start && data[i - 1] == '\r' ? i - 1 : i;
+		memcpy(p, "data: ", 6);
+		p += 6;
+		memcpy(p, data + start, end - start);
+		p += end - start;
+		*p++ = '\n';
+		start = i + 1;
+	}
+	*p++ = '\n';
+
+	ev->len = p - ev->data;
+	ev->refs = 0;
+
+	return ev;
+}
+
+void sse_hub_init(struct sse_hub *hub, unsigned int queue_len, enum sse_overflow overflow)
+{
+	memset(hub, 0, sizeof(*hub));
+	hub->queue_len = queue_len;
+	hub->overflow = overflow;
+}
+
+int sse_subscribe(struct sse_hub *hub, struct connection *conn)
+{
+	struct sse_subscriber *sub;
+
+	sub = calloc(1, sizeof(*sub));
+	if (!sub)
+		return -1;
+	sub->queue = calloc(hub->queue_len, sizeof(*sub->queue));
+	if (!sub->queue) {
+		free(sub);
+		return -1;
+	}
+
+	sub->conn = conn;
+	sub->hub = hub;
+	sub->next = hub->subscribers;
+	if (hub->subscribers)
+		hub->subscribers->prev = sub;
+	hub->subscribers = sub;
+	hub->nsubscribers++;
+	conn->sse = sub;
+	server_stats.sse_subscribers++;
+
+	return 0;
+}
+
+// Function to drop the count oldest queued events of a subscriber
+static void queue_drop(struct sse_subscriber *sub, unsigned int count)
+{
+	unsigned int len = sub->hub->queue_len;
+
+	while (count--) {
+		event_put(sub->queue[sub->head]);
+		sub->head = (sub->head + 1) % len;
+		sub->count--;
+	}
+}
+
+// Function to drop the queued events after the first keep ones
+static void queue_truncate(struct sse_subscriber *sub, unsigned int keep)
+{
+	unsigned int len = sub->hub->queue_len;
+
+	while (sub->count > keep) {
+		sub->count--;
+		event_put(sub->queue[(sub->head + sub->count) % len]);
+	}
+}
+
+void sse_unsubscribe(struct sse_subscriber *sub)
+{
+	struct sse_hub *hub = sub->hub;
+
+	queue_drop(sub, sub->count);
+
+	if (sub->prev)
+		sub->prev->next = sub->next;
+	else
+		hub->subscribers = sub->next;
+	if (sub->next)
+		sub->next->prev = sub->prev;
+	hub->nsubscribers--;
+	server_stats.sse_subscribers--;
+
+	sub->conn->sse = NULL;
+	free(sub->queue);
+	free(sub);
+}
+
+long sse_publish(struct sse_hub *hub, int epollfd, const char *data, size_t len)
+{
+	struct sse_subscriber *sub;
+	struct sse_event *ev;
+	long queued = 0;
+
+	ev = event_encode(++hub->last_id, data, len);
+	if (!ev)
+		return -1;
+	// The publisher holds a reference until every queue has one
+	ev->refs = 1;
+	server_stats.sse_events++;
+
+	for (sub = hub->subscribers; sub; sub = sub->next) {
+		if (sub->overflowed)
+			continue;
+
+		if (sub->count == hub->queue_len) {
+			server_stats.sse_overflows++;
+			if (hub->overflow == SSE_OVERFLOW_DISCONNECT) {
+				sub->overflowed = 1;
+			} else {
+				// Skip ahead, keeping only the event on the wire
+				queue_truncate(sub, sub->offset ? 1 : 0);
+			}
+		}
+
+		if (!sub->overflowed) {
+			ev->refs++;
+			sub->queue[(sub->head + sub->count) % hub->queue_len] = ev;
+			sub->count++;
+			queued++;
+		}
+
+		// Idle subscribers only watch for their peer closing
+		if (sub->conn->state == STATE_EVENT_WAIT) {
+			sub->conn->state = STATE_SENDING_DATA;
+			w_epoll_update_ptr_out(epollfd, sub->conn->sockfd, sub->conn);
+		}
+	}
+	event_put(ev);
+
+	return queued;
+}
+
+int sse_send(struct sse_subscriber *sub)
+{
+	struct iovec iov[SSE_MAX_IOV];
+	unsigned int i, n, len = sub->hub->queue_len;
+	struct sse_event *ev;
+	ssize_t sent;
+
+	if (sub->overflowed)
+		return -1;
+
+	while (sub->count) {
+		n = sub->count < SSE_MAX_IOV ? sub->count : SSE_MAX_IOV;
+		for (i = 0; i < n; i++) {
+			ev = sub->queue[(sub->head + i) % len];
+			iov[i].iov_base = ev->data;
+			iov[i].iov_len = ev->len;
+		}
+		iov[0].iov_base = (char *)iov[0].iov_base + sub->offset;
+		iov[0].iov_len -= sub->offset;
+
+		sent = writev(sub->conn->sockfd, iov, n);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			return -1;
+		}
+
+		// Release the events that were written completely
+		sent += sub->offset;
+		sub->offset = 0;
+		while (sub->count && (size_t)sent >= sub->queue[sub->head]->len) {
+			sent -= sub->queue[sub->head]->len;
+			queue_drop(sub, 1);
+		}
+		sub->offset = sent;
+		if (sent)
+			return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef SSE_H_
+#define SSE_H_	1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Events a subscriber may have queued unless the route sets queue= */
+#define SSE_DEFAULT_QUEUE	64
+
+/* Queued events written by one writev() */
+#define SSE_MAX_IOV		64
+
+struct connection;
+
+/* What happens to a subscriber whose queue is full when an event comes */
+enum sse_overflow {
+	/* close its connection */
+	SSE_OVERFLOW_DISCONNECT,
+	/* drop what it has not started sending, the gap shows in the ids */
+	SSE_OVERFLOW_SKIP
+};
+
+/* An encoded event, shared by the queues of every subscriber */
+struct sse_event {
+	int refs;
+	size_t len;
+	char data[];
+};
+
+struct sse_subscriber {
+	struct connection *conn;
+	struct sse_hub *hub;
+	struct sse_subscriber *prev;
+	struct sse_subscriber *next;
+
+	/* ring of hub->queue_len events, head is being sent */
+	struct sse_event **queue;
+	unsigned int head;
+	unsigned int count;
+	/* bytes of the head event already sent */
+	size_t offset;
+	/* the queue overflowed with SSE_OVERFLOW_DISCONNECT */
+	int overflowed;
+};
+
+/* Subscribers of one event route */
+struct sse_hub {
+	struct sse_subscriber *subscribers;
+	size_t nsubscribers;
+	unsigned int queue_len;
+	enum sse_overflow overflow;
+	uint64_t last_id;
+};
+
+void sse_hub_init(struct sse_hub *hub, unsigned int queue_len, enum sse_overflow overflow);
+
+/* Attach conn to hub; sets conn->sse. Returns 0 or -1 on ENOMEM. */
+int sse_subscribe(struct sse_hub *hub, struct connection *conn);
+
+/* Detach a subscriber and drop the events it still had queued */
+void sse_unsubscribe(struct sse_subscriber *sub);
+
+/*
+ * Encode data as one event and queue it to every subscriber, waking the
+ * idle ones through epollfd. Each line of data becomes a data: field.
+ * Returns the number of subscribers it was queued to, or -1 on ENOMEM.
+ */
+long sse_publish(struct sse_hub *hub, int epollfd, const char *data, size_t len);
+
+/*
+ * Write queued events to the subscriber socket. Returns 1 if events are
+ * still queued, 0 once the queue is empty and -1 if the subscriber must
+ * be disconnected.
+ */
+int sse_send(struct sse_subscriber *sub);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SSE_H_ */
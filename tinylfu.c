@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tinylfu.h"
+
+/* Odd multipliers picking a different counter in each row */
+static const uint32_t sketch_seeds[TLFU_SKETCH_DEPTH] = {
+	0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f
+};
+
+static void list_unlink(struct tlfu_list *list, struct tlfu_node *node)
+{
+	if (node->prev)
+		node->prev->next = node->next;
+	else
+		list->head = node->next;
+	if (node->next)
+		node->next->prev = node->prev;
+	else
+		list->tail = node->prev;
+	node->prev = NULL;
+	node->next = NULL;
+	list->len--;
+}
+
+static void list_push(struct tlfu_list *list, struct tlfu_node *node)
+{
+	node->prev = NULL;
+	node->next = list->head;
+	if (list->head)
+		list->head->prev = node;
+	list->head = node;
+	if (!list->tail)
+		list->tail = node;
+	list->len++;
+}
+
+static void move_to(struct tlfu *c, struct tlfu_node *node, enum tlfu_segment segment)
+{
+	list_unlink(&c->seg[node->segment], node);
+	node->segment = segment;
+	list_push(&c->seg[segment], node);
+}
+
+static uint8_t *counter(const struct tlfu *c, unsigned int row, uint32_t hash)
+{
+	return &c->sketch[((size_t)row << (32 - c->shift)) +
+			  ((uint32_t)(hash * sketch_seeds[row]) >> c->shift)];
+}
+
+int tlfu_init(struct tlfu *c, size_t capacity)
+{
+	size_t width = 16;
+
+	memset(c, 0, sizeof(*c));
+	if (!capacity)
+		capacity = 1;
+
+	c->window_max = capacity / 100 ? capacity / 100 : 1;
+	c->main_max = capacity - c->window_max;
+	c->protected_max = c->main_max * 4 / 5;
+
+	// About one counter per row for each item
+	for (c->shift = 28; width < capacity && c->shift > 1; c->shift--)
+		width *= 2;
+	c->sketch = calloc(TLFU_SKETCH_DEPTH, width);
+	c->sample = capacity * TLFU_SAMPLE_FACTOR;
+
+	return c->sketch ? 0 : -1;
+}
+
+void tlfu_free(struct tlfu *c)
+{
+	free(c->sketch);
+	c->sketch = NULL;
+}
+
+void tlfu_record(struct tlfu *c, uint32_t hash)
+{
+	size_t i, size;
+	unsigned int row;
+	uint8_t *count;
+
+	for (row = 0; row < TLFU_SKETCH_DEPTH; row++) {
+		count = counter(c, row, hash);
+		if (*count < TLFU_COUNTER_MAX)
+			(*count)++;
+	}
+
+	// Aging: halving every counter lets old favourites fade out
+	if (++c->additions < c->sample)
+		return;
+	size = (size_t)TLFU_SKETCH_DEPTH << (32 - c->shift);
+	for (i = 0; i < size; i++)
+		c->sketch[i] >>= 1;
+	c->additions /= 2;
+}
+
+unsigned int tlfu_frequency(const struct tlfu *c, uint32_t hash)
+{
+	unsigned int row, freq = TLFU_COUNTER_MAX, n;
+
+	for (row = 0; row < TLFU_SKETCH_DEPTH; row++) {
+		n = *counter(c, row, hash);
+		if (n < freq)
+			freq = n;
+	}
+
+	return freq;
+}
+
+struct tlfu_node *tlfu_admit(struct tlfu *c, struct tlfu_node *node)
+{
+	struct tlfu_node *candidate, *victim;
+
+	node->segment = TLFU_WINDOW;
+	list_push(&c->seg[TLFU_WINDOW], node);
+	if (c->seg[TLFU_WINDOW].len <= c->window_max)
+		return NULL;
+
+	// What leaves the window goes on probation while there is room
+	candidate = c->seg[TLFU_WINDOW].tail;
+	move_to(c, candidate, TLFU_PROBATION);
+	if (c->seg[TLFU_PROBATION].len + c->seg[TLFU_PROTECTED].len <= c->main_max)
+		return NULL;
+
+	victim = c->seg[TLFU_PROBATION].tail;
+	if (victim == candidate)
+		victim = c->seg[TLFU_PROTECTED].tail;
+	if (!victim)
+		return candidate;
+
+	// Ties keep the incumbent, so a sweep of new names cannot push it out
+	return tlfu_frequency(c, candidate->hash) > tlfu_frequency(c, victim->hash) ?
+	       victim : candidate;
+}
+
+void tlfu_hit(struct tlfu *c, struct tlfu_node *node)
+{
+	struct tlfu_list *hot = &c->seg[TLFU_PROTECTED];
+
+	if (node->segment != TLFU_PROBATION) {
+		move_to(c, node, node->segment);
+		return;
+	}
+
+	move_to(c, node, TLFU_PROTECTED);
+	// The protected segment overflows back into probation
+	if (hot->len > c->protected_max)
+		move_to(c, hot->tail, TLFU_PROBATION);
+}
+
+void tlfu_remove(struct tlfu *c, struct tlfu_node *node)
+{
+	list_unlink(&c->seg[node->segment], node);
+}
+
+struct tlfu_node *tlfu_colder(const struct tlfu *c, const struct tlfu_node *node)
+{
+	int segment;
+
+	if (node && node->prev)
+		return node->prev;
+
+	for (segment = node ? (int)node->segment + 1 : 0; segment < TLFU_SEGMENTS; segment++)
+		if (c->seg[segment].tail)
+			return c->seg[segment].tail;
+
+	return NULL;
+}
+
+struct tlfu_node *tlfu_hotter(const struct tlfu *c, const struct tlfu_node *node)
+{
+	int segment;
+
+	if (node && node->next)
+		return node->next;
+
+	for (segment = node ? (int)node->segment - 1 : TLFU_SEGMENTS - 1; segment >= 0; segment--)
+		if (c->seg[segment].head)
+			return c->seg[segment].head;
+
+	return NULL;
+}
@@ -0,0 +1,98 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef TINYLFU_H_
+#define TINYLFU_H_	1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Rows of the count-min sketch, each indexed by its own hash */
+#define TLFU_SKETCH_DEPTH	4
+/* Counters saturate here, like the 4-bit ones of the original design */
+#define TLFU_COUNTER_MAX	15
+/* Counters are halved after this many accesses per cached item */
+#define TLFU_SAMPLE_FACTOR	10
+
+/* Segments of the cache, in eviction order: coldest first */
+enum tlfu_segment {
+	/* main area, admitted but not hit since */
+	TLFU_PROBATION,
+	/* newest items, about 1% of the capacity */
+	TLFU_WINDOW,
+	/* main area, hit at least once after admission; 80% of it */
+	TLFU_PROTECTED,
+	TLFU_SEGMENTS
+};
+
+/* Embedded in each cached item */
+struct tlfu_node {
+	struct tlfu_node *prev;
+	struct tlfu_node *next;
+	uint32_t hash;
+	enum tlfu_segment segment;
+};
+
+/* Most recently used first */
+struct tlfu_list {
+	struct tlfu_node *head;
+	struct tlfu_node *tail;
+	size_t len;
+};
+
+/*
+ * W-TinyLFU: a small LRU window in front of a segmented LRU, with a
+ * frequency sketch deciding whether what leaves the window may replace
+ * the coldest item of the main area. One-off sweeps pass through the
+ * window without flushing the items that are used repeatedly.
+ */
+struct tlfu {
+	struct tlfu_list seg[TLFU_SEGMENTS];
+	size_t window_max;
+	size_t main_max;
+	size_t protected_max;
+	/* TLFU_SKETCH_DEPTH rows of 1 << (32 - shift) counters */
+	uint8_t *sketch;
+	unsigned int shift;
+	size_t additions;
+	size_t sample;
+};
+
+/* Size the segments and the sketch for capacity items (at least 1) */
+int tlfu_init(struct tlfu *c, size_t capacity);
+void tlfu_free(struct tlfu *c);
+
+/* Count an access to hash, whether it hits or not */
+void tlfu_record(struct tlfu *c, uint32_t hash);
+
+/* Estimated recent accesses to hash, at most TLFU_COUNTER_MAX */
+unsigned int tlfu_frequency(const struct tlfu *c, uint32_t hash);
+
+/*
+ * Insert a new item, node->hash set. Returns the item to evict, either
+ * the one leaving the window or the victim it beat, or NULL while the
+ * cache is not full. The caller removes it with tlfu_remove().
+ */
+struct tlfu_node *tlfu_admit(struct tlfu *c, struct tlfu_node *node);
+
+/* Move an item hit again up its segment, promoting probation to protected */
+void tlfu_hit(struct tlfu *c, struct tlfu_node *node);
+
+void tlfu_remove(struct tlfu *c, struct tlfu_node *node);
+
+/*
+ * Walk the items: tlfu_colder() in eviction order, tlfu_hotter() in the
+ * opposite one, starting from NULL. To remove items on the way, fetch
+ * the next one first.
+ */
+struct tlfu_node *tlfu_colder(const struct tlfu *c, const struct tlfu_node *node);
+struct tlfu_node *tlfu_hotter(const struct tlfu *c, const struct tlfu_node *node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TINYLFU_H_ */
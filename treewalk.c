@@ -0,0 +1,239 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "treewalk.h"
+
+/*
+ * A directory waiting to be read, relative to the root it was found
+ * under: empty for the root, else ending with a slash
+ */
+struct walk_dir {
+	int root_fd;
+	char *path;
+};
+
+/* Directories shared by the walk threads, read depth first */
+struct walk_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct walk_dir *dirs;
+	size_t len;
+	size_t size;
+	/* queued or being read; the walk is over when it drops to 0 */
+	size_t pending;
+	treewalk_fn fn;
+	void *arg;
+	struct treewalk_stats stats;
+};
+
+// Function to queue a directory, called with the lock held
+static int queue_push(struct walk_queue *q, int root_fd, const char *path)
+{
+	struct walk_dir *dirs;
+	size_t size;
+	char *copy;
+
+	if (q->len == q->size) {
+		size = q->size ? q->size * 2 : 64;
+		dirs = realloc(q->dirs, size * sizeof(*dirs));
+		if (!dirs)
+			return -1;
+		q->dirs = dirs;
+		q->size = size;
+	}
+	copy = strdup(path);
+	if (!copy)
+		return -1;
+
+	q->dirs[q->len].root_fd = root_fd;
+	q->dirs[q->len].path = copy;
+	q->len++;
+	q->pending++;
+	pthread_cond_signal(&q->cond);
+
+	return 0;
+}
+
+static void stat_from_statx(struct stat *st, const struct statx *stx)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_size = stx->stx_size;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+// Function to read one directory, queueing the ones found in it
+static void walk_dir(struct walk_queue *q, const struct walk_dir *dir)
+{
+	char buf[32768] __attribute__((aligned(__alignof__(struct dirent64))));
+	unsigned long files = 0, errors = 0;
+	unsigned long long bytes = 0;
+	const struct dirent64 *de;
+	char name[PATH_MAX];
+	struct statx stx;
+	struct stat st;
+	ssize_t n, pos;
+	int fd, len;
+
+	fd = openat(dir->root_fd, dir->path[0] ? dir->path : ".",
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		pthread_mutex_lock(&q->lock);
+		q->stats.errors++;
+		pthread_mutex_unlock(&q->lock);
+		return;
+	}
+
+	while ((n = getdents64(fd, buf, sizeof(buf))) > 0) {
+		for (pos = 0; pos < n; pos += de->d_reclen) {
+			de = (const struct dirent64 *)(buf + pos);
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+
+			// Symlinks are not followed, they may lead anywhere
+			if (statx(fd, de->d_name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+				  STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME,
+				  &stx) < 0) {
+				errors++;
+				continue;
+			}
+
+			len = snprintf(name, sizeof(name), "%s%s%s", dir->path, de->d_name,
+				       S_ISDIR(stx.stx_mode) ? "/" : "");
+			if (len < 0 || (size_t)len >= sizeof(name)) {
+				errors++;
+				continue;
+			}
+
+			if (!S_ISDIR(stx.stx_mode)) {
+				files++;
+				bytes += stx.stx_size;
+				if (q->fn) {
+					stat_from_statx(&st, &stx);
+					q->fn(fd, de->d_name, name, &st, q->arg);
+				}
+				continue;
+			}
+
+			pthread_mutex_lock(&q->lock);
+			if (queue_push(q, dir->root_fd, name) < 0)
+				q->stats.errors++;
+			pthread_mutex_unlock(&q->lock);
+		}
+	}
+	if (n < 0)
+		errors++;
+	close(fd);
+
+	pthread_mutex_lock(&q->lock);
+	q->stats.dirs++;
+	q->stats.files += files;
+	q->stats.bytes += bytes;
+	q->stats.errors += errors;
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void *walk_worker(void *arg)
+{
+	struct walk_queue *q = arg;
+	struct walk_dir dir;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (!q->len && q->pending)
+			pthread_cond_wait(&q->cond, &q->lock);
+		if (!q->len)
+			break;
+		dir = q->dirs[--q->len];
+		pthread_mutex_unlock(&q->lock);
+
+		walk_dir(q, &dir);
+		free(dir.path);
+
+		pthread_mutex_lock(&q->lock);
+		// The last directory read wakes the idle threads up to leave
+		if (--q->pending == 0)
+			pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+// Function to check whether an earlier site has the same root directory
+static int root_seen(const struct site *sites, const struct site *site)
+{
+	struct stat st, prev;
+	const struct site *s;
+
+	if (fstat(site->root_fd, &st) < 0)
+		return 1;
+	for (s = sites; s != site; s = s->next)
+		if (fstat(s->root_fd, &prev) == 0 &&
+		    prev.st_dev == st.st_dev && prev.st_ino == st.st_ino)
+			return 1;
+
+	return 0;
+}
+
+int treewalk(const struct site *sites, treewalk_fn fn, void *arg, struct treewalk_stats *stats)
+{
+	pthread_t threads[TREEWALK_MAX_THREADS];
+	struct walk_queue q;
+	struct timespec start, end;
+	const struct site *site;
+	long nthreads, started, i;
+
+	memset(&q, 0, sizeof(q));
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.cond, NULL);
+	q.fn = fn;
+	q.arg = arg;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (site = sites; site; site = site->next)
+		if (!root_seen(sites, site) && queue_push(&q, site->root_fd, "") < 0)
+			q.stats.errors++;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > TREEWALK_MAX_THREADS)
+		nthreads = TREEWALK_MAX_THREADS;
+	for (started = 0; started < nthreads; started++)
+		if (pthread_create(&threads[started], NULL, walk_worker, &q) != 0)
+			break;
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	// Without threads the queued directories were never read
+	for (i = 0; i < (long)q.len; i++)
+		free(q.dirs[i].path);
+	free(q.dirs);
+	pthread_cond_destroy(&q.cond);
+	pthread_mutex_destroy(&q.lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	q.stats.ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+	if (stats)
+		*stats = q.stats;
+
+	return started ? 0 : -1;
+}
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef TREEWALK_H_
+#define TREEWALK_H_	1
+
+#include <sys/stat.h>
+
+#include "vhost.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Most threads walking the site trees */
+#define TREEWALK_MAX_THREADS	8
+
+/*
+ * Called for every entry that is not a directory, from any of the walk
+ * threads: dirfd is the directory it is in, entry its name there, name
+ * its path relative to the site root, as the descriptor cache names it.
+ */
+typedef void (*treewalk_fn)(int dirfd, const char *entry, const char *name,
+			    const struct stat *st, void *arg);
+
+struct treewalk_stats {
+	unsigned long dirs;
+	unsigned long files;
+	unsigned long long bytes;
+	/* entries and subtrees skipped because they could not be read */
+	unsigned long errors;
+	long ms;
+};
+
+/*
+ * Walk the tree below every site root on up to TREEWALK_MAX_THREADS
+ * threads, reading directories with getdents64() and every entry with
+ * statx(). Roots shared by several sites are walked once, symlinks are
+ * not followed, and a directory that cannot be read is skipped with
+ * what is below it. fn may be NULL. Returns 0, or -1 if no thread could
+ * be started.
+ */
+int treewalk(const struct site *sites, treewalk_fn fn, void *arg, struct treewalk_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TREEWALK_H_ */
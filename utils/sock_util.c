@@ -10,6 +10,7 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -59,10 +60,11 @@ int tcp_close_connection(int sockfd)
 }
 
 /*
- * Create a server socket.
+ * Create a server socket bound to port, for the caller to set options on
+ * before it calls listen(2) with the backlog of its socket profile.
  */
 
-int tcp_create_listener(unsigned short port, int backlog)
+int tcp_bind_listener(unsigned short port)
 {
 	struct sockaddr_in address;
 	int listenfd;
@@ -85,12 +87,20 @@ int tcp_create_listener(unsigned short port, int backlog)
 	rc = bind(listenfd, (SSA *) &address, sizeof(address));
 	DIE(rc < 0, "bind");
 
-	rc = listen(listenfd, backlog);
-	DIE(rc < 0, "listen");
-
 	return listenfd;
 }
 
+/*
+ * Bound the bytes written to sockfd that the kernel holds without having
+ * sent them; the socket is only writable again once fewer are queued.
+ */
+
+int tcp_set_notsent_lowat(int sockfd, unsigned int bytes)
+{
+	return setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+			  &bytes, sizeof(bytes));
+}
+
 /*
  * Use getpeername(2) to extract remote peer address. Fill buffer with
  * address format IP_address:port (e.g. 192.168.0.1:22).
@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vhost.h"
+
+#define VHOST_MIN_SLOTS		16
+
+// FNV-1a, host names are short and already lower case
+static uint32_t vhost_hash(const char *name, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * Function to bring a Host value to its lookup form: lower case, without
+ * the port and the trailing dot. Returns the length or -1 if invalid.
+ */
+static int vhost_normalize(const char *host, size_t len, char *out)
+{
+	const char *end;
+	size_t i;
+
+	if (len && host[0] == '[') {
+		// IPv6 literal, the port follows the closing bracket
+		end = memchr(host, ']', len);
+		if (!end)
+			return -1;
+		len = end - host + 1;
+	} else {
+		end = memchr(host, ':', len);
+		if (end)
+			len = end - host;
+		if (len && host[len - 1] == '.')
+			len--;
+	}
+
+	if (len == 0 || len > VHOST_MAX_NAME)
+		return -1;
+
+	for (i = 0; i < len; i++)
+		out[i] = tolower((unsigned char)host[i]);
+	out[len] = '\0';
+
+	return len;
+}
+
+void vhost_table_init(struct vhost_table *table)
+{
+	memset(table, 0, sizeof(*table));
+}
+
+void vhost_table_free(struct vhost_table *table)
+{
+	size_t i;
+
+	if (table->slots)
+		for (i = 0; i <= table->mask; i++)
+			free(table->slots[i].name);
+	free(table->slots);
+	vhost_table_init(table);
+}
+
+static struct vhost_entry *vhost_probe(const struct vhost_table *table, const char *name,
+				       size_t len, uint32_t hash)
+{
+	struct vhost_entry *entry;
+	size_t i;
+
+	if (!table->slots)
+		return NULL;
+
+	// Linear probing; the table is at most half full so an empty slot ends the chain
+	for (i = hash & table->mask;; i = (i + 1) & table->mask) {
+		entry = &table->slots[i];
+		if (!entry->name || (entry->hash == hash && entry->len == len &&
+				     !memcmp(entry->name, name, len)))
+			return entry;
+	}
+}
+
+static int vhost_grow(struct vhost_table *table)
+{
+	struct vhost_table grown = *table;
+	size_t nslots = table->slots ? (table->mask + 1) * 2 : VHOST_MIN_SLOTS;
+	size_t i;
+
+	grown.slots = calloc(nslots, sizeof(*grown.slots));
+	if (!grown.slots)
+		return -1;
+	grown.mask = nslots - 1;
+
+	if (table->slots) {
+		for (i = 0; i <= table->mask; i++) {
+			struct vhost_entry *old = &table->slots[i];
+
+			if (old->name)
+				*vhost_probe(&grown, old->name, old->len, old->hash) = *old;
+		}
+		free(table->slots);
+	}
+	*table = grown;
+
+	return 0;
+}
+
+int vhost_add(struct vhost_table *table, const char *name, struct site *site)
+{
+	char key[VHOST_MAX_NAME + 1];
+	struct vhost_entry *entry;
+	uint32_t hash;
+	int len;
+
+	len = vhost_normalize(name, strlen(name), key);
+	if (len < 0)
+		return -1;
+
+	// A wildcard is only allowed as the whole first label
+	if (strchr(key + 1, '*') || (key[0] == '*' && (len < 3 || key[1] != '.')))
+		return -1;
+
+	if ((table->count + 1) * 2 > (table->slots ? table->mask + 1 : 0) &&
+	    vhost_grow(table) < 0)
+		return -1;
+
+	hash = vhost_hash(key, len);
+	entry = vhost_probe(table, key, len, hash);
+	if (entry->name)
+		return -1;
+
+	entry->name = strdup(key);
+	if (!entry->name)
+		return -1;
+	entry->len = len;
+	entry->hash = hash;
+	entry->site = site;
+	table->count++;
+
+	return 0;
+}
+
+struct site *vhost_lookup(const struct vhost_table *table, const char *host, size_t len)
+{
+	char key[VHOST_MAX_NAME + 1];
+	struct vhost_entry *entry;
+	char *dot;
+	int n;
+
+	n = vhost_normalize(host, len, key);
+	if (n < 0 || !table->count)
+		return table->default_site;
+
+	entry = vhost_probe(table, key, n, vhost_hash(key, n));
+	if (entry->name)
+		return entry->site;
+
+	// "a.example.com" becomes "*.example.com" by overwriting the end of its first label
+	dot = strchr(key, '.');
+	if (dot && dot > key && dot[1]) {
+		dot[-1] = '*';
+		n -= dot - 1 - key;
+		entry = vhost_probe(table, dot - 1, n, vhost_hash(dot - 1, n));
+		if (entry->name)
+			return entry->site;
+	}
+
+	return table->default_site;
+}
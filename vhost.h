@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef VHOST_H_
+#define VHOST_H_	1
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "router.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Longest host name accepted in a Host header (RFC 1035 limit) */
+#define VHOST_MAX_NAME		255
+
+/* A site served under one or more host names */
+struct site {
+	/* always ends with '/' */
+	char document_root[PATH_MAX];
+	/* file names of the routes are opened relative to this directory */
+	int root_fd;
+	struct router router;
+	struct site *next;
+};
+
+struct vhost_entry {
+	/* lower case; wildcards are stored as "*.example.com" */
+	char *name;
+	size_t len;
+	uint32_t hash;
+	struct site *site;
+};
+
+/* Open addressing hash table from host name to site */
+struct vhost_table {
+	struct vhost_entry *slots;
+	size_t mask;
+	size_t count;
+	/* answers hosts that match no name, may be NULL */
+	struct site *default_site;
+};
+
+void vhost_table_init(struct vhost_table *table);
+void vhost_table_free(struct vhost_table *table);
+
+/*
+ * Serve site under name, either a host name or "*.domain" for the direct
+ * subdomains of domain. Returns -1 if name is invalid or already taken.
+ */
+int vhost_add(struct vhost_table *table, const char *name, struct site *site);
+
+/*
+ * Site for a Host header value (port and trailing dot are ignored). Exact
+ * names cost one probe; a miss probes the wildcard of the parent domain,
+ * then falls back to the default site.
+ */
+struct site *vhost_lookup(const struct vhost_table *table, const char *host, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VHOST_H_ */
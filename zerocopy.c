@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+/* after <time.h>, it uses struct timespec */
+#include <linux/errqueue.h>
+
+#include "zerocopy.h"
+
+int zerocopy_enable(int sockfd)
+{
+	int one = 1;
+
+	return setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+}
+
+ssize_t zerocopy_send(int sockfd, const void *buf, size_t len)
+{
+	return send(sockfd, buf, len, MSG_ZEROCOPY | MSG_NOSIGNAL);
+}
+
+struct zerocopy_ring *zerocopy_ring_new(void)
+{
+	struct zerocopy_ring *ring;
+	char *mem;
+	int i;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+	// One block, so a ring costs a single allocation
+	mem = malloc((size_t)ZEROCOPY_RING_BUFS * ZEROCOPY_CHUNK);
+	if (!mem) {
+		free(ring);
+		return NULL;
+	}
+	for (i = 0; i < ZEROCOPY_RING_BUFS; i++)
+		ring->buf[i] = mem + (size_t)i * ZEROCOPY_CHUNK;
+
+	return ring;
+}
+
+void zerocopy_ring_free(struct zerocopy_ring *ring)
+{
+	if (!ring)
+		return;
+	free(ring->buf[0]);
+	free(ring);
+}
+
+char *zerocopy_ring_buf(struct zerocopy_ring *ring)
+{
+	unsigned int i = ring->head;
+
+	return ring->pending[i] ? NULL : ring->buf[i];
+}
+
+void zerocopy_ring_sent(struct zerocopy_ring *ring)
+{
+	unsigned int i = ring->head;
+
+	// Ids only need tracking from the oldest send still held
+	if (!ring->pending[i]) {
+		ring->first_id[i] = ring->next_id;
+		ring->sent[i] = 0;
+	}
+	ring->sent[i]++;
+	ring->pending[i]++;
+	ring->next_id++;
+}
+
+void zerocopy_ring_next(struct zerocopy_ring *ring)
+{
+	ring->head = (ring->head + 1) % ZEROCOPY_RING_BUFS;
+}
+
+unsigned long zerocopy_ring_pending(const struct zerocopy_ring *ring)
+{
+	unsigned long n = 0;
+	int i;
+
+	for (i = 0; i < ZEROCOPY_RING_BUFS; i++)
+		n += ring->pending[i];
+
+	return n;
+}
+
+// Function to release the sends lo to hi of the buffers that made them
+static void ring_release(struct zerocopy_ring *ring, uint32_t lo, uint32_t hi)
+{
+	uint32_t first, last;
+	int i;
+
+	for (i = 0; i < ZEROCOPY_RING_BUFS; i++) {
+		if (!ring->pending[i])
+			continue;
+		// The sends of a buffer have consecutive ids
+		first = ring->first_id[i];
+		last = first + ring->sent[i] - 1;
+		if (hi < first || lo > last)
+			continue;
+		if (lo > first)
+			first = lo;
+		if (hi < last)
+			last = hi;
+		if (last - first + 1 >= ring->pending[i])
+			ring->pending[i] = 0;
+		else
+			ring->pending[i] -= last - first + 1;
+	}
+}
+
+long zerocopy_reap(int sockfd, unsigned long *copied, struct zerocopy_ring *ring)
+{
+	char control[128];
+	struct sock_extended_err *serr;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	uint32_t range;
+	long done = 0;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(sockfd, &msg, MSG_ERRQUEUE) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno)
+				continue;
+
+			// One notification covers the ids ee_info to ee_data
+			range = serr->ee_data - serr->ee_info + 1;
+			done += range;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				*copied += range;
+			if (!ring)
+				continue;
+			ring_release(ring, serr->ee_info, serr->ee_data);
+			// Pinning gains nothing on a route the kernel copies on
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				ring->copy = 1;
+		}
+	}
+
+	return done;
+}
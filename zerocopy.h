@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef ZEROCOPY_H_
+#define ZEROCOPY_H_	1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * MSG_ZEROCOPY sends (Linux 4.14+). The kernel pins the pages of the
+ * buffer instead of copying them, so the buffer must stay unchanged and
+ * referenced until the completion notification for the send is read from
+ * the socket error queue.
+ */
+
+/* Buffers of a zerocopy ring, and the bytes read into each at most */
+#define ZEROCOPY_RING_BUFS	4
+#define ZEROCOPY_CHUNK		(64 << 10)
+
+/*
+ * Buffers filled and sent one after the other with MSG_ZEROCOPY, for data
+ * that is not already in stable pages. A buffer is refilled only once the
+ * kernel released every send made from it, so a reply can keep a few
+ * chunks in flight while it reads the next one.
+ */
+struct zerocopy_ring {
+	char *buf[ZEROCOPY_RING_BUFS];
+	/* id of the first send from each buffer, sends made, sends not released */
+	uint32_t first_id[ZEROCOPY_RING_BUFS];
+	unsigned int sent[ZEROCOPY_RING_BUFS];
+	unsigned int pending[ZEROCOPY_RING_BUFS];
+	/* buffer being filled or sent */
+	unsigned int head;
+	/* notification id the next MSG_ZEROCOPY send of the socket takes */
+	uint32_t next_id;
+	/* the kernel copied a send: the rest goes out with plain send() */
+	int copy;
+};
+
+/* Allocate a ring and its buffers. Returns NULL if out of memory. */
+struct zerocopy_ring *zerocopy_ring_new(void);
+void zerocopy_ring_free(struct zerocopy_ring *ring);
+
+/* Buffer at the head of the ring, or NULL while the kernel still holds it */
+char *zerocopy_ring_buf(struct zerocopy_ring *ring);
+
+/* Account a successful zerocopy_send() from the head buffer */
+void zerocopy_ring_sent(struct zerocopy_ring *ring);
+
+/* Move to the next buffer once the head one is sent */
+void zerocopy_ring_next(struct zerocopy_ring *ring);
+
+/* Sends from the ring the kernel has not released yet */
+unsigned long zerocopy_ring_pending(const struct zerocopy_ring *ring);
+
+/* Turn SO_ZEROCOPY on for a socket. Returns 0, or -1 if unsupported. */
+int zerocopy_enable(int sockfd);
+
+/*
+ * send() with MSG_ZEROCOPY. Every call that returns >= 0 takes the next
+ * notification id of the socket, so the caller counts them to know how
+ * many completions to wait for.
+ */
+ssize_t zerocopy_send(int sockfd, const void *buf, size_t len);
+
+/*
+ * Read the completion notifications queued on sockfd. Returns the number
+ * of sends they cover, or -1 on error; *copied is increased by those the
+ * kernel ended up copying anyway (e.g. over loopback). When ring is not
+ * NULL, the buffers the notifications cover are released and a copied
+ * send switches the ring to copy mode.
+ */
+long zerocopy_reap(int sockfd, unsigned long *copied, struct zerocopy_ring *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZEROCOPY_H_ */